@@ -0,0 +1,143 @@
+#ifndef MATRIX_EXPRESSION_H
+#define MATRIX_EXPRESSION_H
+
+// Lazy elementwise arithmetic. a + b, a - b, a.hadamard(b) and a op scalar don't compute anything:
+// they return a small expression object holding (references to) their operands, and a chain of
+// them nests into one type. The work happens when the expression is assigned to a Matrix, in a
+// single loop over the rows where every element is computed straight from the leaves, so
+// `r = a + b * 2.0 - c.hadamard(d)` makes one pass over memory and allocates at most once.
+//
+// Expressions refer to their Matrix operands, so don't keep one (e.g. in an `auto`) past the
+// statement that builds it; assign it to a Matrix instead.
+
+#include <functional>
+#include <type_traits>
+
+void warn(const char* func, const char* message);
+
+// Matrix<T> is sized at runtime; Matrix<T, R, C> is fixed at compile time (see fixed.h).
+constexpr unsigned int MATRIX_DYNAMIC = 0;
+template <typename T, unsigned int R = MATRIX_DYNAMIC, unsigned int C = MATRIX_DYNAMIC> class Matrix;
+
+template <typename T> class MatrixView;
+
+template <typename L, typename R, typename Op> class MatrixBinaryExpr;
+template <typename E, typename Op> class MatrixScalarExpr;
+
+// Matrix leaves are held by reference, intermediate expressions by value.
+template <typename E>
+using matrix_expr_ref = std::conditional_t<E::is_matrix, const E&, const E>;
+
+// Operands with elements in memory, row i at data() + i * stride(): Matrix<T> and MatrixView<T>
+template <typename E> struct matrix_is_strided : std::false_type {};
+template <typename T> struct matrix_is_strided<Matrix<T>> : std::true_type {};
+template <typename T> struct matrix_is_strided<MatrixView<T>> : std::true_type {};
+
+// Expressions whose element (i, j) reads only element (i, j) of each Matrix leaf, so they can be
+// evaluated into a Matrix they refer to. Views may be offset into it and concatenations and
+// Kronecker products read other elements, so those aren't.
+template <typename E> struct matrix_is_elementwise : std::false_type {};
+template <typename T> struct matrix_is_elementwise<Matrix<T>> : std::true_type {};
+template <typename L, typename R, typename Op> struct matrix_is_elementwise<MatrixBinaryExpr<L, R, Op>> :
+    std::bool_constant<matrix_is_elementwise<L>::value && matrix_is_elementwise<R>::value> {};
+template <typename E, typename Op> struct matrix_is_elementwise<MatrixScalarExpr<E, Op>> : matrix_is_elementwise<E> {};
+
+// Base of Matrix and of every expression type, so the operators below accept any of them.
+// Expressions provide value_type, rows(), cols() and row_fn(i), which returns a callable giving
+// element j of row i.
+template <typename E> class MatrixExpr {
+    public:
+        const E& self() const { return static_cast<const E&>(*this); }
+
+        template <typename R>
+        MatrixBinaryExpr<E, R, std::multiplies<>> hadamard(const MatrixExpr<R>& rhs) const {
+            return {self(), rhs.self(), "Matrix::hadamard"};
+        }
+};
+
+template <typename L, typename R, typename Op>
+class MatrixBinaryExpr : public MatrixExpr<MatrixBinaryExpr<L, R, Op>> {
+    private:
+        matrix_expr_ref<L> m_lhs;
+        matrix_expr_ref<R> m_rhs;
+    public:
+        using value_type = typename L::value_type;
+        static constexpr bool is_matrix = false;
+
+        MatrixBinaryExpr(const L& lhs, const R& rhs, const char* func): m_lhs(lhs), m_rhs(rhs) {
+            if (lhs.rows() != rhs.rows())
+                warn(func, "Inconsistent number of rows");
+            if (lhs.cols() != rhs.cols())
+                warn(func, "Inconsistent number of cols");
+        }
+
+        unsigned int rows() const { return m_lhs.rows(); }
+        unsigned int cols() const { return m_lhs.cols(); }
+        auto row_fn(unsigned int i) const {
+            return [lhs = m_lhs.row_fn(i), rhs = m_rhs.row_fn(i)](unsigned int j) -> value_type {
+                return Op()(lhs(j), rhs(j));
+            };
+        }
+};
+
+template <typename E, typename Op>
+class MatrixScalarExpr : public MatrixExpr<MatrixScalarExpr<E, Op>> {
+    public:
+        using value_type = typename E::value_type;
+    private:
+        matrix_expr_ref<E> m_expr;
+        value_type m_scalar;
+    public:
+        static constexpr bool is_matrix = false;
+
+        MatrixScalarExpr(const E& expr, const value_type& scalar): m_expr(expr), m_scalar(scalar) {}
+
+        unsigned int rows() const { return m_expr.rows(); }
+        unsigned int cols() const { return m_expr.cols(); }
+        auto row_fn(unsigned int i) const {
+            return [row = m_expr.row_fn(i), scalar = m_scalar](unsigned int j) -> value_type {
+                return Op()(row(j), scalar);
+            };
+        }
+};
+
+template <typename L, typename R>
+MatrixBinaryExpr<L, R, std::plus<>> operator+(const MatrixExpr<L>& lhs, const MatrixExpr<R>& rhs) {
+    return {lhs.self(), rhs.self(), "Matrix::operator+"};
+}
+
+template <typename L, typename R>
+MatrixBinaryExpr<L, R, std::minus<>> operator-(const MatrixExpr<L>& lhs, const MatrixExpr<R>& rhs) {
+    return {lhs.self(), rhs.self(), "Matrix::operator-"};
+}
+
+// Scalar operations
+#define do_op(op, functor) \
+template <typename E> \
+MatrixScalarExpr<E, functor> operator op (const MatrixExpr<E>& lhs, const typename E::value_type& rhs) { \
+    return {lhs.self(), rhs}; \
+}
+do_op(+, std::plus<>);
+do_op(-, std::minus<>);
+do_op(*, std::multiplies<>);
+do_op(/, std::divides<>);
+#undef do_op
+
+// Something a product can read directly: a reference to a Matrix leaf, a view, or a freshly
+// evaluated Matrix.
+template <typename E>
+decltype(auto) evaluate(const MatrixExpr<E>& expr) {
+    if constexpr (matrix_is_strided<E>::value)
+        return expr.self();
+    else
+        return Matrix<typename E::value_type>(expr);
+}
+
+// Matrix products of expressions evaluate the expressions first; Matrix * Matrix is a member, and
+// strided_product (view.h) multiplies anything else straight out of memory.
+template <typename L, typename R>
+auto operator*(const MatrixExpr<L>& lhs, const MatrixExpr<R>& rhs) {
+    return strided_product(evaluate(lhs), evaluate(rhs));
+}
+
+#endif
@@ -0,0 +1,448 @@
+#ifndef FACTOR_H
+#define FACTOR_H
+
+// Dense factorizations and triangular solves on Matrix<T>: LU with partial pivoting, Cholesky
+// and Householder QR. All three are blocked the LAPACK way. A narrow panel of FACTOR_BLOCK
+// columns is factored with simple loops (it stays in cache), and its effect on the trailing
+// matrix, where almost all the flops are, is applied as one gemm call per panel. Triangular solves
+// with many right-hand sides are blocked the same way.
+//
+// Storage is row-major, so the panel loops are written to run along rows: pivot swaps exchange
+// whole rows, and every update inside a panel is a row axpy.
+
+#include <cmath>
+#include <vector>
+#include "matrix.h"
+
+// Panel width. Wide enough that the trailing gemm runs near full speed, narrow enough that the
+// panel's own (non-gemm) work stays small.
+constexpr size_t FACTOR_BLOCK = 64;
+
+// Solves L X = B in place of B (n x nrhs), with L lower triangular (unit diagonal if `unit`).
+template <typename T>
+void trsm_lower(const size_t n, const size_t nrhs, const T* l, const size_t ldl, T* b, const size_t ldb,
+                const bool unit, util::thread_pool* pool = nullptr, const size_t block = FACTOR_BLOCK) {
+    for (size_t k = 0; k < n; k += block) {
+        const size_t nb = std::min(block, n - k);
+        for (size_t i = k; i < k + nb; ++i) {
+            T* bi = b + i * ldb;
+            for (size_t p = k; p < i; ++p) {
+                const T factor = l[i * ldl + p];
+                const T* bp = b + p * ldb;
+                for (size_t j = 0; j < nrhs; ++j) bi[j] -= factor * bp[j];
+            }
+            if (!unit) {
+                const T inv = T(1) / l[i * ldl + i];
+                for (size_t j = 0; j < nrhs; ++j) bi[j] *= inv;
+            }
+        }
+        if (k + nb < n)
+            gemm<T>(n - k - nb, nrhs, nb, T(-1), l + (k + nb) * ldl + k, ldl, b + k * ldb, ldb, T(1),
+                    b + (k + nb) * ldb, ldb, pool);
+    }
+}
+
+// Solves U X = B in place of B (n x nrhs), with U upper triangular.
+template <typename T>
+void trsm_upper(const size_t n, const size_t nrhs, const T* u, const size_t ldu, T* b, const size_t ldb,
+                util::thread_pool* pool = nullptr, const size_t block = FACTOR_BLOCK) {
+    for (size_t end = n; end > 0;) {
+        const size_t nb = std::min(block, end), k = end - nb;
+        for (size_t i = end; i-- > k;) {
+            T* bi = b + i * ldb;
+            for (size_t p = i + 1; p < end; ++p) {
+                const T factor = u[i * ldu + p];
+                const T* bp = b + p * ldb;
+                for (size_t j = 0; j < nrhs; ++j) bi[j] -= factor * bp[j];
+            }
+            const T inv = T(1) / u[i * ldu + i];
+            for (size_t j = 0; j < nrhs; ++j) bi[j] *= inv;
+        }
+        if (k > 0)
+            gemm<T>(k, nrhs, nb, T(-1), u + k, ldu, b + k * ldb, ldb, T(1), b, ldb, pool);
+        end = k;
+    }
+}
+
+// Solves L^T X = B in place of B (n x nrhs), with L lower triangular, without forming L^T. Inside
+// a block, row i of L is row i's column of L^T, so each solved row is a row axpy into the rows above
+// it; the rows above the block take one gemm against the block's rows of L, transposed per block.
+template <typename T>
+void trsm_lower_transpose(const size_t n, const size_t nrhs, const T* l, const size_t ldl, T* b, const size_t ldb,
+                          util::thread_pool* pool = nullptr, const size_t block = FACTOR_BLOCK) {
+    for (size_t end = n; end > 0;) {
+        const size_t nb = std::min(block, end), k = end - nb;
+        for (size_t i = end; i-- > k;) {
+            T* bi = b + i * ldb;
+            const T inv = T(1) / l[i * ldl + i];
+            for (size_t j = 0; j < nrhs; ++j) bi[j] *= inv;
+            for (size_t p = k; p < i; ++p) {
+                const T factor = l[i * ldl + p];
+                T* bp = b + p * ldb;
+                for (size_t j = 0; j < nrhs; ++j) bp[j] -= factor * bi[j];
+            }
+        }
+        if (k > 0) {
+            aligned_array<T> panel = make_aligned_array<T>(k * nb);
+            transpose<T>(nb, k, l + k * ldl, ldl, panel.get(), nb);
+            gemm<T>(k, nrhs, nb, T(-1), panel.get(), nb, b + k * ldb, ldb, T(1), b, ldb, pool);
+        }
+        end = k;
+    }
+}
+
+// Forward substitution: solves L X = B for lower triangular L.
+template <typename T>
+Matrix<T> forward_substitution(const Matrix<T>& l, Matrix<T> b, bool unit = false) {
+    if (l.rows() != l.cols() || l.rows() != b.rows())
+        warn("forward_substitution", "Dimensions don't match up");
+    trsm_lower<T>(l.rows(), b.cols(), l.data(), l.stride(), b.data(), b.stride(), unit, matrix_thread_pool());
+    return b;
+}
+
+// Back substitution: solves U X = B for upper triangular U.
+template <typename T>
+Matrix<T> back_substitution(const Matrix<T>& u, Matrix<T> b) {
+    if (u.rows() != u.cols() || u.rows() != b.rows())
+        warn("back_substitution", "Dimensions don't match up");
+    trsm_upper<T>(u.rows(), b.cols(), u.data(), u.stride(), b.data(), b.stride(), matrix_thread_pool());
+    return b;
+}
+
+template <typename T>
+Matrix<T> column_matrix(const std::vector<T>& v) {
+    Matrix<T> m(v.size(), 1);
+    for (unsigned int i = 0; i < v.size(); i++)
+        m[i][0] = v[i];
+    return m;
+}
+
+template <typename T>
+std::vector<T> column_vector(const Matrix<T>& m) {
+    std::vector<T> v(m.rows());
+    for (unsigned int i = 0; i < m.rows(); i++)
+        v[i] = m[i][0];
+    return v;
+}
+
+// P A = L U, with L unit lower triangular and U upper triangular stored together in factors().
+// Row i of P A is row pivots()[i] of A.
+template <typename T> class LU {
+    private:
+        Matrix<T> m_lu;
+        std::vector<unsigned int> m_pivots;
+        int m_sign = 1;
+        bool m_singular = false;
+    public:
+        explicit LU(const Matrix<T>& a, size_t block = FACTOR_BLOCK);
+
+        // Solves A X = B
+        Matrix<T> solve(const Matrix<T>& b) const;
+        std::vector<T> solve(const std::vector<T>& b) const { return column_vector(solve(column_matrix(b))); }
+        T determinant() const;
+
+        bool singular() const { return m_singular; }
+        const Matrix<T>& factors() const { return m_lu; }
+        const std::vector<unsigned int>& pivots() const { return m_pivots; }
+};
+
+template <typename T>
+LU<T>::LU(const Matrix<T>& a, size_t block): m_lu(a), m_pivots(a.rows()) {
+    if (a.rows() != a.cols())
+        warn("LU::LU", "Matrix isn't square");
+    const size_t n = std::min(a.rows(), a.cols()), ld = m_lu.stride(), cols = m_lu.cols();
+    T* const base = m_lu.data();
+    for (unsigned int i = 0; i < a.rows(); i++)
+        m_pivots[i] = i;
+
+    for (size_t k = 0; k < n; k += block) {
+        const size_t nb = std::min(block, n - k);
+        // Panel: columns [k, k + nb), all rows from k down
+        for (size_t j = k; j < k + nb; ++j) {
+            size_t pivot = j;
+            for (size_t i = j + 1; i < m_lu.rows(); ++i)
+                if (std::abs(base[i * ld + j]) > std::abs(base[pivot * ld + j]))
+                    pivot = i;
+            if (pivot != j) {
+                std::swap_ranges(base + j * ld, base + j * ld + cols, base + pivot * ld);
+                std::swap(m_pivots[j], m_pivots[pivot]);
+                m_sign = -m_sign;
+            }
+            const T diagonal = base[j * ld + j];
+            if (diagonal == T(0)) {
+                m_singular = true;
+                continue;
+            }
+            const T* uj = base + j * ld;
+            for (size_t i = j + 1; i < m_lu.rows(); ++i) {
+                T* ri = base + i * ld;
+                const T factor = ri[j] /= diagonal;
+                for (size_t c = j + 1; c < k + nb; ++c) ri[c] -= factor * uj[c];
+            }
+        }
+        if (k + nb >= cols)
+            continue;
+        // U12 = L11^-1 A12, then A22 -= L21 U12
+        trsm_lower<T>(nb, cols - k - nb, base + k * ld + k, ld, base + k * ld + k + nb, ld, true, matrix_thread_pool(),
+                      block);
+        if (k + nb < m_lu.rows())
+            gemm<T>(m_lu.rows() - k - nb, cols - k - nb, nb, T(-1), base + (k + nb) * ld + k, ld,
+                    base + k * ld + k + nb, ld, T(1), base + (k + nb) * ld + k + nb, ld, matrix_thread_pool());
+    }
+    if (m_singular)
+        warn("LU::LU", "Matrix is singular");
+}
+
+template <typename T>
+Matrix<T> LU<T>::solve(const Matrix<T>& b) const {
+    if (b.rows() != m_lu.rows())
+        warn("LU::solve", "Number of rows don't match up");
+    Matrix<T> x(b.rows(), b.cols());
+    for (unsigned int i = 0; i < b.rows(); i++)
+        std::copy(b[m_pivots[i]], b[m_pivots[i]] + b.cols(), x[i]);
+    trsm_lower<T>(m_lu.rows(), x.cols(), m_lu.data(), m_lu.stride(), x.data(), x.stride(), true, matrix_thread_pool());
+    trsm_upper<T>(m_lu.rows(), x.cols(), m_lu.data(), m_lu.stride(), x.data(), x.stride(), matrix_thread_pool());
+    return x;
+}
+
+template <typename T>
+T LU<T>::determinant() const {
+    T det = T(m_sign);
+    for (unsigned int i = 0; i < m_lu.rows(); i++)
+        det *= m_lu[i][i];
+    return det;
+}
+
+// A = L L^T for symmetric positive definite A; only the lower triangle of A is read.
+template <typename T> class Cholesky {
+    private:
+        Matrix<T> m_l;
+        bool m_ok = true;
+    public:
+        explicit Cholesky(const Matrix<T>& a, size_t block = FACTOR_BLOCK);
+
+        // Solves A X = B
+        Matrix<T> solve(const Matrix<T>& b) const;
+        std::vector<T> solve(const std::vector<T>& b) const { return column_vector(solve(column_matrix(b))); }
+
+        // False if A turned out not to be positive definite
+        bool ok() const { return m_ok; }
+        const Matrix<T>& factor() const { return m_l; }
+};
+
+template <typename T>
+Cholesky<T>::Cholesky(const Matrix<T>& a, size_t block): m_l(a) {
+    if (a.rows() != a.cols())
+        warn("Cholesky::Cholesky", "Matrix isn't square");
+    const size_t n = a.rows(), ld = m_l.stride();
+    T* const base = m_l.data();
+
+    for (size_t k = 0; k < n && m_ok; k += block) {
+        const size_t nb = std::min(block, n - k);
+        // Panel, a column at a time: l_jj = sqrt(a_jj - sum_p l_jp^2), and below it
+        // l_ij = (a_ij - sum_p l_ip l_jp) / l_jj, with p over the panel columns left of j
+        for (size_t j = k; j < k + nb; ++j) {
+            T* lj = base + j * ld;
+            T d = lj[j];
+            for (size_t p = k; p < j; ++p) d -= lj[p] * lj[p];
+            if (!(d > T(0))) {
+                warn("Cholesky::Cholesky", "Matrix isn't positive definite");
+                m_ok = false;
+                break;
+            }
+            lj[j] = std::sqrt(d);
+            for (size_t i = j + 1; i < n; ++i) {
+                T* li = base + i * ld;
+                T s = li[j];
+                for (size_t p = k; p < j; ++p) s -= li[p] * lj[p];
+                li[j] = s / lj[j];
+            }
+        }
+        if (!m_ok)
+            break;
+        // A22 -= L21 L21^T, lower triangle only: one gemm per block of rows, against L21^T
+        if (k + nb >= n)
+            continue;
+        const size_t rest = n - k - nb;
+        aligned_array<T> l21t = make_aligned_array<T>(nb * rest);
+        transpose<T>(rest, nb, base + (k + nb) * ld + k, ld, l21t.get(), rest);
+        for (size_t i = 0; i < rest; i += block) {
+            const size_t rows = std::min(block, rest - i);
+            gemm<T>(rows, i + rows, nb, T(-1), base + (k + nb + i) * ld + k, ld, l21t.get(), rest, T(1),
+                    base + (k + nb + i) * ld + k + nb, ld, matrix_thread_pool());
+        }
+    }
+    for (size_t i = 0; i < n; ++i)
+        std::fill(base + i * ld + i + 1, base + i * ld + n, T());
+}
+
+template <typename T>
+Matrix<T> Cholesky<T>::solve(const Matrix<T>& b) const {
+    if (b.rows() != m_l.rows())
+        warn("Cholesky::solve", "Number of rows don't match up");
+    Matrix<T> x = forward_substitution(m_l, b);
+    trsm_lower_transpose<T>(m_l.rows(), x.cols(), m_l.data(), m_l.stride(), x.data(), x.stride(), matrix_thread_pool());
+    return x;
+}
+
+// A = Q R for m x n A with m >= n. R sits on and above the diagonal of factors(); below it, column
+// j holds the Householder vector v_j (with an implicit leading 1) and Q = H_0 H_1 ... H_{n-1},
+// H_j = I - tau_j v_j v_j^T. A panel's reflectors are applied to the trailing matrix at once as
+// I - V T^T V^T (the compact WY form), which is three gemm calls.
+template <typename T> class QR {
+    private:
+        Matrix<T> m_qr;
+        std::vector<T> m_tau;
+
+        // Computes the reflector for column j and applies it to columns (j, end)
+        void reflect_column(size_t j, size_t end);
+    public:
+        explicit QR(const Matrix<T>& a, size_t block = FACTOR_BLOCK);
+
+        // Least-squares solution of A X = B (exact when A is square and nonsingular)
+        Matrix<T> solve(const Matrix<T>& b) const;
+        std::vector<T> solve(const std::vector<T>& b) const { return column_vector(solve(column_matrix(b))); }
+        // Q^T B
+        Matrix<T> apply_qt(Matrix<T> b) const;
+        // The n x n upper triangular R
+        Matrix<T> r() const;
+
+        const Matrix<T>& factors() const { return m_qr; }
+        const std::vector<T>& tau() const { return m_tau; }
+};
+
+template <typename T>
+void QR<T>::reflect_column(size_t j, size_t end) {
+    const size_t m = m_qr.rows(), ld = m_qr.stride();
+    T* const base = m_qr.data();
+    T norm2 = 0;
+    for (size_t i = j + 1; i < m; ++i) norm2 += base[i * ld + j] * base[i * ld + j];
+    const T alpha = base[j * ld + j];
+    if (norm2 == T(0)) {
+        m_tau[j] = 0;
+        return;
+    }
+    const T beta = alpha > T(0) ? -std::sqrt(alpha * alpha + norm2) : std::sqrt(alpha * alpha + norm2);
+    m_tau[j] = (beta - alpha) / beta;
+    const T scale = T(1) / (alpha - beta);
+    for (size_t i = j + 1; i < m; ++i) base[i * ld + j] *= scale;
+    base[j * ld + j] = beta;
+
+    // Columns (j, end): w = v^T A, A -= tau v w, accumulated a row at a time
+    if (j + 1 >= end)
+        return;
+    std::vector<T> w(base + j * ld + j + 1, base + j * ld + end);
+    for (size_t i = j + 1; i < m; ++i) {
+        const T v = base[i * ld + j];
+        const T* row = base + i * ld + j + 1;
+        for (size_t c = 0; c < w.size(); ++c) w[c] += v * row[c];
+    }
+    for (T& x : w) x *= m_tau[j];
+    T* top = base + j * ld + j + 1;
+    for (size_t c = 0; c < w.size(); ++c) top[c] -= w[c];
+    for (size_t i = j + 1; i < m; ++i) {
+        const T v = base[i * ld + j];
+        T* row = base + i * ld + j + 1;
+        for (size_t c = 0; c < w.size(); ++c) row[c] -= v * w[c];
+    }
+}
+
+template <typename T>
+QR<T>::QR(const Matrix<T>& a, size_t block): m_qr(a), m_tau(std::min(a.rows(), a.cols())) {
+    if (a.rows() < a.cols())
+        warn("QR::QR", "Expected at least as many rows as cols");
+    const size_t m = m_qr.rows(), n = m_qr.cols(), ld = m_qr.stride(), steps = m_tau.size();
+    T* const base = m_qr.data();
+
+    for (size_t k = 0; k < steps; k += block) {
+        const size_t nb = std::min(block, steps - k);
+        for (size_t j = k; j < k + nb; ++j)
+            reflect_column(j, k + nb);
+        if (k + nb >= n)
+            continue;
+
+        // V (rows x nb, unit lower trapezoidal) and its transpose
+        const size_t rows = m - k, rest = n - k - nb;
+        aligned_array<T> v = make_aligned_array<T>(rows * nb), vt = make_aligned_array<T>(nb * rows);
+        for (size_t i = 0; i < rows; ++i)
+            for (size_t c = 0; c < nb; ++c)
+                v[i * nb + c] = i > c ? base[(k + i) * ld + k + c] : T(i == c);
+        transpose<T>(rows, nb, v.get(), nb, vt.get(), rows);
+
+        // T, upper triangular: T_jj = tau_j, T[0:j, j] = -tau_j T[0:j, 0:j] V[:, 0:j]^T v_j
+        std::vector<T> t(nb * nb, T());
+        for (size_t j = 0; j < nb; ++j) {
+            std::vector<T> dots(j, T());
+            for (size_t p = 0; p < j; ++p)
+                for (size_t i = j; i < rows; ++i)
+                    dots[p] += vt[p * rows + i] * vt[j * rows + i];
+            for (size_t p = 0; p < j; ++p) {
+                T s = 0;
+                for (size_t q = p; q < j; ++q) s += t[p * nb + q] * dots[q];
+                t[p * nb + j] = -m_tau[k + j] * s;
+            }
+            t[j * nb + j] = m_tau[k + j];
+        }
+
+        // C -= V (T^T (V^T C)) on the trailing columns
+        T* c = base + k * ld + k + nb;
+        aligned_array<T> w = make_aligned_array<T>(nb * rest), tw = make_aligned_array<T>(nb * rest);
+        gemm<T>(nb, rest, rows, T(1), vt.get(), rows, c, ld, T(0), w.get(), rest, matrix_thread_pool());
+        for (size_t i = 0; i < nb; ++i) {
+            T* out = tw.get() + i * rest;
+            std::fill(out, out + rest, T());
+            for (size_t p = 0; p <= i; ++p) {
+                const T factor = t[p * nb + i];
+                const T* in = w.get() + p * rest;
+                for (size_t col = 0; col < rest; ++col) out[col] += factor * in[col];
+            }
+        }
+        gemm<T>(rows, rest, nb, T(-1), v.get(), nb, tw.get(), rest, T(1), c, ld, matrix_thread_pool());
+    }
+}
+
+template <typename T>
+Matrix<T> QR<T>::apply_qt(Matrix<T> b) const {
+    if (b.rows() != m_qr.rows())
+        warn("QR::apply_qt", "Number of rows don't match up");
+    const size_t m = m_qr.rows(), nrhs = b.cols();
+    std::vector<T> w(nrhs);
+    for (size_t j = 0; j < m_tau.size(); ++j) {
+        if (m_tau[j] == T(0))
+            continue;
+        std::copy(b[j], b[j] + nrhs, w.begin());
+        for (size_t i = j + 1; i < m; ++i) {
+            const T v = m_qr[i][j];
+            for (size_t c = 0; c < nrhs; ++c) w[c] += v * b[i][c];
+        }
+        for (T& x : w) x *= m_tau[j];
+        for (size_t c = 0; c < nrhs; ++c) b[j][c] -= w[c];
+        for (size_t i = j + 1; i < m; ++i) {
+            const T v = m_qr[i][j];
+            for (size_t c = 0; c < nrhs; ++c) b[i][c] -= v * w[c];
+        }
+    }
+    return b;
+}
+
+template <typename T>
+Matrix<T> QR<T>::r() const {
+    const unsigned int n = m_qr.cols();
+    Matrix<T> r(std::min(n, m_qr.rows()), n);
+    for (unsigned int i = 0; i < r.rows(); i++)
+        std::copy(m_qr[i] + i, m_qr[i] + n, r[i] + i);
+    return r;
+}
+
+template <typename T>
+Matrix<T> QR<T>::solve(const Matrix<T>& b) const {
+    const Matrix<T> qtb = apply_qt(b);
+    const unsigned int n = m_qr.cols();
+    Matrix<T> x(n, b.cols());
+    for (unsigned int i = 0; i < n; i++)
+        std::copy(qtb[i], qtb[i] + b.cols(), x[i]);
+    trsm_upper<T>(n, x.cols(), m_qr.data(), m_qr.stride(), x.data(), x.stride(), matrix_thread_pool());
+    return x;
+}
+
+#endif
@@ -0,0 +1,295 @@
+#ifndef MATRIX_FIXED_H
+#define MATRIX_FIXED_H
+
+// Matrix<T, R, C>: an R x C matrix whose size is part of its type, for the small transforms
+// that Matrix<T> handles badly (a heap allocation and a virtual destructor per 3x3). Elements
+// live inline, so these go on the stack or inside other objects, copy with memcpy, and every
+// operation is constexpr. Loops have compile-time trip counts and are unrolled outright; the
+// optimizer turns the unrolled products into straight-line vector code.
+//
+// Arithmetic here is eager; there are no temporaries worth fusing at these sizes. Converting to
+// and from Matrix<T> copies.
+
+#include <array>
+
+// Unrolls the loop that follows completely, even at -O2, for the sizes this is meant for
+#define MATRIX_UNROLL _Pragma("GCC unroll 16")
+
+template <typename T, unsigned int R, unsigned int C> class Matrix {
+    static_assert(R != MATRIX_DYNAMIC && C != MATRIX_DYNAMIC, "Matrix<T, R, C> needs nonzero dimensions");
+    private:
+        T m_data[R][C];
+
+        // The 2x2 determinants of the top two rows (s) and of the bottom two rows (c), by column
+        // pair, which a 4x4 determinant and adjugate are built from
+        constexpr void minors4(T (&s)[6], T (&c)[6]) const {
+            const auto& a = m_data;
+            s[0] = a[0][0] * a[1][1] - a[1][0] * a[0][1], c[0] = a[2][0] * a[3][1] - a[3][0] * a[2][1];
+            s[1] = a[0][0] * a[1][2] - a[1][0] * a[0][2], c[1] = a[2][0] * a[3][2] - a[3][0] * a[2][2];
+            s[2] = a[0][0] * a[1][3] - a[1][0] * a[0][3], c[2] = a[2][0] * a[3][3] - a[3][0] * a[2][3];
+            s[3] = a[0][1] * a[1][2] - a[1][1] * a[0][2], c[3] = a[2][1] * a[3][2] - a[3][1] * a[2][2];
+            s[4] = a[0][1] * a[1][3] - a[1][1] * a[0][3], c[4] = a[2][1] * a[3][3] - a[3][1] * a[2][3];
+            s[5] = a[0][2] * a[1][3] - a[1][2] * a[0][3], c[5] = a[2][2] * a[3][3] - a[3][2] * a[2][3];
+        }
+    public:
+        using value_type = T;
+
+        // Zero matrix
+        constexpr Matrix(): m_data{} {}
+        // Matrix<double, 2, 2> m({{1, 2}, {3, 4}})
+        constexpr Matrix(const T (&values)[R][C]): m_data{} {
+            for (unsigned int i = 0; i < R; i++)
+                for (unsigned int j = 0; j < C; j++)
+                    m_data[i][j] = values[i][j];
+        }
+        // Copies a Matrix<T> of the same size
+        explicit Matrix(const Matrix<T>& dynamic): m_data{} {
+            if (dynamic.rows() != R || dynamic.cols() != C)
+                warn("Matrix<T, R, C>::Matrix", "Dimensions don't match, copying the overlap");
+            for (unsigned int i = 0; i < std::min(R, dynamic.rows()); i++)
+                for (unsigned int j = 0; j < std::min(C, dynamic.cols()); j++)
+                    m_data[i][j] = dynamic[i][j];
+        }
+        operator Matrix<T>() const {
+            Matrix<T> result(R, C);
+            for (unsigned int i = 0; i < R; i++)
+                for (unsigned int j = 0; j < C; j++)
+                    result[i][j] = m_data[i][j];
+            return result;
+        }
+
+        static constexpr Matrix identity() {
+            static_assert(R == C, "Only square matrices have an identity");
+            Matrix result;
+            for (unsigned int i = 0; i < R; i++)
+                result.m_data[i][i] = T(1);
+            return result;
+        }
+
+        static constexpr unsigned int rows() { return R; }
+        static constexpr unsigned int cols() { return C; }
+        constexpr T* operator[](const unsigned int x) { return m_data[x]; }
+        constexpr const T* operator[](const unsigned int x) const { return m_data[x]; }
+        constexpr T* data() { return &m_data[0][0]; }
+        constexpr const T* data() const { return &m_data[0][0]; }
+
+#define do_op(op) \
+        constexpr Matrix operator op (const Matrix& rhs) const { \
+            Matrix result; \
+            for (unsigned int i = 0; i < R; i++) \
+                for (unsigned int j = 0; j < C; j++) \
+                    result.m_data[i][j] = m_data[i][j] op rhs.m_data[i][j]; \
+            return result; \
+        } \
+        constexpr Matrix operator op (const T& rhs) const { \
+            Matrix result; \
+            for (unsigned int i = 0; i < R; i++) \
+                for (unsigned int j = 0; j < C; j++) \
+                    result.m_data[i][j] = m_data[i][j] op rhs; \
+            return result; \
+        }
+        do_op(+)
+        do_op(-)
+#undef do_op
+
+        constexpr Matrix operator*(const T& rhs) const {
+            Matrix result;
+            for (unsigned int i = 0; i < R; i++)
+                for (unsigned int j = 0; j < C; j++)
+                    result.m_data[i][j] = m_data[i][j] * rhs;
+            return result;
+        }
+        constexpr Matrix operator/(const T& rhs) const {
+            Matrix result;
+            for (unsigned int i = 0; i < R; i++)
+                for (unsigned int j = 0; j < C; j++)
+                    result.m_data[i][j] = m_data[i][j] / rhs;
+            return result;
+        }
+        constexpr Matrix hadamard(const Matrix& rhs) const {
+            Matrix result;
+            for (unsigned int i = 0; i < R; i++)
+                for (unsigned int j = 0; j < C; j++)
+                    result.m_data[i][j] = m_data[i][j] * rhs.m_data[i][j];
+            return result;
+        }
+
+        // Row i of the result accumulates multiples of the rows of rhs, so the innermost loop
+        // runs along contiguous rows and vectorizes once unrolled.
+        template <unsigned int K>
+        constexpr Matrix<T, R, K> operator*(const Matrix<T, C, K>& rhs) const {
+            Matrix<T, R, K> result;
+            MATRIX_UNROLL
+            for (unsigned int i = 0; i < R; i++)
+                MATRIX_UNROLL
+                for (unsigned int k = 0; k < C; k++)
+                    MATRIX_UNROLL
+                    for (unsigned int j = 0; j < K; j++)
+                        result[i][j] += m_data[i][k] * rhs[k][j];
+            return result;
+        }
+        constexpr std::array<T, R> operator*(const std::array<T, C>& rhs) const {
+            std::array<T, R> result{};
+            MATRIX_UNROLL
+            for (unsigned int i = 0; i < R; i++)
+                MATRIX_UNROLL
+                for (unsigned int j = 0; j < C; j++)
+                    result[i] += m_data[i][j] * rhs[j];
+            return result;
+        }
+
+        constexpr Matrix<T, C, R> transpose() const {
+            Matrix<T, C, R> result;
+            for (unsigned int i = 0; i < R; i++)
+                for (unsigned int j = 0; j < C; j++)
+                    result[j][i] = m_data[i][j];
+            return result;
+        }
+
+        constexpr T determinant() const;
+        // Closed forms up to 4x4, Gauss-Jordan with partial pivoting above; a singular matrix
+        // warns and gives the zero matrix
+        constexpr Matrix inverse() const;
+
+        constexpr bool operator==(const Matrix& rhs) const {
+            for (unsigned int i = 0; i < R; i++)
+                for (unsigned int j = 0; j < C; j++)
+                    if (m_data[i][j] != rhs.m_data[i][j])
+                        return false;
+            return true;
+        }
+        constexpr bool operator!=(const Matrix& rhs) const { return !(*this == rhs); }
+};
+
+template <typename T, unsigned int R, unsigned int C>
+constexpr T Matrix<T, R, C>::determinant() const {
+    static_assert(R == C, "Only square matrices have a determinant");
+    const auto& a = m_data;
+    if constexpr (R == 1) {
+        return a[0][0];
+    } else if constexpr (R == 2) {
+        return a[0][0] * a[1][1] - a[0][1] * a[1][0];
+    } else if constexpr (R == 3) {
+        return a[0][0] * (a[1][1] * a[2][2] - a[1][2] * a[2][1])
+             - a[0][1] * (a[1][0] * a[2][2] - a[1][2] * a[2][0])
+             + a[0][2] * (a[1][0] * a[2][1] - a[1][1] * a[2][0]);
+    } else if constexpr (R == 4) {
+        T s[6] = {}, c[6] = {};
+        minors4(s, c);
+        return s[0] * c[5] - s[1] * c[4] + s[2] * c[3] + s[3] * c[2] - s[4] * c[1] + s[5] * c[0];
+    } else {
+        // Gaussian elimination with partial pivoting
+        Matrix<T, R, C> u = *this;
+        T det = T(1);
+        for (unsigned int k = 0; k < R; k++) {
+            unsigned int pivot = k;
+            for (unsigned int i = k + 1; i < R; i++)
+                if ((u[i][k] < 0 ? -u[i][k] : u[i][k]) > (u[pivot][k] < 0 ? -u[pivot][k] : u[pivot][k]))
+                    pivot = i;
+            if (u[pivot][k] == T(0))
+                return T(0);
+            if (pivot != k) {
+                for (unsigned int j = 0; j < C; j++) {
+                    const T t = u[k][j];
+                    u[k][j] = u[pivot][j];
+                    u[pivot][j] = t;
+                }
+                det = -det;
+            }
+            det *= u[k][k];
+            for (unsigned int i = k + 1; i < R; i++) {
+                const T factor = u[i][k] / u[k][k];
+                for (unsigned int j = k; j < C; j++)
+                    u[i][j] -= factor * u[k][j];
+            }
+        }
+        return det;
+    }
+}
+
+template <typename T, unsigned int R, unsigned int C>
+constexpr Matrix<T, R, C> Matrix<T, R, C>::inverse() const {
+    static_assert(R == C, "Only square matrices have an inverse");
+    const auto& a = m_data;
+    Matrix result;
+    if constexpr (R == 4) {
+        T s[6] = {}, c[6] = {};
+        minors4(s, c);
+        const T det = s[0] * c[5] - s[1] * c[4] + s[2] * c[3] + s[3] * c[2] - s[4] * c[1] + s[5] * c[0];
+        if (det == T(0)) {
+            warn("Matrix<T, R, C>::inverse", "Singular matrix");
+            return result;
+        }
+        const T inv = T(1) / det;
+        result[0][0] = ( a[1][1] * c[5] - a[1][2] * c[4] + a[1][3] * c[3]) * inv;
+        result[0][1] = (-a[0][1] * c[5] + a[0][2] * c[4] - a[0][3] * c[3]) * inv;
+        result[0][2] = ( a[3][1] * s[5] - a[3][2] * s[4] + a[3][3] * s[3]) * inv;
+        result[0][3] = (-a[2][1] * s[5] + a[2][2] * s[4] - a[2][3] * s[3]) * inv;
+        result[1][0] = (-a[1][0] * c[5] + a[1][2] * c[2] - a[1][3] * c[1]) * inv;
+        result[1][1] = ( a[0][0] * c[5] - a[0][2] * c[2] + a[0][3] * c[1]) * inv;
+        result[1][2] = (-a[3][0] * s[5] + a[3][2] * s[2] - a[3][3] * s[1]) * inv;
+        result[1][3] = ( a[2][0] * s[5] - a[2][2] * s[2] + a[2][3] * s[1]) * inv;
+        result[2][0] = ( a[1][0] * c[4] - a[1][1] * c[2] + a[1][3] * c[0]) * inv;
+        result[2][1] = (-a[0][0] * c[4] + a[0][1] * c[2] - a[0][3] * c[0]) * inv;
+        result[2][2] = ( a[3][0] * s[4] - a[3][1] * s[2] + a[3][3] * s[0]) * inv;
+        result[2][3] = (-a[2][0] * s[4] + a[2][1] * s[2] - a[2][3] * s[0]) * inv;
+        result[3][0] = (-a[1][0] * c[3] + a[1][1] * c[1] - a[1][2] * c[0]) * inv;
+        result[3][1] = ( a[0][0] * c[3] - a[0][1] * c[1] + a[0][2] * c[0]) * inv;
+        result[3][2] = (-a[3][0] * s[3] + a[3][1] * s[1] - a[3][2] * s[0]) * inv;
+        result[3][3] = ( a[2][0] * s[3] - a[2][1] * s[1] + a[2][2] * s[0]) * inv;
+        return result;
+    } else if constexpr (R <= 3) {
+        const T det = determinant();
+        if (det == T(0)) {
+            warn("Matrix<T, R, C>::inverse", "Singular matrix");
+            return result;
+        }
+        const T inv = T(1) / det;
+        if constexpr (R == 1) {
+            result[0][0] = inv;
+        } else if constexpr (R == 2) {
+            result[0][0] = a[1][1] * inv, result[0][1] = -a[0][1] * inv;
+            result[1][0] = -a[1][0] * inv, result[1][1] = a[0][0] * inv;
+        } else {
+            // Adjugate: the cofactor of (j, i), by cyclic indexing
+            for (unsigned int i = 0; i < 3; i++)
+                for (unsigned int j = 0; j < 3; j++)
+                    result[i][j] = (a[(j + 1) % 3][(i + 1) % 3] * a[(j + 2) % 3][(i + 2) % 3]
+                                  - a[(j + 1) % 3][(i + 2) % 3] * a[(j + 2) % 3][(i + 1) % 3]) * inv;
+        }
+        return result;
+    } else {
+        // Gauss-Jordan on [A | I]
+        Matrix<T, R, C> u = *this;
+        result = identity();
+        for (unsigned int k = 0; k < R; k++) {
+            unsigned int pivot = k;
+            for (unsigned int i = k + 1; i < R; i++)
+                if ((u[i][k] < 0 ? -u[i][k] : u[i][k]) > (u[pivot][k] < 0 ? -u[pivot][k] : u[pivot][k]))
+                    pivot = i;
+            if (u[pivot][k] == T(0)) {
+                warn("Matrix<T, R, C>::inverse", "Singular matrix");
+                return Matrix();
+            }
+            for (unsigned int j = 0; j < C; j++) {
+                const T t = u[k][j], r = result[k][j];
+                u[k][j] = u[pivot][j], result[k][j] = result[pivot][j];
+                u[pivot][j] = t, result[pivot][j] = r;
+            }
+            const T inv = T(1) / u[k][k];
+            for (unsigned int j = 0; j < C; j++)
+                u[k][j] *= inv, result[k][j] *= inv;
+            for (unsigned int i = 0; i < R; i++) {
+                if (i == k)
+                    continue;
+                const T factor = u[i][k];
+                for (unsigned int j = 0; j < C; j++)
+                    u[i][j] -= factor * u[k][j], result[i][j] -= factor * result[k][j];
+            }
+        }
+        return result;
+    }
+}
+
+#undef MATRIX_UNROLL
+#endif
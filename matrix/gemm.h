@@ -0,0 +1,295 @@
+#ifndef GEMM_H
+#define GEMM_H
+
+// General matrix multiply, C = alpha * A * B + beta * C, on row-major arrays with arbitrary
+// leading dimensions. The loops are blocked the usual way (Goto/BLIS): a KC-deep slice of B is
+// packed into NR-wide column panels that stay in L3, an MC x KC block of A is packed into MR-tall
+// row panels that stay in L2, and a micro-kernel keeps an MR x NR tile of C in registers while it
+// streams through one panel of each. Packing pads the edges with zeros, so the micro-kernel
+// always sees whole panels; edge tiles of C go through a small buffer.
+//
+// float and double get AVX2/FMA micro-kernels when the CPU has them (checked once at runtime);
+// everything else, and CPUs without AVX2, uses a portable kernel of the same shape. A and B may be
+// stored in a narrower type than C (bfloat16 and float16 in reduced.h): packing converts them to
+// C's type, so the narrow type only ever travels from memory, and the kernels are the same.
+//
+// Given a thread pool, large products split C into tiles that are multiplied concurrently; each
+// tile is an independent product, packing its own panels into its thread's buffers.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <immintrin.h>
+#include "../thread_pool.h"
+
+// Cache-line aligned, uninitialized heap arrays. An array can also wrap memory owned by someone
+// else (a file mapping, see matrix_file.h), which release(ptr, bytes) hands back instead.
+struct aligned_delete {
+    void (*release)(void* ptr, size_t bytes) = nullptr;
+    size_t bytes = 0;
+    void operator()(void* ptr) const {
+        if (release)
+            release(ptr, bytes);
+        else
+            ::operator delete(ptr, std::align_val_t(64));
+    }
+};
+template <typename T>
+using aligned_array = std::unique_ptr<T[], aligned_delete>;
+
+template <typename T>
+aligned_array<T> make_aligned_array(const size_t n) {
+    return aligned_array<T>(static_cast<T*>(::operator new(std::max<size_t>(n, 1) * sizeof(T), std::align_val_t(64))));
+}
+
+template <typename T>
+struct gemm_blocking {
+    // A tile of C is MR rows by two AVX2 vectors: 12 accumulators, leaving room for the B loads
+    // and the A broadcast in 16 ymm registers.
+    static constexpr size_t MR = 6;
+    static constexpr size_t NR = std::is_same_v<T, float> ? 16 : 8;
+    static constexpr size_t KC = 256;
+    static constexpr size_t MC = 120;
+    static constexpr size_t NC = 3072;
+};
+
+// Converts n contiguous elements while packing; storage types with a faster way overload this.
+template <typename T, typename S>
+void gemm_convert(const S* src, T* dst, const size_t n) {
+    if constexpr (std::is_same_v<S, T>)
+        std::memcpy(dst, src, n * sizeof(T));
+    else
+        for (size_t i = 0; i < n; ++i) dst[i] = T(src[i]);
+}
+
+// Copies A[0, mc) x [0, kc) into MR-row panels, k-major within a panel: panel[p * MR + i]. Rows
+// stored in another type are converted a row at a time first.
+template <typename T, typename S>
+void gemm_pack_a(const size_t mc, const size_t kc, const S* a, const size_t lda, T* packed) {
+    constexpr size_t MR = gemm_blocking<T>::MR;
+    for (size_t i0 = 0; i0 < mc; i0 += MR) {
+        const size_t rows = std::min(MR, mc - i0);
+        if constexpr (std::is_same_v<S, T>) {
+            for (size_t p = 0; p < kc; ++p) {
+                for (size_t i = 0; i < rows; ++i) packed[p * MR + i] = a[(i0 + i) * lda + p];
+                for (size_t i = rows; i < MR; ++i) packed[p * MR + i] = T(0);
+            }
+        } else {
+            alignas(64) T row[gemm_blocking<T>::KC];
+            for (size_t i = 0; i < MR; ++i) {
+                if (i < rows)
+                    gemm_convert(a + (i0 + i) * lda, row, kc);
+                for (size_t p = 0; p < kc; ++p) packed[p * MR + i] = i < rows ? row[p] : T(0);
+            }
+        }
+        packed += MR * kc;
+    }
+}
+
+// Copies B[0, kc) x [0, nc) into NR-column panels, k-major within a panel: panel[p * NR + j].
+template <typename T, typename S>
+void gemm_pack_b(const size_t kc, const size_t nc, const S* b, const size_t ldb, T* packed) {
+    constexpr size_t NR = gemm_blocking<T>::NR;
+    for (size_t j0 = 0; j0 < nc; j0 += NR) {
+        const size_t cols = std::min(NR, nc - j0);
+        for (size_t p = 0; p < kc; ++p) {
+            const S* row = b + p * ldb + j0;
+            if (cols == NR) {
+                gemm_convert(row, packed + p * NR, NR);
+            } else {
+                for (size_t j = 0; j < cols; ++j) packed[p * NR + j] = T(row[j]);
+                for (size_t j = cols; j < NR; ++j) packed[p * NR + j] = T(0);
+            }
+        }
+        packed += NR * kc;
+    }
+}
+
+// C[MR x NR] = alpha * A_panel * B_panel + beta * C. C is not read when beta is zero.
+template <typename T>
+void gemm_kernel_generic(const size_t kc, const T* a, const T* b, T* c, const size_t ldc, const T alpha, const T beta) {
+    constexpr size_t MR = gemm_blocking<T>::MR, NR = gemm_blocking<T>::NR;
+    T acc[MR][NR] = {};
+    for (size_t p = 0; p < kc; ++p, a += MR, b += NR)
+        for (size_t i = 0; i < MR; ++i)
+            for (size_t j = 0; j < NR; ++j)
+                acc[i][j] += a[i] * b[j];
+    for (size_t i = 0; i < MR; ++i)
+        for (size_t j = 0; j < NR; ++j)
+            c[i * ldc + j] = beta == T(0) ? alpha * acc[i][j] : alpha * acc[i][j] + beta * c[i * ldc + j];
+}
+
+__attribute__((target("avx2,fma")))
+inline void gemm_kernel_avx2(const size_t kc, const double* a, const double* b, double* c, const size_t ldc,
+                             const double alpha, const double beta) {
+    __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd(), c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd(),
+            c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd(), c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd(),
+            c40 = _mm256_setzero_pd(), c41 = _mm256_setzero_pd(), c50 = _mm256_setzero_pd(), c51 = _mm256_setzero_pd();
+    for (size_t p = 0; p < kc; ++p, a += 6, b += 8) {
+        const __m256d b0 = _mm256_load_pd(b), b1 = _mm256_load_pd(b + 4);
+        __m256d ai = _mm256_broadcast_sd(a + 0);
+        c00 = _mm256_fmadd_pd(ai, b0, c00); c01 = _mm256_fmadd_pd(ai, b1, c01);
+        ai = _mm256_broadcast_sd(a + 1);
+        c10 = _mm256_fmadd_pd(ai, b0, c10); c11 = _mm256_fmadd_pd(ai, b1, c11);
+        ai = _mm256_broadcast_sd(a + 2);
+        c20 = _mm256_fmadd_pd(ai, b0, c20); c21 = _mm256_fmadd_pd(ai, b1, c21);
+        ai = _mm256_broadcast_sd(a + 3);
+        c30 = _mm256_fmadd_pd(ai, b0, c30); c31 = _mm256_fmadd_pd(ai, b1, c31);
+        ai = _mm256_broadcast_sd(a + 4);
+        c40 = _mm256_fmadd_pd(ai, b0, c40); c41 = _mm256_fmadd_pd(ai, b1, c41);
+        ai = _mm256_broadcast_sd(a + 5);
+        c50 = _mm256_fmadd_pd(ai, b0, c50); c51 = _mm256_fmadd_pd(ai, b1, c51);
+    }
+    const __m256d va = _mm256_set1_pd(alpha), vb = _mm256_set1_pd(beta);
+    const __m256d rows[6][2] = {{c00, c01}, {c10, c11}, {c20, c21}, {c30, c31}, {c40, c41}, {c50, c51}};
+    for (int i = 0; i < 6; ++i) {
+        double* row = c + i * ldc;
+        for (int h = 0; h < 2; ++h) {
+            __m256d v = _mm256_mul_pd(va, rows[i][h]);
+            if (beta != 0) v = _mm256_fmadd_pd(vb, _mm256_loadu_pd(row + 4 * h), v);
+            _mm256_storeu_pd(row + 4 * h, v);
+        }
+    }
+}
+
+__attribute__((target("avx2,fma")))
+inline void gemm_kernel_avx2(const size_t kc, const float* a, const float* b, float* c, const size_t ldc,
+                             const float alpha, const float beta) {
+    __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps(), c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps(),
+           c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps(), c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps(),
+           c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps(), c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+    for (size_t p = 0; p < kc; ++p, a += 6, b += 16) {
+        const __m256 b0 = _mm256_load_ps(b), b1 = _mm256_load_ps(b + 8);
+        __m256 ai = _mm256_broadcast_ss(a + 0);
+        c00 = _mm256_fmadd_ps(ai, b0, c00); c01 = _mm256_fmadd_ps(ai, b1, c01);
+        ai = _mm256_broadcast_ss(a + 1);
+        c10 = _mm256_fmadd_ps(ai, b0, c10); c11 = _mm256_fmadd_ps(ai, b1, c11);
+        ai = _mm256_broadcast_ss(a + 2);
+        c20 = _mm256_fmadd_ps(ai, b0, c20); c21 = _mm256_fmadd_ps(ai, b1, c21);
+        ai = _mm256_broadcast_ss(a + 3);
+        c30 = _mm256_fmadd_ps(ai, b0, c30); c31 = _mm256_fmadd_ps(ai, b1, c31);
+        ai = _mm256_broadcast_ss(a + 4);
+        c40 = _mm256_fmadd_ps(ai, b0, c40); c41 = _mm256_fmadd_ps(ai, b1, c41);
+        ai = _mm256_broadcast_ss(a + 5);
+        c50 = _mm256_fmadd_ps(ai, b0, c50); c51 = _mm256_fmadd_ps(ai, b1, c51);
+    }
+    const __m256 va = _mm256_set1_ps(alpha), vb = _mm256_set1_ps(beta);
+    const __m256 rows[6][2] = {{c00, c01}, {c10, c11}, {c20, c21}, {c30, c31}, {c40, c41}, {c50, c51}};
+    for (int i = 0; i < 6; ++i) {
+        float* row = c + i * ldc;
+        for (int h = 0; h < 2; ++h) {
+            __m256 v = _mm256_mul_ps(va, rows[i][h]);
+            if (beta != 0) v = _mm256_fmadd_ps(vb, _mm256_loadu_ps(row + 8 * h), v);
+            _mm256_storeu_ps(row + 8 * h, v);
+        }
+    }
+}
+
+template <typename T>
+using gemm_kernel_fn = void (*)(size_t, const T*, const T*, T*, size_t, T, T);
+
+template <typename T>
+gemm_kernel_fn<T> gemm_select_kernel() {
+    if constexpr (std::is_same_v<T, float> || std::is_same_v<T, double>) {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+            return static_cast<gemm_kernel_fn<T>>(&gemm_kernel_avx2);
+    }
+    return &gemm_kernel_generic<T>;
+}
+
+// Multiplies the packed block Ap (mc x kc) by the packed panel Bp (kc x nc) into C.
+template <typename T>
+void gemm_macro_kernel(const size_t mc, const size_t nc, const size_t kc, const T alpha, const T* ap, const T* bp,
+                       const T beta, T* c, const size_t ldc) {
+    constexpr size_t MR = gemm_blocking<T>::MR, NR = gemm_blocking<T>::NR;
+    static const gemm_kernel_fn<T> kernel = gemm_select_kernel<T>();
+    alignas(64) T edge[MR * NR];
+    for (size_t jr = 0; jr < nc; jr += NR) {
+        const size_t cols = std::min(NR, nc - jr);
+        for (size_t ir = 0; ir < mc; ir += MR) {
+            const size_t rows = std::min(MR, mc - ir);
+            T* tile = c + ir * ldc + jr;
+            if (rows == MR && cols == NR) {
+                kernel(kc, ap + ir * kc, bp + jr * kc, tile, ldc, alpha, beta);
+                continue;
+            }
+            kernel(kc, ap + ir * kc, bp + jr * kc, edge, NR, T(1), T(0));
+            for (size_t i = 0; i < rows; ++i)
+                for (size_t j = 0; j < cols; ++j)
+                    tile[i * ldc + j] = beta == T(0) ? alpha * edge[i * NR + j]
+                                                     : alpha * edge[i * NR + j] + beta * tile[i * ldc + j];
+        }
+    }
+}
+
+// Products with fewer multiply-adds than this aren't worth handing to a pool.
+constexpr double GEMM_PARALLEL_THRESHOLD = 1 << 21;
+
+template <typename T, typename A = T, typename B = A>
+void gemm(size_t m, size_t n, size_t k, T alpha, const A* a, size_t lda, const B* b, size_t ldb, T beta, T* c,
+          size_t ldc, util::thread_pool* pool = nullptr);
+
+// Splits C into about four tiles per thread: MC-row blocks first, since they share nothing but B,
+// then, when there are too few of those, NR-aligned column blocks, which share A instead.
+template <typename T, typename A, typename B>
+void gemm_tiled(const size_t m, const size_t n, const size_t k, const T alpha, const A* a, const size_t lda,
+                const B* b, const size_t ldb, const T beta, T* c, const size_t ldc, util::thread_pool& pool) {
+    using blocking = gemm_blocking<T>;
+    const size_t target = 4 * pool.size();
+    const size_t row_tiles = std::min((m + blocking::MC - 1) / blocking::MC, target);
+    const size_t tile_rows = ((m + row_tiles - 1) / row_tiles + blocking::MR - 1) / blocking::MR * blocking::MR;
+    const size_t col_tiles = std::min((target + row_tiles - 1) / row_tiles, (n + 255) / 256);
+    const size_t tile_cols = ((n + col_tiles - 1) / col_tiles + blocking::NR - 1) / blocking::NR * blocking::NR;
+    const size_t num_row_tiles = (m + tile_rows - 1) / tile_rows, num_col_tiles = (n + tile_cols - 1) / tile_cols;
+    pool.parallel_for(0, num_row_tiles * num_col_tiles, 1, [&](const size_t lo, const size_t hi) {
+        for (size_t t = lo; t < hi; ++t) {
+            const size_t i = t / num_col_tiles * tile_rows, j = t % num_col_tiles * tile_cols;
+            gemm(std::min(tile_rows, m - i), std::min(tile_cols, n - j), k, alpha, a + i * lda, lda, b + j, ldb,
+                 beta, c + i * ldc + j, ldc, nullptr);
+        }
+    });
+}
+
+// C = alpha * A * B + beta * C, where A is m x k, B is k x n and C is m x n, all row-major with
+// leading dimensions lda, ldb and ldc. C is not read when beta is zero.
+template <typename T, typename A, typename B>
+void gemm(const size_t m, const size_t n, const size_t k, const T alpha, const A* a, const size_t lda,
+          const B* b, const size_t ldb, const T beta, T* c, const size_t ldc, util::thread_pool* pool) {
+    using blocking = gemm_blocking<T>;
+    if (m == 0 || n == 0) return;
+    if (pool && pool->size() > 1 && (double)m * n * k >= GEMM_PARALLEL_THRESHOLD) {
+        gemm_tiled(m, n, k, alpha, a, lda, b, ldb, beta, c, ldc, *pool);
+        return;
+    }
+    if (k == 0) {
+        for (size_t i = 0; i < m; ++i)
+            for (size_t j = 0; j < n; ++j)
+                c[i * ldc + j] = beta == T(0) ? T(0) : beta * c[i * ldc + j];
+        return;
+    }
+    static thread_local aligned_array<T> packed_a, packed_b;
+    static thread_local size_t size_a = 0, size_b = 0;
+    const size_t need_a = blocking::MC * blocking::KC, need_b = blocking::KC * (std::min(n, blocking::NC) + blocking::NR);
+    if (size_a < need_a) packed_a = make_aligned_array<T>(size_a = need_a);
+    if (size_b < need_b) packed_b = make_aligned_array<T>(size_b = need_b);
+
+    for (size_t jc = 0; jc < n; jc += blocking::NC) {
+        const size_t nc = std::min(blocking::NC, n - jc);
+        for (size_t pc = 0; pc < k; pc += blocking::KC) {
+            const size_t kc = std::min(blocking::KC, k - pc);
+            gemm_pack_b(kc, nc, b + pc * ldb + jc, ldb, packed_b.get());
+            const T beta_pc = pc == 0 ? beta : T(1);
+            for (size_t ic = 0; ic < m; ic += blocking::MC) {
+                const size_t mc = std::min(blocking::MC, m - ic);
+                gemm_pack_a(mc, kc, a + ic * lda + pc, lda, packed_a.get());
+                gemm_macro_kernel(mc, nc, kc, alpha, packed_a.get(), packed_b.get(), beta_pc, c + ic * ldc + jc, ldc);
+            }
+        }
+    }
+}
+
+#endif
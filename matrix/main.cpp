@@ -1,19 +1,634 @@
 
 #define DEBUG
 #include "matrix.h"
+#include "factor.h"
+#include "matrix_file.h"
+#include "reduced.h"
+#include "sparse.h"
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <memory>
 #include <random>
+#include <string>
 
-int main() {
-    Matrix<double> m(1000, 1000), n(1000, 1000);
+// Build with -DUSE_CBLAS ... -lopenblas to compare against a tuned BLAS.
+#ifdef USE_CBLAS
+extern "C" {
+void cblas_sgemm(int, int, int, int, int, int, float, const float*, int, const float*, int, float, float*, int);
+void cblas_dgemm(int, int, int, int, int, int, double, const double*, int, const double*, int, double, double*, int);
+}
+void blas_gemm(const Matrix<float>& a, const Matrix<float>& b, Matrix<float>& c) {
+    cblas_sgemm(101, 111, 111, a.rows(), b.cols(), a.cols(), 1, a.data(), a.stride(), b.data(), b.stride(), 0, c.data(), c.stride());
+}
+void blas_gemm(const Matrix<double>& a, const Matrix<double>& b, Matrix<double>& c) {
+    cblas_dgemm(101, 111, 111, a.rows(), b.cols(), a.cols(), 1, a.data(), a.stride(), b.data(), b.stride(), 0, c.data(), c.stride());
+}
+#endif
 
-    for (int i = 0; i < m.rows(); i++)
-        for (int j = 0; j < m.cols(); j++)
+template<typename T>
+Matrix<T> random_matrix(unsigned int rows, unsigned int cols) {
+    Matrix<T> m(rows, cols);
+    for (unsigned int i = 0; i < m.rows(); i++)
+        for (unsigned int j = 0; j < m.cols(); j++)
             m[i][j] = rand() % 1000 - 500;
-    for (int i = 0; i < n.rows(); i++)
-        for (int j = 0; j < n.cols(); j++)
-            n[i][j] = rand() % 1000 - 500;
+    return m;
+}
+
+// Largest difference between a few sampled entries of m * n and their dot products.
+template<typename T>
+double sampled_error(const Matrix<T>& m, const Matrix<T>& n, const Matrix<T>& product) {
+    double error = 0;
+    for (unsigned int s = 0; s < 64; s++) {
+        const unsigned int i = rand() % product.rows(), j = rand() % product.cols();
+        double sum = 0;
+        for (unsigned int k = 0; k < m.cols(); k++)
+            sum += (double)m[i][k] * n[k][j];
+        error = std::max(error, std::abs(sum - product[i][j]) / std::max(1.0, std::abs(sum)));
+    }
+    return error;
+}
+
+template<typename T>
+void benchmark_gemm(const char* name, unsigned int size, int repeats) {
+    using seconds = std::chrono::duration<double>;
+    Matrix<T> m = random_matrix<T>(size, size), n = random_matrix<T>(size, size);
+    const double flops = 2.0 * size * size * size * repeats;
+    Matrix<T> product = m * n;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int r = 0; r < repeats; r++)
+        product = m * n;
+    auto finish = std::chrono::high_resolution_clock::now();
+    std::cout << "Matrix<" << name << ">::operator* " << size << "x" << size << ": "
+              << flops / seconds(finish - start).count() / 1e9 << " GFLOPS";
+    const double error = sampled_error(m, n, product);
+    assert(error < (sizeof(T) == 4 ? 1e-4 : 1e-12));
+#ifdef USE_CBLAS
+    Matrix<T> reference(size, size);
+    start = std::chrono::high_resolution_clock::now();
+    for (int r = 0; r < repeats; r++)
+        blas_gemm(m, n, reference);
+    finish = std::chrono::high_resolution_clock::now();
+    std::cout << ", BLAS " << flops / seconds(finish - start).count() / 1e9 << " GFLOPS";
+#endif
+    std::cout << " (relative error " << error << ")\n";
+}
+
+// Milliseconds per call of fn, averaged over `repeats` calls.
+template<typename F>
+double time_ms(int repeats, F&& fn) {
+    const auto start = std::chrono::high_resolution_clock::now();
+    for (int r = 0; r < repeats; r++)
+        fn();
+    const auto finish = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double, std::milli>(finish - start).count() / repeats;
+}
+
+// Times the parallel operations on pools of 1 to max_threads threads, checking every result
+// against the single-threaded one.
+void benchmark_scaling(unsigned int max_threads) {
+    Matrix<double> a = random_matrix<double>(1000, 1000), b = random_matrix<double>(1000, 1000);
+    Matrix<double> x = random_matrix<double>(2000, 2000), y = random_matrix<double>(2000, 2000);
+    std::vector<double> v(2000);
+    for (double& e : v)
+        e = rand() % 1000 - 500;
+
+    set_matrix_thread_pool(nullptr);
+    const Matrix<double> product = a * b, sum = x + y, hadamard = x.hadamard(y), scaled = x * 3.0;
+    const std::vector<double> image = x * v;
+
+    std::cout << "threads   gemm 1000   add 2000   hadamard 2000   scalar* 2000   matvec 2000  (ms)\n";
+    for (unsigned int threads = 1; threads <= max_threads; threads++) {
+        util::thread_pool pool(threads);
+        set_matrix_thread_pool(&pool);
+        Matrix<double> r(1, 1);
+        std::vector<double> w;
+        const double gemm_ms = time_ms(3, [&] { r = a * b; });
+        assert(std::equal(r.data(), r.data() + 1000 * r.stride(), product.data()));
+        const double add_ms = time_ms(10, [&] { r = x + y; });
+        assert(std::equal(r.data(), r.data() + 2000 * r.stride(), sum.data()));
+        const double hadamard_ms = time_ms(10, [&] { r = x.hadamard(y); });
+        assert(std::equal(r.data(), r.data() + 2000 * r.stride(), hadamard.data()));
+        const double scalar_ms = time_ms(10, [&] { r = x * 3.0; });
+        assert(std::equal(r.data(), r.data() + 2000 * r.stride(), scaled.data()));
+        const double matvec_ms = time_ms(10, [&] { w = x * v; });
+        assert(w == image);
+        printf("%7u %11.2f %10.2f %15.2f %14.2f %13.2f\n", threads, gemm_ms, add_ms, hadamard_ms, scalar_ms, matvec_ms);
+    }
+    set_matrix_thread_pool(nullptr);
+}
+
+// Common elementwise chains, evaluated lazily in one fused pass versus one operation at a time
+// into temporaries (which is what every operator used to do).
+void benchmark_expressions(unsigned int size, int repeats) {
+    Matrix<double> a = random_matrix<double>(size, size), b = random_matrix<double>(size, size);
+    Matrix<double> c = random_matrix<double>(size, size), d = random_matrix<double>(size, size);
+    Matrix<double> r(size, size), eager(size, size);
+    const auto report = [&](const char* name, double lazy_ms, double eager_ms) {
+        assert(std::equal(r.data(), r.data() + (size_t)size * r.stride(), eager.data()));
+        printf("  %-30s lazy %8.3f ms   eager %8.3f ms   %.2fx\n", name, lazy_ms, eager_ms, eager_ms / lazy_ms);
+    };
+    std::cout << "Elementwise chains on " << size << "x" << size << ":\n";
+
+    double lazy_ms = time_ms(repeats, [&] { r = a + b * 2.0 - c.hadamard(d); });
+    double eager_ms = time_ms(repeats, [&] {
+        const Matrix<double> scaled = b * 2.0, sum = a + scaled, product = c.hadamard(d);
+        eager = sum - product;
+    });
+    report("a + b * 2.0 - c.hadamard(d)", lazy_ms, eager_ms);
+
+    lazy_ms = time_ms(repeats, [&] { r = a * 0.5 + b; });
+    eager_ms = time_ms(repeats, [&] {
+        const Matrix<double> scaled = a * 0.5;
+        eager = scaled + b;
+    });
+    report("a * 0.5 + b", lazy_ms, eager_ms);
+
+    lazy_ms = time_ms(repeats, [&] { r = (a - b).hadamard(a - b) / 2.0; });
+    eager_ms = time_ms(repeats, [&] {
+        const Matrix<double> diff = a - b, square = diff.hadamard(diff);
+        eager = square / 2.0;
+    });
+    report("(a - b).hadamard(a - b) / 2.0", lazy_ms, eager_ms);
+
+    lazy_ms = time_ms(repeats, [&] { r = a; r += b.hadamard(c) - d; });
+    eager_ms = time_ms(repeats, [&] {
+        const Matrix<double> product = b.hadamard(c), diff = product - d;
+        eager = a;
+        eager += diff;
+    });
+    report("r += b.hadamard(c) - d", lazy_ms, eager_ms);
+}
+
+// Strassen-Winograd against the classical product: one level of recursion (cutoff n / 2), which
+// shows where the crossover is, and the default cutoff. The error is the largest difference from
+// the classical result, relative to its largest entry.
+void benchmark_strassen() {
+    std::cout << "Strassen        classical   1 level (speedup, error)        default cutoff (speedup, error)\n";
+    for (unsigned int size : {512, 1024, 1536, 2048, 3072, 4096}) {
+        Matrix<double> m(size, size), n(size, size);
+        for (unsigned int i = 0; i < size; i++)
+            for (unsigned int j = 0; j < size; j++)
+                m[i][j] = rand() / (double)RAND_MAX * 2 - 1, n[i][j] = rand() / (double)RAND_MAX * 2 - 1;
+        Matrix<double> classical(1, 1), fast(1, 1);
+        const double classical_ms = time_ms(1, [&] { classical = m * n; });
+        double scale = 0;
+        for (unsigned int i = 0; i < size; i++)
+            for (unsigned int j = 0; j < size; j++)
+                scale = std::max(scale, std::abs(classical[i][j]));
+        const auto error = [&] {
+            double e = 0;
+            for (unsigned int i = 0; i < size; i++)
+                for (unsigned int j = 0; j < size; j++)
+                    e = std::max(e, std::abs(fast[i][j] - classical[i][j]));
+            return e / scale;
+        };
+        const double one_level_ms = time_ms(1, [&] { fast = m.strassen(n, size / 2); });
+        const double one_level_error = error();
+        const double default_ms = time_ms(1, [&] { fast = m.strassen(n); });
+        printf("  %4u      %9.1f ms   %9.1f ms (%.2fx, %.1e)   %9.1f ms (%.2fx, %.1e)\n", size, classical_ms,
+               one_level_ms, classical_ms / one_level_ms, one_level_error, default_ms, classical_ms / default_ms, error());
+    }
+}
+
+// Transpose bandwidth (bytes read plus bytes written) of the old element-by-element loop, the
+// tiled copy (into an existing matrix, so that page faults on a fresh result don't count) and
+// the in-place transpose. Power-of-two sizes are where a naive column walk keeps
+// evicting its own lines, since every element of a column maps to the same few cache sets.
+void benchmark_transpose() {
+    std::cout << "Transpose (GB/s)      naive     tiled  in place\n";
+    const std::pair<unsigned int, unsigned int> shapes[] = {
+        {512, 512}, {1000, 1000}, {1024, 1024}, {2047, 2047}, {2048, 2048}, {4095, 4095}, {4096, 4096},
+        {1000, 3000}, {1024, 4096}};
+    for (const auto& [rows, cols] : shapes) {
+        Matrix<double> m = random_matrix<double>(rows, cols), t(cols, rows);
+        const double bytes = 2.0 * rows * cols * sizeof(double);
+        const int repeats = std::max(1.0, 2e9 / bytes);
+        const double naive_ms = time_ms(repeats, [&] {
+            for (unsigned int i = 0; i < cols; i++)
+                for (unsigned int j = 0; j < rows; j++)
+                    t[i][j] = m[j][i];
+        });
+        const Matrix<double> naive = t;
+        const double tiled_ms = time_ms(repeats, [&] { transpose(rows, cols, m.data(), m.stride(), t.data(), t.stride()); });
+        assert(std::equal(t.data(), t.data() + (size_t)cols * t.stride(), naive.data()));
+        assert(std::equal(t.data(), t.data() + (size_t)cols * t.stride(), m.transpose().data()));
+        const double in_place_ms = time_ms(repeats | 1, [&] { m.transpose_in_place(); });
+        assert(std::equal(m.data(), m.data() + (size_t)cols * m.stride(), naive.data()));
+        printf("  %4ux%-4u      %8.2f  %8.2f  %8.2f\n", rows, cols, bytes / naive_ms / 1e6, bytes / tiled_ms / 1e6,
+               bytes / in_place_ms / 1e6);
+    }
+}
+
+// n x n with Pareto-distributed row lengths (alpha = 2, so a few rows are very long) averaging
+// about `degree` nonzeros, in uniformly random columns: the shape of a web or social graph.
+SparseMatrix<double> power_law_matrix(unsigned int n, double degree, std::mt19937& rng) {
+    std::uniform_real_distribution<double> uniform(0, 1);
+    std::vector<SparseMatrix<double>::triplet> entries;
+    entries.reserve((size_t)(n * degree * 1.2));
+    for (unsigned int i = 0; i < n; i++) {
+        const double length = std::min<double>(n, degree / 2 / std::sqrt(1 - uniform(rng)));
+        for (unsigned int e = 0; e < (unsigned int)length; e++)
+            entries.emplace_back(i, rng() % n, uniform(rng) * 2 - 1);
+    }
+    return SparseMatrix<double>(n, n, std::move(entries));
+}
+
+// n x n with the 2 * half + 1 diagonals around the main one filled: a stencil or FEM matrix.
+SparseMatrix<double> banded_matrix(unsigned int n, unsigned int half, std::mt19937& rng) {
+    std::uniform_real_distribution<double> uniform(-1, 1);
+    std::vector<SparseMatrix<double>::triplet> entries;
+    entries.reserve((size_t)n * (2 * half + 1));
+    for (unsigned int i = 0; i < n; i++)
+        for (unsigned int j = i < half ? 0 : i - half; j <= std::min(n - 1, i + half); j++)
+            entries.emplace_back(i, j, uniform(rng));
+    return SparseMatrix<double>(n, n, std::move(entries));
+}
+
+// SpMV scaling over 1..max_threads, then sparse-dense, sparse-sparse and transpose on the same
+// matrices, and a small case against the dense path.
+void benchmark_sparse(unsigned int max_threads) {
+    std::mt19937 rng(1);
+    const unsigned int n = 1 << 20;
+    const std::pair<const char*, SparseMatrix<double>> matrices[] = {
+        {"power-law", power_law_matrix(n, 16, rng)}, {"banded", banded_matrix(n, 4, rng)}};
+    std::vector<double> x(n);
+    for (double& e : x)
+        e = rng() % 1000 - 500;
+
+    std::cout << "Sparse " << n << "x" << n << "\n";
+    for (const auto& [name, a] : matrices) {
+        const double flops = 2.0 * a.nonzeros();
+        printf("  %-10s %zu nonzeros\n", name, a.nonzeros());
+        set_matrix_thread_pool(nullptr);
+        const std::vector<double> y = a * x;
+        for (unsigned int threads = 1; threads <= max_threads; threads++) {
+            util::thread_pool pool(threads);
+            set_matrix_thread_pool(&pool);
+            std::vector<double> z;
+            const double spmv_ms = time_ms(10, [&] { z = a * x; });
+            assert(z == y);
+            printf("    SpMV, %u threads: %8.2f ms, %.2f GFLOPS\n", threads, spmv_ms, flops / spmv_ms / 1e6);
+        }
+        set_matrix_thread_pool(nullptr);
+
+        SparseMatrix<double> at(1, 1);
+        const double transpose_ms = time_ms(1, [&] { at = a.transpose(); });
+        assert(at.transpose().values() == a.values());
+        const unsigned int width = 16;
+        Matrix<double> dense(n, width), product(1, 1);
+        for (unsigned int i = 0; i < n; i++)
+            for (unsigned int j = 0; j < width; j++)
+                dense[i][j] = x[i] + j;
+        const double spmm_ms = time_ms(1, [&] { product = a * dense; });
+        std::vector<double> column(n);
+        for (unsigned int i = 0; i < n; i++)
+            column[i] = dense[i][3];
+        const std::vector<double> expected = a * column;
+        for (unsigned int i = 0; i < n; i += 997)
+            assert(product[i][3] == expected[i]);
+        printf("    transpose %.1f ms, times %ux%u dense %.1f ms (%.2f GFLOPS)\n", transpose_ms, n, width, spmm_ms,
+               flops * width / spmm_ms / 1e6);
+    }
+
+    // Squaring a power-law matrix fills in quickly (long rows meet long rows), so these are smaller
+    const unsigned int m = 1 << 16;
+    const std::pair<const char*, SparseMatrix<double>> smaller[] = {
+        {"power-law", power_law_matrix(m, 16, rng)}, {"banded", banded_matrix(m, 4, rng)}};
+    for (const auto& [name, a] : smaller) {
+        SparseMatrix<double> square(1, 1);
+        const double spgemm_ms = time_ms(1, [&] { square = a * a; });
+        printf("  %-10s %ux%u, %zu nonzeros: squared in %.1f ms, %zu nonzeros\n", name, m, m, a.nonzeros(), spgemm_ms,
+               square.nonzeros());
+    }
+
+    // At 1% density the dense product does 100 times the work
+    const unsigned int size = 4000;
+    Matrix<double> small = power_law_matrix(size, size / 100, rng).dense();
+    const SparseMatrix<double> sparse(small);
+    const std::vector<double> v(x.begin(), x.begin() + size);
+    const double dense_ms = time_ms(20, [&] { small * v; });
+    const double sparse_ms = time_ms(20, [&] { sparse * v; });
+    assert(sparse * v == small * v);
+    printf("  %ux%u, %zu nonzeros: dense matvec %.3f ms, SpMV %.3f ms\n", size, size, sparse.nonzeros(), dense_ms,
+           sparse_ms);
+}
+
+// Batches of small products, which is what transform-heavy code does: Matrix<double, N, N> against
+// Matrix<double> of the same size.
+template<unsigned int N>
+void benchmark_fixed(unsigned int batch, int repeats) {
+    std::vector<Matrix<double, N, N>> a(batch), b(batch), c(batch);
+    for (unsigned int t = 0; t < batch; t++)
+        for (unsigned int i = 0; i < N; i++)
+            for (unsigned int j = 0; j < N; j++)
+                a[t][i][j] = rand() % 100 / 10.0 - 5, b[t][i][j] = rand() % 100 / 10.0 - 5 + (i == j) * 10;
+    std::vector<Matrix<double>> da(a.begin(), a.end()), db(b.begin(), b.end()), dc(batch, Matrix<double>(N, N));
+
+    const double fixed_ms = time_ms(repeats, [&] {
+        for (unsigned int t = 0; t < batch; t++)
+            c[t] = a[t] * b[t];
+    });
+    const double dynamic_ms = time_ms(repeats, [&] {
+        for (unsigned int t = 0; t < batch; t++)
+            dc[t] = da[t] * db[t];
+    });
+    for (unsigned int t = 0; t < batch; t += 101)
+        for (unsigned int i = 0; i < N; i++)
+            for (unsigned int j = 0; j < N; j++)
+                assert(std::abs(dc[t][i][j] - c[t][i][j]) < 1e-9);
+    const double inverse_ms = time_ms(repeats, [&] {
+        for (unsigned int t = 0; t < batch; t++)
+            c[t] = b[t].inverse();
+    });
+    std::vector<std::array<double, N>> points(batch);
+    for (unsigned int t = 0; t < batch; t++)
+        points[t][t % N] = 1;
+    const double transform_ms = time_ms(repeats, [&] {
+        for (unsigned int t = 0; t < batch; t++)
+            points[t] = a[t] * points[t];
+    });
+    printf("  %ux%u: product %6.1f ns fixed, %6.1f ns dynamic (%.0fx); inverse %5.1f ns; transform %4.1f ns\n", N, N,
+           fixed_ms * 1e6 / batch, dynamic_ms * 1e6 / batch, dynamic_ms / fixed_ms, inverse_ms * 1e6 / batch,
+           transform_ms * 1e6 / batch);
+}
+
+// Largest |A x - b| over the largest |A| |x|, which is what a backward stable solve keeps near
+// machine epsilon regardless of conditioning.
+double relative_residual(const Matrix<double>& a, const Matrix<double>& x, const Matrix<double>& b) {
+    const Matrix<double> r = a * x;
+    double residual = 0, norm_a = 0, norm_x = 0;
+    for (unsigned int i = 0; i < a.rows(); i++) {
+        double row = 0;
+        for (unsigned int j = 0; j < a.cols(); j++)
+            row += std::abs(a[i][j]);
+        norm_a = std::max(norm_a, row);
+        for (unsigned int j = 0; j < b.cols(); j++)
+            residual = std::max(residual, std::abs(r[i][j] - b[i][j]));
+    }
+    for (unsigned int i = 0; i < x.rows(); i++)
+        for (unsigned int j = 0; j < x.cols(); j++)
+            norm_x = std::max(norm_x, std::abs(x[i][j]));
+    return residual / (norm_a * norm_x);
+}
+
+// GFLOPS of the three factorizations (2/3 n^3 for LU, 1/3 n^3 for Cholesky, 4/3 n^3 for QR) and
+// the relative residual of a 16 right-hand side solve with each. The unblocked column is LU with
+// a panel as wide as the matrix, i.e. no gemm at all.
+void benchmark_factorizations() {
+    std::cout << "Factorizations (GFLOPS, residual)     LU                 unblocked LU         Cholesky           QR\n";
+    for (unsigned int size : {256, 512, 1000, 1024, 2000}) {
+        Matrix<double> a(size, size), spd(size, size), b(size, 16);
+        for (unsigned int i = 0; i < size; i++) {
+            for (unsigned int j = 0; j < size; j++)
+                a[i][j] = rand() / (double)RAND_MAX * 2 - 1;
+            for (unsigned int j = 0; j < 16; j++)
+                b[i][j] = rand() / (double)RAND_MAX * 2 - 1;
+        }
+        spd = a * a.transpose();
+        for (unsigned int i = 0; i < size; i++)
+            spd[i][i] += size;
+
+        const double n3 = (double)size * size * size;
+        std::unique_ptr<LU<double>> lu, unblocked;
+        std::unique_ptr<Cholesky<double>> cholesky;
+        std::unique_ptr<QR<double>> qr;
+        const double lu_ms = time_ms(1, [&] { lu = std::make_unique<LU<double>>(a); });
+        const double unblocked_ms = time_ms(1, [&] { unblocked = std::make_unique<LU<double>>(a, size); });
+        const double cholesky_ms = time_ms(1, [&] { cholesky = std::make_unique<Cholesky<double>>(spd); });
+        const double qr_ms = time_ms(1, [&] { qr = std::make_unique<QR<double>>(a); });
+        printf("  %4u                         %6.2f (%.1e)   %6.2f (%.1e)   %6.2f (%.1e)   %6.2f (%.1e)\n", size,
+               2 * n3 / 3 / lu_ms * 1e-6, relative_residual(a, lu->solve(b), b),
+               2 * n3 / 3 / unblocked_ms * 1e-6, relative_residual(a, unblocked->solve(b), b),
+               n3 / 3 / cholesky_ms * 1e-6, relative_residual(spd, cholesky->solve(b), b),
+               4 * n3 / 3 / qr_ms * 1e-6, relative_residual(a, qr->solve(b), b));
+    }
+}
+
+// Block assembly with copies against views. Copying is what concat() and kronecker() used to
+// do: build every intermediate matrix, then the block matrix from them. Views build the result
+// in one pass, take products of blocks in place, and accumulate blocks into a larger matrix.
+void benchmark_views(unsigned int size) {
+    Matrix<double> a = random_matrix<double>(size, size), b = random_matrix<double>(size, size),
+                   c = random_matrix<double>(size, size), d = random_matrix<double>(size, size);
+    Matrix<double> result(1, 1), check(1, 1);
+    const auto copy_block = [](const Matrix<double>& m, unsigned int row, unsigned int col, unsigned int rows,
+                               unsigned int cols) {
+        Matrix<double> block(rows, cols);
+        for (unsigned int i = 0; i < rows; i++)
+            for (unsigned int j = 0; j < cols; j++)
+                block[i][j] = m[row + i][col + j];
+        return block;
+    };
+    const auto same = [&] {
+        for (unsigned int i = 0; i < result.rows(); i++)
+            for (unsigned int j = 0; j < result.cols(); j++)
+                assert(result[i][j] == check[i][j]);
+    };
+    printf("Views, %ux%u blocks         copies      views\n", size, size);
+
+    // [a b; c d], with the vertical concatenation done by transposing
+    const double copy_concat_ms = time_ms(3, [&] {
+        check = a.concat(b).transpose().concat(c.concat(d).transpose()).transpose();
+    });
+    const double view_concat_ms = time_ms(3, [&] { result = vconcat(hconcat(a, b), hconcat(c, d)); });
+    same();
+    printf("  2x2 block matrix       %8.2f ms %8.2f ms\n", copy_concat_ms, view_concat_ms);
+
+    // A product of two off-center blocks
+    const unsigned int half = size / 2;
+    const double copy_product_ms = time_ms(3, [&] {
+        check = copy_block(a, half / 2, half / 2, half, half) * copy_block(b, 1, 3, half, half);
+    });
+    const double view_product_ms = time_ms(3, [&] {
+        result = a.submatrix(half / 2, half / 2, half, half) * b.submatrix(1, 3, half, half);
+    });
+    same();
+    printf("  block product          %8.2f ms %8.2f ms\n", copy_product_ms, view_product_ms);
+
+    // Adding 8x8 element matrices into overlapping diagonal blocks, finite-element style
+    Matrix<double> local = random_matrix<double>(8, 8);
+    const double copy_assembly_ms = time_ms(3, [&] {
+        check = Matrix<double>(size, size);
+        for (unsigned int k = 0; k + 8 <= size; k += 4) {
+            Matrix<double> block = copy_block(check, k, k, 8, 8);
+            block += local;
+            for (unsigned int i = 0; i < 8; i++)
+                std::copy(block[i], block[i] + 8, check[k + i] + k);
+        }
+    });
+    const double view_assembly_ms = time_ms(3, [&] {
+        result = Matrix<double>(size, size);
+        for (unsigned int k = 0; k + 8 <= size; k += 4)
+            result.submatrix(k, k, 8, 8) += local;
+    });
+    same();
+    printf("  block assembly         %8.2f ms %8.2f ms\n", copy_assembly_ms, view_assembly_ms);
+
+    // The Kronecker product of sqrt(size) x sqrt(size) corners of a and b, about size x size
+    const unsigned int factor = (unsigned int)std::sqrt(size);
+    const double copy_kronecker_ms = time_ms(3, [&] {
+        const Matrix<double> x = copy_block(a, 0, 0, factor, factor), y = copy_block(b, 0, 0, factor, factor);
+        check = Matrix<double>(factor * factor, factor * factor);
+        for (unsigned int i = 0; i < check.rows(); i++)
+            for (unsigned int j = 0; j < check.cols(); j++)
+                check[i][j] = x[i / factor][j / factor] * y[i % factor][j % factor];
+    });
+    const double view_kronecker_ms = time_ms(3, [&] {
+        result = kronecker(a.submatrix(0, 0, factor, factor), b.submatrix(0, 0, factor, factor));
+    });
+    same();
+    printf("  Kronecker product      %8.2f ms %8.2f ms\n", copy_kronecker_ms, view_kronecker_ms);
+
+    // Rotating the columns, then the rows, of a matrix into itself, where every element is read
+    // from one that has a different position
+    const double copy_rotate_ms = time_ms(1, [&] {
+        check = Matrix<double>(size, size);
+        for (unsigned int i = 0; i < size; i++)
+            for (unsigned int j = 0; j < size; j++)
+                check[i][j] = a[(i + 1) % size][(j + 1) % size];
+    });
+    const double view_rotate_ms = time_ms(1, [&] {
+        result = a;
+        result = hconcat(result.submatrix(0, 1, size, size - 1), result.col(0));
+        result = vconcat(result.submatrix(1, 0, size - 1, size), result.row(0));
+    });
+    same();
+    printf("  rotation in place      %8.2f ms %8.2f ms\n", copy_rotate_ms, view_rotate_ms);
+}
+
+// Loading a size x size Matrix<double> saved by the previous pipeline stage: parsing it from text
+// into a Matrix, which is how it used to be done, reading the binary file, and mapping it. Mapping
+// does no work up front, so it is also timed together with a pass over every element, which is
+// when its pages are faulted in (from the page cache, since the file was just written).
+void benchmark_matrix_file(unsigned int size) {
+    const char* text_path = "/tmp/matrix-bench.txt";
+    const char* binary_path = "/tmp/matrix-bench.mat";
+    Matrix<double> m(size, size);
+    for (unsigned int i = 0; i < size; i++)
+        for (unsigned int j = 0; j < size; j++)
+            m[i][j] = rand() / (double)RAND_MAX * 2 - 1;
+
+    FILE* text = fopen(text_path, "w");
+    fprintf(text, "%u %u\n", size, size);
+    for (unsigned int i = 0; i < size; i++)
+        for (unsigned int j = 0; j < size; j++)
+            fprintf(text, "%.17g%c", m[i][j], j + 1 == size ? '\n' : ' ');
+    fclose(text);
+    // Written the way a stage producing more than fits in memory would, a block of rows at a time
+    const double save_ms = time_ms(1, [&] {
+        MatrixFileWriter<double> writer(binary_path, size);
+        for (unsigned int i = 0; i < size; i += 256)
+            writer.write(m.submatrix(i, 0, std::min(256u, size - i), size));
+        [[maybe_unused]] const bool closed = writer.close();
+        assert(closed);
+    });
+
+    Matrix<double> loaded(1, 1);
+    const auto sum = [&] {
+        double total = 0;
+        for (unsigned int i = 0; i < loaded.rows(); i++)
+            for (unsigned int j = 0; j < loaded.cols(); j++)
+                total += loaded[i][j];
+        return total;
+    };
+    const double text_ms = time_ms(1, [&] {
+        FILE* file = fopen(text_path, "r");
+        unsigned int rows = 0, cols = 0;
+        [[maybe_unused]] const int dimensions = fscanf(file, "%u %u", &rows, &cols);
+        assert(dimensions == 2);
+        loaded = Matrix<double>(rows, cols);
+        size_t parsed = 0;
+        for (unsigned int i = 0; i < rows; i++)
+            for (unsigned int j = 0; j < cols; j++)
+                parsed += fscanf(file, "%lf", &loaded[i][j]) == 1;
+        assert(parsed == (size_t)rows * cols);
+        fclose(file);
+    });
+    [[maybe_unused]] const double expected = sum();
+    const double read_ms = time_ms(1, [&] { loaded = load_matrix<double>(binary_path); });
+    assert(sum() == expected);
+    const double map_ms = time_ms(1, [&] { loaded = map_matrix<double>(binary_path); });
+    double total = 0;
+    const double touch_ms = time_ms(1, [&] { total = sum(); });
+    assert(total == expected);
+    printf("Matrix file, %ux%u (%.0f MB): save %.1f ms; load from text %.1f ms, read %.1f ms, "
+           "map %.3f ms (%.1f ms with first touch)\n", size, size, size * (double)size * sizeof(double) / 1e6,
+           save_ms, text_ms, read_ms, map_ms, map_ms + touch_ms);
+    loaded = Matrix<double>(1, 1);
+    remove(text_path);
+    remove(binary_path);
+}
+
+// Activations (m x k) times weights (k x n) with the weights, and the activations, stored in each
+// precision. Throughput counts 2 m n k operations; the error is the largest difference from the
+// double product relative to its largest entry. The int8 weights are stored transposed, one
+// scale per output column; quantizing the activations is part of the timed work.
+void benchmark_reduced(unsigned int m, unsigned int n, unsigned int k, int repeats) {
+    Matrix<double> x(m, k), w(k, n);
+    for (unsigned int i = 0; i < m; i++)
+        for (unsigned int j = 0; j < k; j++)
+            x[i][j] = rand() / (double)RAND_MAX * 2 - 1;
+    for (unsigned int i = 0; i < k; i++)
+        for (unsigned int j = 0; j < n; j++)
+            w[i][j] = (rand() / (double)RAND_MAX * 2 - 1) / std::sqrt(k);
+
+    Matrix<double> reference(1, 1);
+    const double double_ms = time_ms(repeats, [&] { reference = x * w; });
+    double scale = 0;
+    for (unsigned int i = 0; i < m; i++)
+        for (unsigned int j = 0; j < n; j++)
+            scale = std::max(scale, std::abs(reference[i][j]));
+    Matrix<float> result(1, 1);
+    const auto error = [&] {
+        double e = 0;
+        for (unsigned int i = 0; i < m; i++)
+            for (unsigned int j = 0; j < n; j++)
+                e = std::max(e, std::abs(result[i][j] - reference[i][j]));
+        return e / scale;
+    };
+    const double gops = 2.0 * m * n * k * 1e-6;
+    printf("Reduced precision, %ux%u times %ux%u: double %.1f GFLOPS\n", m, k, k, n, gops / double_ms);
+    const auto report = [&](const char* name, double ms, unsigned int bytes) {
+        printf("  %-8s %6.1f GFLOPS (%.2fx double), weights %4.0f MB, error %.1e\n", name, gops / ms, double_ms / ms,
+               (double)k * n * bytes / 1e6, error());
+    };
+
+    const Matrix<float> xf(x), wf(w);
+    report("float", time_ms(repeats, [&] { result = xf * wf; }), 4);
+    const Matrix<bfloat16> xb(x), wb(w);
+    report("bfloat16", time_ms(repeats, [&] { result = reduced_product(xb, wb); }), 2);
+    const Matrix<float16> xh(x), wh(w);
+    report("float16", time_ms(repeats, [&] { result = reduced_product(xh, wh); }), 2);
+    const QuantizedMatrix wq(w.transpose());
+    report("int8", time_ms(repeats, [&] { result = quantized_product(QuantizedMatrix(x), wq); }), 1);
+}
 
-    m * n;
-    
+// Usage: ./main [max threads], defaulting to the number of hardware threads.
+int main(int argc, char** argv) {
+    for (unsigned int size : {64, 255, 1000, 1024}) {
+        const int repeats = std::max(1u, 1000000000u / (size * size * size));
+        benchmark_gemm<float>("float", size, repeats);
+        benchmark_gemm<double>("double", size, repeats);
+    }
+    std::cout << "Small fixed-size matrices, per matrix:\n";
+    benchmark_fixed<2>(1 << 16, 20);
+    benchmark_fixed<3>(1 << 16, 20);
+    benchmark_fixed<4>(1 << 16, 20);
+    benchmark_fixed<6>(1 << 16, 5);
+    benchmark_factorizations();
+    benchmark_reduced(1024, 1024, 1024, 3);
+    benchmark_reduced(32, 4096, 4096, 3);
+    benchmark_strassen();
+    benchmark_transpose();
+    benchmark_views(2048);
+    benchmark_matrix_file(4096);
+    benchmark_expressions(256, 200);
+    benchmark_expressions(2000, 5);
+    const unsigned int max_threads = argc > 1 ? std::stoi(argv[1]) : std::thread::hardware_concurrency();
+    benchmark_scaling(std::max(1u, max_threads));
+    benchmark_sparse(std::max(1u, max_threads));
     return 0;
 }
@@ -7,20 +7,52 @@ void warn(const char* func, const char* message) {
 void warn(const char* func, const char* message) {}
 #endif
 
+util::thread_pool*& matrix_thread_pool() {
+    static util::thread_pool* pool = nullptr;
+    return pool;
+}
+
+void set_matrix_thread_pool(util::thread_pool* pool) {
+    matrix_thread_pool() = pool;
+}
+
+// Rows start on a cache line whenever whole elements fit in one. A stride that's a multiple of
+// 4KB gets one more line: otherwise every element of a column lands in the same cache set, and
+// anything walking down columns (transposes, packing B for a product) evicts its own lines.
+template<typename T>
+unsigned int Matrix<T>::padded_stride(unsigned int cols) {
+    const unsigned int per_line = 64 % sizeof(T) == 0 ? 64 / sizeof(T) : 1;
+    const unsigned int stride = (cols + per_line - 1) / per_line * per_line;
+    return stride * sizeof(T) % 4096 == 0 && per_line > 1 ? stride + per_line : stride;
+}
+
 // Standard constructor
 template<typename T>
 Matrix<T>::Matrix(unsigned int rows, unsigned int cols): 
-    m_rows(rows), m_cols(cols) {
-    m_data.resize(rows);
-    for (unsigned int i = 0; i < rows; i++) 
-        m_data[i].resize(cols);
+    m_rows(rows), m_cols(cols), m_stride(padded_stride(cols)),
+    m_data(make_aligned_array<T>((size_t)rows * m_stride)) {
+    std::fill(m_data.get(), m_data.get() + (size_t)rows * m_stride, T());
 }
 
+// Adopting constructor
+template<typename T>
+Matrix<T>::Matrix(unsigned int rows, unsigned int cols, aligned_array<T>&& data):
+    m_rows(rows), m_cols(cols), m_stride(padded_stride(cols)), m_data(std::move(data)) {}
+
 // Copy constructor
 template<typename T>
 Matrix<T>::Matrix(const Matrix<T>& rhs):
-    m_data(rhs.m_data), m_rows(rhs.m_rows), m_cols(rhs.m_cols)
-{ /* initialization list suffices */ }
+    m_rows(rhs.m_rows), m_cols(rhs.m_cols), m_stride(rhs.m_stride),
+    m_data(make_aligned_array<T>((size_t)m_rows * m_stride)) {
+    std::copy(rhs.m_data.get(), rhs.m_data.get() + (size_t)m_rows * m_stride, m_data.get());
+}
+
+// Move constructor
+template<typename T>
+Matrix<T>::Matrix(Matrix<T>&& rhs) noexcept:
+    m_rows(rhs.m_rows), m_cols(rhs.m_cols), m_stride(rhs.m_stride), m_data(std::move(rhs.m_data)) {
+    rhs.m_rows = rhs.m_cols = 0;
+}
 
 // Destructor
 template<typename T>
@@ -32,105 +64,102 @@ template<typename T>
 Matrix<T>& Matrix<T>::operator=(const Matrix<T>& rhs) {
     if (&rhs == this) 
         return *this;
-    
-    unsigned int new_rows = rhs.rows(), new_cols = rhs.cols();
-    
-    m_data.resize(new_rows);
-    for (unsigned int i = 0; i < new_rows; i++) {
-        m_data.resize(new_cols);
-    }   
-
-    for (unsigned int i = 0; i < new_rows; i++) {
-        for (unsigned int j = 0; j < new_cols; j++) {
-            m_data[i][j] = rhs[i][j];
-        }
-    }
 
-    m_rows = new_rows, m_cols = new_cols;
+    // Reuse our buffer when it's already the right size
+    if ((size_t)m_rows * m_stride != (size_t)rhs.m_rows * rhs.m_stride)
+        m_data = make_aligned_array<T>((size_t)rhs.m_rows * rhs.m_stride);
+    m_rows = rhs.m_rows, m_cols = rhs.m_cols, m_stride = rhs.m_stride;
+    std::copy(rhs.m_data.get(), rhs.m_data.get() + (size_t)m_rows * m_stride, m_data.get());
+    return *this;
+}
+
+template<typename T>
+Matrix<T>& Matrix<T>::operator=(Matrix<T>&& rhs) noexcept {
+    if (&rhs == this) 
+        return *this;
+    m_rows = rhs.m_rows, m_cols = rhs.m_cols, m_stride = rhs.m_stride;
+    m_data = std::move(rhs.m_data);
+    rhs.m_rows = rhs.m_cols = 0;
     return *this;
 }
 
 // Start mathematical operations
-// TODO: Most of these operations are embarassingly parallel
-//       BUT most of these can be parallelized using valarrays
+// Most of these are embarrassingly parallel: each output row depends only on the same row of
+// the inputs, so they're split by rows whenever the matrix is big enough to be worth it.
+
+template<typename F>
+void for_matrix_rows(unsigned int rows, unsigned int cols, F fn) {
+    util::thread_pool* pool = matrix_thread_pool();
+    const size_t elements = (size_t)rows * cols;
+    if (!pool || pool->size() == 1 || elements < MATRIX_PARALLEL_THRESHOLD) {
+        fn(0u, rows);
+        return;
+    }
+    const size_t grain = std::max<size_t>(1, MATRIX_PARALLEL_THRESHOLD / 4 / std::max(1u, cols));
+    pool->parallel_for(0, rows, grain, [&](size_t lo, size_t hi) { fn((unsigned int)lo, (unsigned int)hi); });
+}
 
 template<typename T>
-Matrix<T> Matrix<T>::operator+(const Matrix<T>& rhs) {
-    if (m_rows != rhs.m_rows)
-        warn("Matrix::operator+", "Inconsistent number of rows");
-    if (m_cols != rhs.m_cols)
-        warn("Matrix::operator+", "Inconsistent number of cols");
-    
-    Matrix result(m_rows, m_cols);
-    
-    for (unsigned int i = 0; i < m_rows; i++)
-        for (unsigned int j = 0; j < m_cols; j++)
-            result[i][j] = m_data[i][j] + rhs[i][j];
-        
-    return result;
+template<typename F>
+void Matrix<T>::for_rows(F fn) const {
+    for_matrix_rows(m_rows, m_cols, fn);
 }
 
 template<typename T>
-Matrix<T>& Matrix<T>::operator+=(const Matrix<T>& rhs) {
-    if (m_rows != rhs.m_rows)
-        warn("Matrix::operator+", "Inconsistent number of rows");
-    if (m_cols != rhs.m_cols)
-        warn("Matrix::operator+", "Inconsistent number of cols");
-
-    for (unsigned int i = 0; i < m_rows; i++)
-        for (unsigned int j = 0; j < m_cols; j++)
-            m_data[i][j] += rhs[i][j];
-        
-    return *this;
+template<typename E>
+void Matrix<T>::assign(const E& expr) {
+    for_rows([&](unsigned int lo, unsigned int hi) {
+        for (unsigned int i = lo; i < hi; i++) {
+            T* out = (*this)[i];
+            const auto row = expr.row_fn(i);
+            for (unsigned int j = 0; j < m_cols; j++)
+                out[j] = row(j);
+            std::fill(out + m_cols, out + m_stride, T());
+        }
+    });
 }
 
+// Expression constructor
 template<typename T>
-Matrix<T> Matrix<T>::operator-(const Matrix<T>& rhs) {
-    if (m_rows != rhs.m_rows)
-        warn("Matrix::operator-", "Inconsistent number of rows");
-    if (m_cols != rhs.m_cols)
-        warn("Matrix::operator-", "Inconsistent number of cols");
-    
-    Matrix<T> result(m_rows, m_cols);
-    
-    for (unsigned int i = 0; i < m_rows; i++)
-        for (unsigned int j = 0; j < m_cols; j++)
-            result[i][j] = m_data[i][j] - rhs[i][j];
-        
-    return result;
+template<typename E>
+Matrix<T>::Matrix(const MatrixExpr<E>& expr):
+    m_rows(expr.self().rows()), m_cols(expr.self().cols()), m_stride(padded_stride(m_cols)),
+    m_data(make_aligned_array<T>((size_t)m_rows * m_stride)) {
+    assign(expr.self());
 }
 
+// Elementwise expressions are evaluated in place, even when they refer to *this; anything that
+// may read other elements of *this (views, concatenations, Kronecker products) goes through a
+// temporary
 template<typename T>
-Matrix<T>& Matrix<T>::operator-=(const Matrix<T>& rhs) {
-    if (m_rows != rhs.m_rows)
-        warn("Matrix::operator-", "Inconsistent number of rows");
-    if (m_cols != rhs.m_cols)
-        warn("Matrix::operator-", "Inconsistent number of cols");
-
-    for (unsigned int i = 0; i < m_rows; i++)
-        for (unsigned int j = 0; j < m_cols; j++)
-            m_data[i][j] -= rhs[i][j];
-        
+template<typename E>
+Matrix<T>& Matrix<T>::operator=(const MatrixExpr<E>& expr) {
+    if (!matrix_is_elementwise<E>::value || expr.self().rows() != m_rows || expr.self().cols() != m_cols)
+        return *this = Matrix<T>(expr);
+    assign(expr.self());
     return *this;
 }
 
 template<typename T>
-Matrix<T> Matrix<T>::operator*(const Matrix<T>& rhs) {
+template<typename E>
+Matrix<T>& Matrix<T>::operator+=(const MatrixExpr<E>& rhs) {
+    return *this = *this + rhs;
+}
+
+template<typename T>
+template<typename E>
+Matrix<T>& Matrix<T>::operator-=(const MatrixExpr<E>& rhs) {
+    return *this = *this - rhs;
+}
+
+template<typename T>
+Matrix<T> Matrix<T>::operator*(const Matrix<T>& rhs) const {
     if (m_cols != rhs.m_rows)
         warn("Matrix::operator*", "Multiplying these won't work");
 
     Matrix<T> result(m_rows, rhs.m_cols);
-
-    for (unsigned int i = 0; i < m_rows; i++) {
-        for (unsigned int j = 0;  j < rhs.m_cols; j++) {
-            T sum = 0.0;
-            for (unsigned int k = 0; k < m_cols; k++) {
-                sum += m_data[i][k] * rhs.m_data[k][j];
-            }
-            result[i][j] = sum;
-        }
-    }
-
+    gemm<T>(m_rows, rhs.m_cols, m_cols, T(1), data(), m_stride, rhs.data(), rhs.m_stride,
+            T(0), result.data(), result.m_stride, matrix_thread_pool());
     return result;
 }
 
@@ -141,113 +170,96 @@ Matrix<T>& Matrix<T>::operator*=(const Matrix<T>& rhs) {
     return *this;
 }
 
-// TODO check loop order for cache locality??
 template<typename T>
-Matrix<T> Matrix<T>::transpose() {
-    Matrix<T> result(m_cols, m_rows);
-    for (int i = 0; i < m_cols; i++) {
-        for (int j = 0; j < m_rows; j++) {
-            result[i][j] = m_data[j][i];
-        }
-    }
-}
-
-// Scalar operations
-#define do_op(op) \
-template<typename T> \
-Matrix<T> Matrix<T>::operator op (const T& rhs) { \
-    Matrix<T> result(m_rows, m_cols); \
-    for (int i = 0; i < m_rows; i++) \
-        for (int j = 0; j < m_cols; j++) \
-            result[i][j] = m_data[i][j] op rhs; \
-    return result; \
-}
-do_op(+);
-do_op(-);
-do_op(*);
-do_op(/);
-#undef do_op
-
-template<typename T>
-Matrix<T> Matrix<T>::hadamard(const Matrix<T>& rhs) {
-    if (m_rows != rhs.m_rows)
-        warn("Matrix::hadamard", "Number of rows don't match up");
-    if (m_cols != rhs.m_cols)
-        warn("Matrix::hadamard", "Number of cols don't match up");
-
-    Matrix<T> result(m_rows, m_cols);
-    for (unsigned int i = 0; i < m_rows; i++) 
-        for (unsigned int j = 0; j < m_cols; j++)
-            result[i][j] = m_data[i][j] * rhs[i][j];
+Matrix<T> Matrix<T>::strassen(const Matrix<T>& rhs, unsigned int cutoff) const {
+    if (m_cols != rhs.m_rows)
+        warn("Matrix::strassen", "Multiplying these won't work");
 
+    Matrix<T> result(m_rows, rhs.m_cols);
+    ::strassen<T>(m_rows, rhs.m_cols, m_cols, data(), m_stride, rhs.data(), rhs.m_stride,
+                  result.data(), result.m_stride, cutoff, matrix_thread_pool());
     return result;
 }
 
+// Each task transposes a strip of source columns into a strip of result rows, see transpose.h
 template<typename T>
-Matrix<T> Matrix<T>::kronecker(const Matrix<T>& rhs) {
-    if (m_rows != 1 || rhs.m_cols != 1)
-        warn("Matrix::kronecker", "Arbitrary matrix kronecker not yet implemented");
-    
-    Matrix<T> result(m_cols, rhs.m_rows);
-    for (unsigned int i = 0; i < m_cols; i++)
-        for (unsigned int j = 0; j < rhs.m_rows; j++)
-            result[i][j] = m_data[0][i] * rhs[j][0];
-
+Matrix<T> Matrix<T>::transpose() const {
+    Matrix<T> result(m_cols, m_rows);
+    result.for_rows([&](unsigned int lo, unsigned int hi) {
+        ::transpose<T>(m_rows, hi - lo, data() + lo, m_stride, result[lo], result.m_stride);
+    });
     return result;
 }
 
+// A rectangular matrix is closed up to a dense array, transposed in place, then spread back out
+// to the new row stride.
 template<typename T>
-Matrix<T> Matrix<T>::concat(const Matrix<T>& rhs) {
-    if (m_rows != rhs.m_rows)
-        warn("Matrix::concat", "Number of rows doesn't match up");
-
-    Matrix<T> result(m_rows, m_cols + rhs.m_cols);
-    for (unsigned int i = 0; i < m_rows; i++) {
-        for (unsigned int j = 0, n = m_cols + rhs.m_cols; j < n; j++) {
-            if (j < m_cols)
-                result[i][j] = m_data[i][j];
-            else
-                result[i][j] = rhs[i][j - m_cols];
+Matrix<T>& Matrix<T>::transpose_in_place() {
+    if (m_rows == m_cols) {
+        transpose_square(m_rows, data(), m_stride);
+        return *this;
+    }
+    T* const base = data();
+    for (unsigned int i = 1; i < m_rows; i++)
+        std::move(base + (size_t)i * m_stride, base + (size_t)i * m_stride + m_cols, base + (size_t)i * m_cols);
+    transpose_dense<T>(m_rows, m_cols, base);
+
+    const unsigned int stride = padded_stride(m_rows);
+    if ((size_t)m_cols * stride > (size_t)m_rows * m_stride) {
+        aligned_array<T> spread = make_aligned_array<T>((size_t)m_cols * stride);
+        for (unsigned int i = 0; i < m_cols; i++) {
+            std::move(base + (size_t)i * m_rows, base + (size_t)(i + 1) * m_rows, spread.get() + (size_t)i * stride);
+            std::fill(spread.get() + (size_t)i * stride + m_rows, spread.get() + (size_t)(i + 1) * stride, T());
+        }
+        m_data = std::move(spread);
+    } else {
+        for (unsigned int i = m_cols; i-- > 0;) {
+            std::move_backward(base + (size_t)i * m_rows, base + (size_t)(i + 1) * m_rows, base + (size_t)i * stride + m_rows);
+            std::fill(base + (size_t)i * stride + m_rows, base + (size_t)(i + 1) * stride, T());
         }
     }
-    return result;
+    std::swap(m_rows, m_cols);
+    m_stride = stride;
+    return *this;
 }
 
 template<typename T>
-std::vector<T> Matrix<T>::operator*(const std::vector<T>& rhs) {
+std::vector<T> Matrix<T>::operator*(const std::vector<T>& rhs) const {
     if (rhs.size() != m_cols)
         warn("Matrix::operator*(vector)", "Cannot multiply vector");
 
     std::vector<T> result;
     result.resize(m_rows);
-    for (unsigned int i = 0; i < m_rows; i++) {
-        double sum = 0.0;
-        for (unsigned int j = 0; j < m_cols; j++) {
-            sum += m_data[i][j] * rhs[j];
+    for_rows([&](unsigned int lo, unsigned int hi) {
+        for (unsigned int i = lo; i < hi; i++) {
+            double sum = 0.0;
+            for (unsigned int j = 0; j < m_cols; j++) {
+                sum += (*this)[i][j] * rhs[j];
+            }
+            result[i] = sum;
         }
-        result[i] = sum;
-    }
+    });
     return result;
 }
 
 
 // Accessors
 template<typename T>
-std::vector<T>& Matrix<T>::operator[] (const unsigned int x) {
-    return m_data[x];
+T* Matrix<T>::operator[] (const unsigned int x) {
+    return m_data.get() + (size_t)x * m_stride;
 }
 
 template<typename T>
-const std::vector<T>& Matrix<T>::operator[] (const unsigned int x) const
+const T* Matrix<T>::operator[] (const unsigned int x) const
 {
-    return m_data[x];
+    return m_data.get() + (size_t)x * m_stride;
 }
 
 template<typename T>
 void Matrix<T>::debug() const {
     for (unsigned int i = 0; i < m_rows; i++) {
         for (unsigned int j = 0; j < m_cols; j++) {
-            printf("%3.3lf ", m_data[i][j]);
+            printf("%3.3lf ", (double)(*this)[i][j]);
         }
         printf("\n");
     }
@@ -258,3 +270,12 @@ unsigned int Matrix<T>::rows() const { return m_rows; }
 
 template<typename T>
 unsigned int Matrix<T>::cols() const { return m_cols; }
+
+template<typename T>
+unsigned int Matrix<T>::stride() const { return m_stride; }
+
+template<typename T>
+T* Matrix<T>::data() { return m_data.get(); }
+
+template<typename T>
+const T* Matrix<T>::data() const { return m_data.get(); }
@@ -4,55 +4,113 @@
 
 #include <vector>
 #include <cstdint>
+#include <cstdio>
+#include "gemm.h"
+#include "expression.h"
+#include "transpose.h"
+#include "strassen.h"
 
-// TODO optimize possibly with valarrays instead?
 // TODO make everything const correct?
 
-template <typename T> class Matrix {
+// Large operations (products, elementwise ops, matrix-vector products) are split across this pool
+// when one is set; by default everything runs on the calling thread. The pool must outlive any
+// operation using it.
+util::thread_pool*& matrix_thread_pool();
+void set_matrix_thread_pool(util::thread_pool* pool);
+
+// Elementwise work below this many elements stays on the calling thread
+constexpr size_t MATRIX_PARALLEL_THRESHOLD = 1 << 16;
+
+// Calls fn(lo, hi) on ranges of rows of a rows x cols matrix covering all of it, concurrently on
+// matrix_thread_pool() if it's large
+template<typename F> void for_matrix_rows(unsigned int rows, unsigned int cols, F fn);
+
+template <typename T> class MatrixView;
+
+// Elements live in one cache-line aligned buffer, row-major. Rows are padded to a whole number
+// of cache lines, so element (i, j) is at data()[i * stride() + j].
+//
+// Elementwise arithmetic (+, -, hadamard, scalar ops) is lazy, see expression.h, as are the
+// views, concatenations and Kronecker products in view.h; products, the transpose and the rest
+// are computed immediately.
+template <typename T> class Matrix<T, MATRIX_DYNAMIC, MATRIX_DYNAMIC> : public MatrixExpr<Matrix<T>> {
     private:
-        std::vector<std::vector<T> > m_data;
-        unsigned int m_cols, m_rows;
+        unsigned int m_rows, m_cols, m_stride;
+        aligned_array<T> m_data;
+
+        // Calls fn(lo, hi) on ranges of rows covering the matrix, concurrently if it's large
+        template<typename F> void for_rows(F fn) const;
+        // Evaluates expr into our (already sized) buffer, padding included
+        template<typename E> void assign(const E& expr);
     public:
-        // Standard constructor
+        using value_type = T;
+        static constexpr bool is_matrix = true;
+
+        // Elements from the start of one row to the next in a rows x cols matrix
+        static unsigned int padded_stride(unsigned int cols);
+
+        // Standard constructor (zero-filled)
         Matrix(unsigned int rows, unsigned int cols);
+        // Takes over a buffer laid out as ours would be, rows x padded_stride(cols) elements
+        Matrix(unsigned int rows, unsigned int cols, aligned_array<T>&& data);
         // Copy constructor
         Matrix(const Matrix<T>& rhs); 
+        Matrix(Matrix<T>&& rhs) noexcept;
+        // Evaluates an elementwise expression
+        template<typename E> Matrix(const MatrixExpr<E>& expr);
         // Destructor
         virtual ~Matrix();
 
         // Standard mathematical operations
         Matrix<T>& operator=(const Matrix<T>& rhs);
+        Matrix<T>& operator=(Matrix<T>&& rhs) noexcept;
+        template<typename E> Matrix<T>& operator=(const MatrixExpr<E>& expr);
 
-        Matrix<T> operator+(const Matrix<T>& rhs);
-        Matrix<T>& operator+=(const Matrix<T>& rhs);
-        Matrix<T> operator-(const Matrix<T>& rhs);
-        Matrix<T>& operator-=(const Matrix<T>& rhs);
-        Matrix<T> operator*(const Matrix<T>& rhs);
+        template<typename E> Matrix<T>& operator+=(const MatrixExpr<E>& rhs);
+        template<typename E> Matrix<T>& operator-=(const MatrixExpr<E>& rhs);
+        Matrix<T> operator*(const Matrix<T>& rhs) const;
         Matrix<T>& operator*=(const Matrix<T>& rhs);
-        Matrix<T> transpose();
-
-        Matrix<T> operator+(const T& rhs);
-        Matrix<T> operator-(const T& rhs);
-        Matrix<T> operator*(const T& rhs);
-        Matrix<T> operator/(const T& rhs);
-    
-        Matrix<T> hadamard(const Matrix<T>& rhs);
-        Matrix<T> kronecker(const Matrix<T>& rhs);
-        Matrix<T> concat(const Matrix<T>& rhs);
-
-        std::vector<T> operator*(const std::vector<T>& rhs);
+        // Strassen-Winograd product, classical below the cutoff; see strassen.h for the accuracy
+        Matrix<T> strassen(const Matrix<T>& rhs, unsigned int cutoff = STRASSEN_CUTOFF) const;
+        Matrix<T> transpose() const;
+        // Transposes without a second buffer (unless the padded result needs more room)
+        Matrix<T>& transpose_in_place();
+
+        // Copies; hconcat() and kronecker() in view.h give the same thing lazily
+        Matrix<T> kronecker(const Matrix<T>& rhs) const;
+        Matrix<T> concat(const Matrix<T>& rhs) const;
+
+        // Non-owning views of part of the matrix, see view.h. Writing through a view writes here.
+        MatrixView<T> submatrix(unsigned int row, unsigned int col, unsigned int rows, unsigned int cols);
+        MatrixView<const T> submatrix(unsigned int row, unsigned int col, unsigned int rows, unsigned int cols) const;
+        MatrixView<T> row(unsigned int i);
+        MatrixView<const T> row(unsigned int i) const;
+        MatrixView<T> col(unsigned int j);
+        MatrixView<const T> col(unsigned int j) const;
+        MatrixView<T> view();
+        MatrixView<const T> view() const;
+
+        std::vector<T> operator*(const std::vector<T>& rhs) const;
         std::vector<T> diag_vec();
         
-        // Included this so users can do m[0][0] rather than m(0, 0)
-        std::vector<T>& operator[] (const unsigned int x);
-        const std::vector<T>& operator[] (const unsigned int x) const;
+        // Included this so users can do m[0][0] rather than m(0, 0); returns a pointer to row x
+        T* operator[] (const unsigned int x);
+        const T* operator[] (const unsigned int x) const;
+
+        // Element j of row i is row_fn(i)(j); this is how expressions read their Matrix leaves
+        auto row_fn(unsigned int i) const { return [row = (*this)[i]](unsigned int j) { return row[j]; }; }
 
         unsigned int rows() const;
         unsigned int cols() const;
+        unsigned int stride() const;
+        T* data();
+        const T* data() const;
 
         // DEBUG
         void debug() const;
 };
 
 #include "matrix.cpp"
+#include "fixed.h"
+#include "view.h"
 #endif
@@ -0,0 +1,242 @@
+#ifndef MATRIX_FILE_H
+#define MATRIX_FILE_H
+
+// A binary file format for Matrix<T> that can be used in place. The file is a 64-byte header,
+// zeros up to the next page, then the elements exactly as a Matrix keeps them in memory: row
+// after row, each padded to padded_stride(cols) elements. map_matrix() therefore maps the
+// elements straight into a Matrix, with nothing parsed or copied; pages come in from the page
+// cache as they are first touched, and a second process mapping the same file shares them.
+//
+// Numbers are stored in the machine's byte order (little-endian on everything this runs on).
+// Files are written by save_matrix() or, for matrices that don't fit in memory, a block of rows
+// at a time by MatrixFileWriter.
+
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "matrix.h"
+
+// Byte offset of the elements: a page, so they can be mapped on their own and start aligned
+constexpr uint64_t MATRIX_FILE_OFFSET = 4096;
+constexpr char MATRIX_FILE_MAGIC[8] = {'M', 'A', 'T', 'R', 'I', 'X', '0', '1'};
+
+// Element type codes; other element types can't be saved
+template <typename T> struct matrix_dtype;
+template <> struct matrix_dtype<float> { static constexpr uint32_t code = 1; };
+template <> struct matrix_dtype<double> { static constexpr uint32_t code = 2; };
+template <> struct matrix_dtype<int32_t> { static constexpr uint32_t code = 3; };
+template <> struct matrix_dtype<int64_t> { static constexpr uint32_t code = 4; };
+
+struct MatrixFileHeader {
+    char magic[8];
+    uint32_t dtype;
+    uint32_t element_size;
+    uint64_t rows, cols;
+    // Elements from the start of one row to the next
+    uint64_t stride;
+    // Bytes from the start of the file to row 0
+    uint64_t offset;
+    // Every row starts on a multiple of this many bytes, counting from the start of the file
+    uint64_t alignment;
+    uint64_t reserved;
+};
+static_assert(sizeof(MatrixFileHeader) == 64, "MatrixFileHeader is laid out by hand");
+
+template <typename T>
+MatrixFileHeader matrix_file_header(uint64_t rows, uint64_t cols) {
+    MatrixFileHeader header = {};
+    std::memcpy(header.magic, MATRIX_FILE_MAGIC, sizeof(header.magic));
+    header.dtype = matrix_dtype<T>::code;
+    header.element_size = sizeof(T);
+    header.rows = rows, header.cols = cols;
+    header.stride = Matrix<T>::padded_stride(cols);
+    header.offset = MATRIX_FILE_OFFSET;
+    header.alignment = 64;
+    return header;
+}
+
+// Reads and checks the header of a file holding a Matrix<T>
+template <typename T>
+bool read_matrix_header(int fd, MatrixFileHeader& header) {
+    if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        std::memcmp(header.magic, MATRIX_FILE_MAGIC, sizeof(header.magic)) != 0) {
+        warn("read_matrix_header", "Not a matrix file");
+        return false;
+    }
+    if (header.dtype != matrix_dtype<T>::code || header.element_size != sizeof(T)) {
+        warn("read_matrix_header", "Matrix file holds a different element type");
+        return false;
+    }
+    // The dimensions have to fit a Matrix, and the extent of the elements a file
+    uint64_t bytes, end;
+    if (header.rows > UINT_MAX || header.cols > UINT_MAX || header.stride < header.cols ||
+        Matrix<T>::padded_stride(header.cols) < header.cols || header.offset < sizeof(header) ||
+        __builtin_mul_overflow(header.rows, header.stride, &bytes) ||
+        __builtin_mul_overflow(bytes, sizeof(T), &bytes) || __builtin_add_overflow(bytes, header.offset, &end)) {
+        warn("read_matrix_header", "Matrix file header is corrupt");
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < end) {
+        warn("read_matrix_header", "Matrix file is truncated");
+        return false;
+    }
+    return true;
+}
+
+// Appends a matrix a block of rows at a time, so it never has to be in memory as a whole. The
+// row count goes into the header when the writer is closed.
+template <typename T> class MatrixFileWriter {
+    private:
+        FILE* m_file;
+        unsigned int m_cols;
+        uint64_t m_rows = 0;
+        std::vector<T> m_row;
+        bool m_ok;
+    public:
+        MatrixFileWriter(const char* path, unsigned int cols):
+            m_file(fopen(path, "wb")), m_cols(cols), m_row(Matrix<T>::padded_stride(cols)), m_ok(m_file != nullptr) {
+            if (!m_ok) {
+                warn("MatrixFileWriter::MatrixFileWriter", "Cannot open file");
+                return;
+            }
+            const MatrixFileHeader header = matrix_file_header<T>(0, cols);
+            std::vector<char> head(MATRIX_FILE_OFFSET);
+            std::memcpy(head.data(), &header, sizeof(header));
+            m_ok = fwrite(head.data(), 1, head.size(), m_file) == head.size();
+        }
+        MatrixFileWriter(const MatrixFileWriter&) = delete;
+        MatrixFileWriter& operator=(const MatrixFileWriter&) = delete;
+        ~MatrixFileWriter() { close(); }
+
+        // Appends the rows of a Matrix, view or expression with cols() columns
+        template <typename E> bool write(const MatrixExpr<E>& block);
+
+        // Writes the header; false if anything written so far failed
+        bool close();
+        uint64_t rows() const { return m_rows; }
+};
+
+template <typename T>
+template <typename E>
+bool MatrixFileWriter<T>::write(const MatrixExpr<E>& block) {
+    const E& e = block.self();
+    if (e.cols() != m_cols) {
+        warn("MatrixFileWriter::write", "Number of cols doesn't match up");
+        return m_ok = false;
+    }
+    // Rows already in memory are written from where they are, then the padding from m_row, which
+    // stays zero past m_cols
+    const size_t padding = m_row.size() - m_cols;
+    for (unsigned int i = 0; i < e.rows() && m_ok; i++) {
+        if constexpr (matrix_is_strided<E>::value) {
+            m_ok = fwrite(e[i], sizeof(T), m_cols, m_file) == m_cols &&
+                   fwrite(m_row.data() + m_cols, sizeof(T), padding, m_file) == padding;
+        } else {
+            const auto row = e.row_fn(i);
+            for (unsigned int j = 0; j < m_cols; j++)
+                m_row[j] = row(j);
+            m_ok = fwrite(m_row.data(), sizeof(T), m_row.size(), m_file) == m_row.size();
+        }
+        // Only whole rows count
+        m_rows += m_ok;
+    }
+    return m_ok;
+}
+
+template <typename T>
+bool MatrixFileWriter<T>::close() {
+    if (!m_file)
+        return m_ok;
+    const MatrixFileHeader header = matrix_file_header<T>(m_rows, m_cols);
+    m_ok &= fseek(m_file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, m_file) == 1;
+    m_ok &= fclose(m_file) == 0;
+    m_file = nullptr;
+    return m_ok;
+}
+
+// Writes m to path; false on failure
+template <typename T>
+bool save_matrix(const char* path, const Matrix<T>& m) {
+    MatrixFileWriter<T> writer(path, m.cols());
+    return writer.write(m) && writer.close();
+}
+
+// Reads a matrix into freshly allocated memory, for when the file is going away or the matrix is
+// about to be overwritten anyway. An empty matrix on failure.
+template <typename T>
+Matrix<T> load_matrix(const char* path) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        warn("load_matrix", "Cannot open file");
+        return Matrix<T>(0, 0);
+    }
+    MatrixFileHeader header;
+    if (!read_matrix_header<T>(fd, header)) {
+        close(fd);
+        return Matrix<T>(0, 0);
+    }
+    Matrix<T> result(header.rows, header.cols);
+    bool ok = true;
+    if (header.stride == result.stride()) {
+        const size_t bytes = header.rows * header.stride * sizeof(T);
+        for (size_t done = 0; done < bytes && ok;) {
+            const ssize_t n = pread(fd, (char*)result.data() + done, bytes - done, header.offset + done);
+            ok = n > 0;
+            done += std::max<ssize_t>(n, 0);
+        }
+    } else {
+        for (unsigned int i = 0; i < header.rows && ok; i++)
+            ok = pread(fd, result[i], header.cols * sizeof(T), header.offset + i * header.stride * sizeof(T)) ==
+                 (ssize_t)(header.cols * sizeof(T));
+    }
+    close(fd);
+    if (!ok) {
+        warn("load_matrix", "Cannot read file");
+        return Matrix<T>(0, 0);
+    }
+    return result;
+}
+
+// A Matrix whose elements are the file's, mapped rather than read. Writes to a writable mapping
+// go to the file; otherwise they stay private to this Matrix (copy on write), though pages it
+// hasn't written still show later changes to the file. The file can be renamed or deleted while
+// the Matrix is alive, but not truncated. Falls back to load_matrix() for files
+// whose layout isn't the one Matrix uses.
+template <typename T>
+Matrix<T> map_matrix(const char* path, bool writable = false) {
+    const int fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        warn("map_matrix", "Cannot open file");
+        return Matrix<T>(0, 0);
+    }
+    MatrixFileHeader header;
+    if (!read_matrix_header<T>(fd, header)) {
+        close(fd);
+        return Matrix<T>(0, 0);
+    }
+    const size_t bytes = header.rows * header.stride * sizeof(T);
+    if (header.stride != Matrix<T>::padded_stride(header.cols) || header.offset % sysconf(_SC_PAGESIZE) != 0 ||
+        bytes == 0) {
+        close(fd);
+        if (writable)
+            warn("map_matrix", "Matrix file can't be mapped, reading a copy instead");
+        return load_matrix<T>(path);
+    }
+    void* map = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, writable ? MAP_SHARED : MAP_PRIVATE, fd, header.offset);
+    close(fd);
+    if (map == MAP_FAILED) {
+        warn("map_matrix", "Cannot map file");
+        return Matrix<T>(0, 0);
+    }
+    aligned_array<T> data(static_cast<T*>(map), aligned_delete{[](void* ptr, size_t size) { munmap(ptr, size); }, bytes});
+    return Matrix<T>(header.rows, header.cols, std::move(data));
+}
+
+#endif
@@ -0,0 +1,381 @@
+#ifndef MATRIX_REDUCED_H
+#define MATRIX_REDUCED_H
+
+// Reduced-precision storage for products that are limited by memory bandwidth rather than
+// arithmetic, e.g. large weight matrices applied to a few rows of activations.
+//
+// bfloat16 and float16 are 16-bit storage types: a Matrix<bfloat16> converts from and to any other
+// Matrix elementwise (rounding to nearest even), and reduced_product() multiplies them through
+// gemm, which widens them to float while packing, so memory traffic halves and the arithmetic
+// (and accumulation) stays float. bfloat16 keeps float's range with 8 bits of precision; float16
+// has 11 bits of precision but overflows past 65504.
+//
+// QuantizedMatrix stores each row as int8 times a float scale. quantized_product() multiplies two
+// of them, A B^T (both operands row-quantized, as activations and weights usually are), with
+// int32 accumulation over up to QUANTIZED_BLOCK terms at a time, the scales being applied once per
+// block.
+//
+// Conversions and kernels use AVX2 (and F16C for float16) when the CPU has them, checked once at
+// runtime, and portable loops otherwise.
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <immintrin.h>
+#include "matrix.h"
+
+struct bfloat16 {
+    uint16_t bits = 0;
+
+    bfloat16() = default;
+    bfloat16(float value) {
+        uint32_t x;
+        std::memcpy(&x, &value, sizeof(x));
+        if ((x & 0x7fffffff) > 0x7f800000)
+            bits = (x >> 16) | 0x40;  // quiet NaN
+        else
+            bits = (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+    }
+    operator float() const {
+        const uint32_t x = (uint32_t)bits << 16;
+        float value;
+        std::memcpy(&value, &x, sizeof(value));
+        return value;
+    }
+};
+
+struct float16 {
+    uint16_t bits = 0;
+
+    float16() = default;
+    float16(float value) {
+        uint32_t x;
+        std::memcpy(&x, &value, sizeof(x));
+        const uint16_t sign = (x >> 16) & 0x8000;
+        x &= 0x7fffffff;
+        if (x > 0x7f800000)
+            bits = sign | 0x7e00;  // quiet NaN
+        else if (x >= 0x477ff000)
+            bits = sign | 0x7c00;  // 65520 and up round to infinity
+        else if (x < 0x38800000)
+            bits = sign | (uint16_t)std::nearbyint(std::fabs(value) * 16777216.0f);  // subnormal, in units of 2^-24
+        else
+            bits = sign | ((x - (112u << 23) + 0xfff + ((x >> 13) & 1)) >> 13);
+    }
+    operator float() const {
+        const uint32_t sign = (uint32_t)(bits & 0x8000) << 16, exponent = (bits >> 10) & 0x1f, mantissa = bits & 0x3ff;
+        if (exponent == 0) {
+            const float value = mantissa * (1.0f / 16777216.0f);
+            return sign ? -value : value;
+        }
+        const uint32_t x = sign | (exponent == 31 ? 0x7f800000 : (exponent + 112) << 23) | mantissa << 13;
+        float value;
+        std::memcpy(&value, &x, sizeof(value));
+        return value;
+    }
+};
+
+// Widening conversions for gemm's packing, which calls them a panel row at a time
+
+__attribute__((target("avx2")))
+inline void convert_bfloat16_avx2(const bfloat16* src, float* dst, const size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256i wide = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)));
+        _mm256_storeu_ps(dst + i, _mm256_castsi256_ps(_mm256_slli_epi32(wide, 16)));
+    }
+    for (; i < n; ++i) dst[i] = src[i];
+}
+
+__attribute__((target("avx,f16c")))
+inline void convert_float16_f16c(const float16* src, float* dst, const size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i))));
+    for (; i < n; ++i) dst[i] = src[i];
+}
+
+template <typename S>
+void convert_generic(const S* src, float* dst, const size_t n) {
+    for (size_t i = 0; i < n; ++i) dst[i] = src[i];
+}
+
+inline void gemm_convert(const bfloat16* src, float* dst, const size_t n) {
+    static void (*const convert)(const bfloat16*, float*, size_t) = [] {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") ? &convert_bfloat16_avx2 : &convert_generic<bfloat16>;
+    }();
+    convert(src, dst, n);
+}
+
+inline void gemm_convert(const float16* src, float* dst, const size_t n) {
+    static void (*const convert)(const float16*, float*, size_t) = [] {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c") ? &convert_float16_f16c
+                                                                                 : &convert_generic<float16>;
+    }();
+    convert(src, dst, n);
+}
+
+// A B in float, for A and B stored as float, bfloat16 or float16, in any mix
+template <typename A, typename B>
+Matrix<float> reduced_product(const Matrix<A>& a, const Matrix<B>& b) {
+    if (a.cols() != b.rows())
+        warn("reduced_product", "Multiplying these won't work");
+
+    Matrix<float> result(a.rows(), b.cols());
+    gemm<float>(a.rows(), b.cols(), a.cols(), 1.0f, a.data(), a.stride(), b.data(), b.stride(), 0.0f, result.data(),
+                result.stride(), matrix_thread_pool());
+    return result;
+}
+
+// int8 products. The blocking is gemm's, with int8 widened to int16 while packing and k taken in
+// pairs, so that one madd multiplies two k-steps of an MR x NR tile column at once:
+// panel[(q * R + i) * 2 + r] is element 2q + r of row i, for R = MR rows of A or NR rows of B^T.
+
+// Terms summed in int32 before scaling. With |q| <= 127 this could be far larger before
+// overflowing; it's the depth of a packed block.
+constexpr size_t QUANTIZED_BLOCK = 512;
+
+struct gemm_int8_blocking {
+    static constexpr size_t MR = 6;
+    static constexpr size_t NR = 16;
+    static constexpr size_t KC = QUANTIZED_BLOCK;
+    static constexpr size_t MC = 120;
+    static constexpr size_t NC = 2048;
+};
+
+// Packs one full 16-row panel, kc a multiple of 16: each 8 rows x 16 k block is widened to 8 x 8
+// pairs and transposed in registers, so nothing goes through memory an element at a time.
+__attribute__((target("avx2")))
+inline void gemm_int8_pack16_avx2(const size_t kc, const int8_t* src, const size_t ld, int16_t* packed) {
+    for (size_t p0 = 0; p0 < kc; p0 += 16) {
+        for (size_t half = 0; half < 2; ++half) {
+            __m256i r[8], t[8];
+            for (size_t i = 0; i < 8; ++i)
+                r[i] = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + (8 * half + i) * ld + p0)));
+            for (size_t i = 0; i < 8; i += 2) {
+                t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+                t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+            }
+            for (size_t i = 0; i < 8; i += 4) {
+                r[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+                r[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+                r[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+                r[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+            }
+            // r[q] and r[q + 4] now hold pairs q and q + 4 of rows 0-3 and 4-7, one per 128-bit half
+            for (size_t q = 0; q < 4; ++q) {
+                int16_t* out = packed + (p0 / 2 + q) * 32 + 16 * half;
+                _mm256_store_si256(reinterpret_cast<__m256i*>(out), _mm256_permute2x128_si256(r[q], r[q + 4], 0x20));
+                _mm256_store_si256(reinterpret_cast<__m256i*>(out + 4 * 32), _mm256_permute2x128_si256(r[q], r[q + 4], 0x31));
+            }
+        }
+    }
+}
+
+template <size_t R>
+void gemm_int8_pack(const size_t rows, const size_t kc, const int8_t* src, const size_t ld, int16_t* packed) {
+    static const bool avx2 = [] {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+    }();
+    const size_t pairs = (kc + 1) / 2;
+    for (size_t i0 = 0; i0 < rows; i0 += R, packed += 2 * R * pairs) {
+        const size_t height = std::min(R, rows - i0);
+        if (R == 16 && avx2 && height == R && kc % 16 == 0) {
+            gemm_int8_pack16_avx2(kc, src + i0 * ld, ld, packed);
+            continue;
+        }
+        for (size_t i = 0; i < R; ++i) {
+            const int8_t* row = src + (i0 + i) * ld;
+            for (size_t p = 0; p < 2 * pairs; ++p)
+                packed[(p / 2 * R + i) * 2 + p % 2] = i < height && p < kc ? row[p] : 0;
+        }
+    }
+}
+
+// tile[MR x NR] = A_panel B_panel^T, over `pairs` pairs of k
+inline void gemm_int8_kernel_generic(const size_t pairs, const int16_t* a, const int16_t* b, int32_t* tile) {
+    constexpr size_t MR = gemm_int8_blocking::MR, NR = gemm_int8_blocking::NR;
+    int32_t acc[MR][NR] = {};
+    for (size_t q = 0; q < pairs; ++q, a += 2 * MR, b += 2 * NR)
+        for (size_t i = 0; i < MR; ++i)
+            for (size_t j = 0; j < NR; ++j)
+                acc[i][j] += a[2 * i] * b[2 * j] + a[2 * i + 1] * b[2 * j + 1];
+    std::memcpy(tile, acc, sizeof(acc));
+}
+
+// Both k-steps of row i of an A panel, in every 32-bit lane
+__attribute__((target("avx2")))
+inline __m256i gemm_int8_broadcast(const int16_t* pair) {
+    int32_t v;
+    std::memcpy(&v, pair, sizeof(v));
+    return _mm256_set1_epi32(v);
+}
+
+__attribute__((target("avx2")))
+inline void gemm_int8_kernel_avx2(const size_t pairs, const int16_t* a, const int16_t* b, int32_t* tile) {
+    __m256i c00 = _mm256_setzero_si256(), c01 = _mm256_setzero_si256(), c10 = _mm256_setzero_si256(),
+            c11 = _mm256_setzero_si256(), c20 = _mm256_setzero_si256(), c21 = _mm256_setzero_si256(),
+            c30 = _mm256_setzero_si256(), c31 = _mm256_setzero_si256(), c40 = _mm256_setzero_si256(),
+            c41 = _mm256_setzero_si256(), c50 = _mm256_setzero_si256(), c51 = _mm256_setzero_si256();
+    for (size_t q = 0; q < pairs; ++q, a += 12, b += 32) {
+        const __m256i b0 = _mm256_load_si256(reinterpret_cast<const __m256i*>(b)),
+                      b1 = _mm256_load_si256(reinterpret_cast<const __m256i*>(b + 16));
+        __m256i ai = gemm_int8_broadcast(a + 0);
+        c00 = _mm256_add_epi32(c00, _mm256_madd_epi16(ai, b0)); c01 = _mm256_add_epi32(c01, _mm256_madd_epi16(ai, b1));
+        ai = gemm_int8_broadcast(a + 2);
+        c10 = _mm256_add_epi32(c10, _mm256_madd_epi16(ai, b0)); c11 = _mm256_add_epi32(c11, _mm256_madd_epi16(ai, b1));
+        ai = gemm_int8_broadcast(a + 4);
+        c20 = _mm256_add_epi32(c20, _mm256_madd_epi16(ai, b0)); c21 = _mm256_add_epi32(c21, _mm256_madd_epi16(ai, b1));
+        ai = gemm_int8_broadcast(a + 6);
+        c30 = _mm256_add_epi32(c30, _mm256_madd_epi16(ai, b0)); c31 = _mm256_add_epi32(c31, _mm256_madd_epi16(ai, b1));
+        ai = gemm_int8_broadcast(a + 8);
+        c40 = _mm256_add_epi32(c40, _mm256_madd_epi16(ai, b0)); c41 = _mm256_add_epi32(c41, _mm256_madd_epi16(ai, b1));
+        ai = gemm_int8_broadcast(a + 10);
+        c50 = _mm256_add_epi32(c50, _mm256_madd_epi16(ai, b0)); c51 = _mm256_add_epi32(c51, _mm256_madd_epi16(ai, b1));
+    }
+    const __m256i rows[6][2] = {{c00, c01}, {c10, c11}, {c20, c21}, {c30, c31}, {c40, c41}, {c50, c51}};
+    for (int i = 0; i < 6; ++i)
+        for (int h = 0; h < 2; ++h)
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(tile + i * 16 + 8 * h), rows[i][h]);
+}
+
+// C = diag(a_scales) A B^T diag(b_scales) (+ C when accumulate), where A is m x k and B is n x k,
+// both int8 and row-major, and C is m x n float.
+inline void gemm_int8_serial(const size_t m, const size_t n, const size_t k, const int8_t* a, const size_t lda,
+                             const float* a_scales, const int8_t* b, const size_t ldb, const float* b_scales, float* c,
+                             const size_t ldc) {
+    using blocking = gemm_int8_blocking;
+    constexpr size_t MR = blocking::MR, NR = blocking::NR;
+    using kernel_fn = void (*)(size_t, const int16_t*, const int16_t*, int32_t*);
+    static const kernel_fn kernel = [] {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") ? &gemm_int8_kernel_avx2 : &gemm_int8_kernel_generic;
+    }();
+    static thread_local aligned_array<int16_t> packed_a, packed_b;
+    static thread_local size_t size_a = 0, size_b = 0;
+    const size_t need_a = blocking::MC * (blocking::KC + 1),
+                 need_b = (blocking::KC + 1) * (std::min(n, blocking::NC) + NR);
+    if (size_a < need_a) packed_a = make_aligned_array<int16_t>(size_a = need_a);
+    if (size_b < need_b) packed_b = make_aligned_array<int16_t>(size_b = need_b);
+    alignas(64) int32_t tile[MR * NR];
+
+    if (k == 0)
+        for (size_t i = 0; i < m; ++i)
+            std::fill(c + i * ldc, c + i * ldc + n, 0.0f);
+    for (size_t jc = 0; jc < n; jc += blocking::NC) {
+        const size_t nc = std::min(blocking::NC, n - jc);
+        for (size_t pc = 0; pc < k; pc += blocking::KC) {
+            const size_t kc = std::min(blocking::KC, k - pc), pairs = (kc + 1) / 2;
+            gemm_int8_pack<NR>(nc, kc, b + jc * ldb + pc, ldb, packed_b.get());
+            for (size_t ic = 0; ic < m; ic += blocking::MC) {
+                const size_t mc = std::min(blocking::MC, m - ic);
+                gemm_int8_pack<MR>(mc, kc, a + ic * lda + pc, lda, packed_a.get());
+                for (size_t jr = 0; jr < nc; jr += NR) {
+                    const size_t cols = std::min(NR, nc - jr);
+                    for (size_t ir = 0; ir < mc; ir += MR) {
+                        const size_t rows = std::min(MR, mc - ir);
+                        kernel(pairs, packed_a.get() + 2 * ir * pairs, packed_b.get() + 2 * jr * pairs, tile);
+                        for (size_t i = 0; i < rows; ++i) {
+                            const float scale = a_scales[ic + ir + i];
+                            const float* column_scales = b_scales + jc + jr;
+                            float* row = c + (ic + ir + i) * ldc + jc + jr;
+                            for (size_t j = 0; j < cols; ++j) {
+                                const float value = scale * column_scales[j] * tile[i * NR + j];
+                                row[j] = pc == 0 ? value : row[j] + value;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// As gemm_int8_serial, split into tiles like gemm_tiled when given a pool and enough work
+inline void gemm_int8(const size_t m, const size_t n, const size_t k, const int8_t* a, const size_t lda,
+                      const float* a_scales, const int8_t* b, const size_t ldb, const float* b_scales, float* c,
+                      const size_t ldc, util::thread_pool* pool = nullptr) {
+    using blocking = gemm_int8_blocking;
+    if (m == 0 || n == 0) return;
+    if (!pool || pool->size() == 1 || (double)m * n * k < GEMM_PARALLEL_THRESHOLD) {
+        gemm_int8_serial(m, n, k, a, lda, a_scales, b, ldb, b_scales, c, ldc);
+        return;
+    }
+    const size_t target = 4 * pool->size();
+    const size_t row_tiles = std::min((m + blocking::MC - 1) / blocking::MC, target);
+    const size_t tile_rows = ((m + row_tiles - 1) / row_tiles + blocking::MR - 1) / blocking::MR * blocking::MR;
+    const size_t col_tiles = std::min((target + row_tiles - 1) / row_tiles, (n + 255) / 256);
+    const size_t tile_cols = ((n + col_tiles - 1) / col_tiles + blocking::NR - 1) / blocking::NR * blocking::NR;
+    const size_t num_row_tiles = (m + tile_rows - 1) / tile_rows, num_col_tiles = (n + tile_cols - 1) / tile_cols;
+    pool->parallel_for(0, num_row_tiles * num_col_tiles, 1, [&](const size_t lo, const size_t hi) {
+        for (size_t t = lo; t < hi; ++t) {
+            const size_t i = t / num_col_tiles * tile_rows, j = t % num_col_tiles * tile_cols;
+            gemm_int8_serial(std::min(tile_rows, m - i), std::min(tile_cols, n - j), k, a + i * lda, lda, a_scales + i,
+                             b + j * ldb, ldb, b_scales + j, c + i * ldc + j, ldc);
+        }
+    });
+}
+
+// Row i is scales()[i] * values()[i], with the scale chosen so the row's largest magnitude maps
+// to 127 (symmetric, round to nearest)
+class QuantizedMatrix {
+    private:
+        Matrix<int8_t> m_values;
+        std::vector<float> m_scales;
+    public:
+        template <typename E>
+        explicit QuantizedMatrix(const MatrixExpr<E>& expr);
+
+        // The matrix this stands for, as float
+        Matrix<float> dense() const;
+
+        unsigned int rows() const { return m_values.rows(); }
+        unsigned int cols() const { return m_values.cols(); }
+        const Matrix<int8_t>& values() const { return m_values; }
+        const std::vector<float>& scales() const { return m_scales; }
+};
+
+template <typename E>
+QuantizedMatrix::QuantizedMatrix(const MatrixExpr<E>& expr):
+    m_values(expr.self().rows(), expr.self().cols()), m_scales(expr.self().rows()) {
+    const E& e = expr.self();
+    for_matrix_rows(rows(), cols(), [&](unsigned int lo, unsigned int hi) {
+        for (unsigned int i = lo; i < hi; i++) {
+            const auto row = e.row_fn(i);
+            float largest = 0;
+            for (unsigned int j = 0; j < cols(); j++)
+                largest = std::max(largest, std::fabs((float)row(j)));
+            m_scales[i] = largest / 127;
+            const float inverse = largest > 0 ? 127 / largest : 0;
+            int8_t* out = m_values[i];
+            for (unsigned int j = 0; j < cols(); j++)
+                out[j] = (int8_t)std::max(-127.0f, std::min(127.0f, std::nearbyint((float)row(j) * inverse)));
+        }
+    });
+}
+
+inline Matrix<float> QuantizedMatrix::dense() const {
+    Matrix<float> result(rows(), cols());
+    for (unsigned int i = 0; i < rows(); i++)
+        for (unsigned int j = 0; j < cols(); j++)
+            result[i][j] = m_scales[i] * m_values[i][j];
+    return result;
+}
+
+// A B^T in float, for row-quantized A (m x k) and B (n x k)
+inline Matrix<float> quantized_product(const QuantizedMatrix& a, const QuantizedMatrix& b) {
+    if (a.cols() != b.cols())
+        warn("quantized_product", "Multiplying these won't work");
+
+    Matrix<float> result(a.rows(), b.rows());
+    gemm_int8(a.rows(), b.rows(), a.cols(), a.values().data(), a.values().stride(), a.scales().data(),
+              b.values().data(), b.values().stride(), b.scales().data(), result.data(), result.stride(),
+              matrix_thread_pool());
+    return result;
+}
+
+#endif
@@ -0,0 +1,234 @@
+
+#include <algorithm>
+#include <limits>
+#include <numeric>
+
+template<typename T>
+template<typename F>
+void SparseMatrix<T>::for_rows(F fn, size_t work_per_nonzero) const {
+    util::thread_pool* pool = matrix_thread_pool();
+    const size_t nnz = nonzeros();
+    if (!pool || pool->size() == 1 || nnz * work_per_nonzero < MATRIX_PARALLEL_THRESHOLD) {
+        fn(0u, m_rows);
+        return;
+    }
+    // Chunk c starts at the first row starting at or after nonzero c * nnz / chunks
+    const size_t chunks = 4 * pool->size();
+    const auto boundary = [&](size_t c) -> unsigned int {
+        if (c == chunks)
+            return m_rows;
+        return std::lower_bound(m_row_ptr.begin(), m_row_ptr.end() - 1, c * nnz / chunks) - m_row_ptr.begin();
+    };
+    pool->parallel_for(0, chunks, 1, [&](size_t lo, size_t hi) {
+        for (size_t c = lo; c < hi; c++) {
+            const unsigned int begin = boundary(c), end = boundary(c + 1);
+            if (begin < end)
+                fn(begin, end);
+        }
+    });
+}
+
+// Empty matrix
+template<typename T>
+SparseMatrix<T>::SparseMatrix(unsigned int rows, unsigned int cols):
+    m_rows(rows), m_cols(cols), m_row_ptr(rows + 1, 0) {}
+
+// From dense
+template<typename T>
+SparseMatrix<T>::SparseMatrix(const Matrix<T>& dense):
+    m_rows(dense.rows()), m_cols(dense.cols()), m_row_ptr(dense.rows() + 1, 0) {
+    for (unsigned int i = 0; i < m_rows; i++) {
+        for (unsigned int j = 0; j < m_cols; j++) {
+            if (dense[i][j] != T()) {
+                m_col_idx.push_back(j);
+                m_values.push_back(dense[i][j]);
+            }
+        }
+        m_row_ptr[i + 1] = m_values.size();
+    }
+}
+
+// From triplets: bucket by row, then sort each row by column and sum repeats
+template<typename T>
+SparseMatrix<T>::SparseMatrix(unsigned int rows, unsigned int cols, std::vector<triplet> entries):
+    m_rows(rows), m_cols(cols), m_row_ptr(rows + 1, 0) {
+    for (const triplet& e : entries) {
+        if (std::get<0>(e) >= rows || std::get<1>(e) >= cols) {
+            warn("SparseMatrix::SparseMatrix", "Entry out of bounds, dropping it");
+            continue;
+        }
+        m_row_ptr[std::get<0>(e) + 1]++;
+    }
+    std::partial_sum(m_row_ptr.begin(), m_row_ptr.end(), m_row_ptr.begin());
+
+    std::vector<std::pair<unsigned int, T>> sorted(m_row_ptr[rows]);
+    std::vector<size_t> next(m_row_ptr.begin(), m_row_ptr.end() - 1);
+    for (const triplet& e : entries)
+        if (std::get<0>(e) < rows && std::get<1>(e) < cols)
+            sorted[next[std::get<0>(e)]++] = {std::get<1>(e), std::get<2>(e)};
+
+    m_col_idx.reserve(sorted.size());
+    m_values.reserve(sorted.size());
+    for (unsigned int i = 0; i < rows; i++) {
+        const auto first = sorted.begin() + m_row_ptr[i], last = sorted.begin() + m_row_ptr[i + 1];
+        std::sort(first, last, [](const auto& a, const auto& b) { return a.first < b.first; });
+        m_row_ptr[i] = m_values.size();
+        for (auto it = first; it != last; ++it) {
+            if (it != first && it->first == m_col_idx.back())
+                m_values.back() += it->second;
+            else {
+                m_col_idx.push_back(it->first);
+                m_values.push_back(it->second);
+            }
+        }
+    }
+    m_row_ptr[rows] = m_values.size();
+}
+
+template<typename T>
+Matrix<T> SparseMatrix<T>::dense() const {
+    Matrix<T> result(m_rows, m_cols);
+    for (unsigned int i = 0; i < m_rows; i++)
+        for (size_t p = m_row_ptr[i]; p < m_row_ptr[i + 1]; p++)
+            result[i][m_col_idx[p]] = m_values[p];
+    return result;
+}
+
+// Counting sort by column; walking the rows in order leaves every new row sorted
+template<typename T>
+SparseMatrix<T> SparseMatrix<T>::transpose() const {
+    SparseMatrix<T> result(m_cols, m_rows);
+    for (unsigned int j : m_col_idx)
+        result.m_row_ptr[j + 1]++;
+    std::partial_sum(result.m_row_ptr.begin(), result.m_row_ptr.end(), result.m_row_ptr.begin());
+
+    result.m_col_idx.resize(nonzeros());
+    result.m_values.resize(nonzeros());
+    std::vector<size_t> next(result.m_row_ptr.begin(), result.m_row_ptr.end() - 1);
+    for (unsigned int i = 0; i < m_rows; i++) {
+        for (size_t p = m_row_ptr[i]; p < m_row_ptr[i + 1]; p++) {
+            const size_t q = next[m_col_idx[p]]++;
+            result.m_col_idx[q] = i;
+            result.m_values[q] = m_values[p];
+        }
+    }
+    return result;
+}
+
+template<typename T>
+std::vector<T> SparseMatrix<T>::operator*(const std::vector<T>& rhs) const {
+    if (rhs.size() != m_cols)
+        warn("SparseMatrix::operator*(vector)", "Cannot multiply vector");
+
+    std::vector<T> result(m_rows);
+    for_rows([&](unsigned int lo, unsigned int hi) {
+        for (unsigned int i = lo; i < hi; i++) {
+            double sum = 0.0;
+            for (size_t p = m_row_ptr[i]; p < m_row_ptr[i + 1]; p++)
+                sum += m_values[p] * rhs[m_col_idx[p]];
+            result[i] = sum;
+        }
+    });
+    return result;
+}
+
+// Each nonzero (i, j) adds a multiple of row j of rhs to row i of the result
+template<typename T>
+Matrix<T> SparseMatrix<T>::operator*(const Matrix<T>& rhs) const {
+    if (m_cols != rhs.rows())
+        warn("SparseMatrix::operator*", "Multiplying these won't work");
+
+    Matrix<T> result(m_rows, rhs.cols());
+    const unsigned int n = rhs.cols();
+    for_rows([&](unsigned int lo, unsigned int hi) {
+        for (unsigned int i = lo; i < hi; i++) {
+            T* out = result[i];
+            for (size_t p = m_row_ptr[i]; p < m_row_ptr[i + 1]; p++) {
+                const T value = m_values[p];
+                const T* row = rhs[m_col_idx[p]];
+                for (unsigned int j = 0; j < n; j++)
+                    out[j] += value * row[j];
+            }
+        }
+    }, std::max(1u, n));
+    return result;
+}
+
+// Gustavson's algorithm, in two passes so rows can be filled in parallel: the first counts the
+// distinct columns of each result row, the second accumulates the row in a dense scratch row and
+// writes it out sorted. Scratch rows are indexed by column, with a marker saying which result row
+// last touched each column.
+template<typename T>
+SparseMatrix<T> SparseMatrix<T>::operator*(const SparseMatrix<T>& rhs) const {
+    if (m_cols != rhs.m_rows)
+        warn("SparseMatrix::operator*", "Multiplying these won't work");
+
+    SparseMatrix<T> result(m_rows, rhs.m_cols);
+    const size_t work = std::max<size_t>(1, rhs.nonzeros() / std::max(1u, rhs.m_rows));
+    constexpr unsigned int untouched = std::numeric_limits<unsigned int>::max();
+
+    for_rows([&](unsigned int lo, unsigned int hi) {
+        std::vector<unsigned int> marker(rhs.m_cols, untouched);
+        for (unsigned int i = lo; i < hi; i++) {
+            size_t count = 0;
+            for (size_t p = m_row_ptr[i]; p < m_row_ptr[i + 1]; p++) {
+                const unsigned int k = m_col_idx[p];
+                for (size_t q = rhs.m_row_ptr[k]; q < rhs.m_row_ptr[k + 1]; q++) {
+                    if (marker[rhs.m_col_idx[q]] != i) {
+                        marker[rhs.m_col_idx[q]] = i;
+                        count++;
+                    }
+                }
+            }
+            result.m_row_ptr[i + 1] = count;
+        }
+    }, work);
+    std::partial_sum(result.m_row_ptr.begin(), result.m_row_ptr.end(), result.m_row_ptr.begin());
+
+    result.m_col_idx.resize(result.m_row_ptr[m_rows]);
+    result.m_values.resize(result.m_row_ptr[m_rows]);
+    for_rows([&](unsigned int lo, unsigned int hi) {
+        std::vector<unsigned int> marker(rhs.m_cols, untouched);
+        std::vector<T> accumulator(rhs.m_cols);
+        for (unsigned int i = lo; i < hi; i++) {
+            unsigned int* cols = result.m_col_idx.data() + result.m_row_ptr[i];
+            size_t count = 0;
+            for (size_t p = m_row_ptr[i]; p < m_row_ptr[i + 1]; p++) {
+                const unsigned int k = m_col_idx[p];
+                const T value = m_values[p];
+                for (size_t q = rhs.m_row_ptr[k]; q < rhs.m_row_ptr[k + 1]; q++) {
+                    const unsigned int j = rhs.m_col_idx[q];
+                    if (marker[j] != i) {
+                        marker[j] = i;
+                        accumulator[j] = T();
+                        cols[count++] = j;
+                    }
+                    accumulator[j] += value * rhs.m_values[q];
+                }
+            }
+            std::sort(cols, cols + count);
+            T* values = result.m_values.data() + result.m_row_ptr[i];
+            for (size_t c = 0; c < count; c++)
+                values[c] = accumulator[cols[c]];
+        }
+    }, work);
+    return result;
+}
+
+template<typename T>
+unsigned int SparseMatrix<T>::rows() const { return m_rows; }
+
+template<typename T>
+unsigned int SparseMatrix<T>::cols() const { return m_cols; }
+
+template<typename T>
+size_t SparseMatrix<T>::nonzeros() const { return m_values.size(); }
+
+template<typename T>
+const std::vector<size_t>& SparseMatrix<T>::row_ptr() const { return m_row_ptr; }
+
+template<typename T>
+const std::vector<unsigned int>& SparseMatrix<T>::col_idx() const { return m_col_idx; }
+
+template<typename T>
+const std::vector<T>& SparseMatrix<T>::values() const { return m_values; }
@@ -0,0 +1,51 @@
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include <tuple>
+#include <vector>
+#include "matrix.h"
+
+// Compressed sparse row storage: the nonzeros of row i are values()[row_ptr()[i], row_ptr()[i+1])
+// in columns col_idx()[...], sorted by column. The compressed column form of a matrix is the
+// compressed row form of its transpose, so column-oriented work goes through transpose().
+//
+// Products run on matrix_thread_pool(), split into ranges of rows holding equal numbers of
+// nonzeros rather than equal numbers of rows, so a few dense rows (power-law graphs) don't leave
+// one thread with most of the work.
+template <typename T> class SparseMatrix {
+    private:
+        unsigned int m_rows, m_cols;
+        std::vector<size_t> m_row_ptr;
+        std::vector<unsigned int> m_col_idx;
+        std::vector<T> m_values;
+
+        // Calls fn(lo, hi) on ranges of rows covering the matrix, balanced by nonzeros, concurrently
+        // when there are enough of them
+        template<typename F> void for_rows(F fn, size_t work_per_nonzero = 1) const;
+    public:
+        using triplet = std::tuple<unsigned int, unsigned int, T>;
+
+        // Empty (all zero) matrix
+        SparseMatrix(unsigned int rows, unsigned int cols);
+        // Keeps the nonzero elements of a dense matrix
+        explicit SparseMatrix(const Matrix<T>& dense);
+        // Builds from (row, col, value) entries in any order; repeated positions are summed
+        SparseMatrix(unsigned int rows, unsigned int cols, std::vector<triplet> entries);
+
+        Matrix<T> dense() const;
+        SparseMatrix<T> transpose() const;
+
+        std::vector<T> operator*(const std::vector<T>& rhs) const;
+        Matrix<T> operator*(const Matrix<T>& rhs) const;
+        SparseMatrix<T> operator*(const SparseMatrix<T>& rhs) const;
+
+        unsigned int rows() const;
+        unsigned int cols() const;
+        size_t nonzeros() const;
+        const std::vector<size_t>& row_ptr() const;
+        const std::vector<unsigned int>& col_idx() const;
+        const std::vector<T>& values() const;
+};
+
+#include "sparse.cpp"
+#endif
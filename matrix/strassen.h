@@ -0,0 +1,136 @@
+#ifndef STRASSEN_H
+#define STRASSEN_H
+
+// Strassen-Winograd multiplication: 7 half-size products and 15 additions per level instead of
+// 8 products, recursing until a dimension drops below the cutoff, where gemm takes over.
+//
+// Odd dimensions are peeled: the even leading part goes through the recursion, and the last
+// row, column and inner index (whichever are odd) are fixed up with thin gemm calls. Every level
+// needs three temporaries (one quadrant each of A, B and C), taken from a single arena sized up
+// front and released in stack order, so the recursion never allocates. The schedule is the usual
+// one for C = A * B that keeps four of the seven products in the quadrants of C.
+//
+// The result differs from the classical product by rounding only, but by more of it: the error
+// bound grows by roughly a factor of 3 (rather than 2) with each level. Keep the cutoff large.
+
+#include "gemm.h"
+
+// Dimensions at or below this go to gemm. Around here a level of recursion starts to pay for
+// its extra passes over memory; see the benchmark in main.cpp.
+constexpr size_t STRASSEN_CUTOFF = 1024;
+
+// Bump allocator for the recursion's temporaries; blocks are cache-line aligned.
+template <typename T>
+class strassen_arena {
+    private:
+        aligned_array<T> m_buffer;
+        size_t m_size, m_top = 0;
+    public:
+        static constexpr size_t LINE = 64 % sizeof(T) == 0 ? 64 / sizeof(T) : 1;
+        static size_t round(const size_t n) { return (n + LINE - 1) / LINE * LINE; }
+
+        explicit strassen_arena(const size_t size): m_buffer(make_aligned_array<T>(size)), m_size(size) {}
+
+        T* take(const size_t n) {
+            T* block = m_buffer.get() + m_top;
+            m_top += round(n);
+            return block;
+        }
+        size_t mark() const { return m_top; }
+        void release(const size_t mark) { m_top = mark; }
+        size_t size() const { return m_size; }
+};
+
+// Arena elements needed to multiply m x k by k x n with the given cutoff.
+inline size_t strassen_workspace(size_t m, size_t n, size_t k, const size_t cutoff, const size_t line) {
+    const auto round = [line](const size_t x) { return (x + line - 1) / line * line; };
+    size_t total = 0;
+    while (std::min({m, n, k}) > cutoff) {
+        m /= 2, n /= 2, k /= 2;
+        total += m * round(k) + k * round(n) + m * round(n);
+    }
+    return total;
+}
+
+// c = a + b, or a - b when subtract is set; all rows x cols.
+template <typename T>
+void strassen_add(const size_t rows, const size_t cols, const T* a, const size_t lda, const T* b, const size_t ldb,
+                  T* c, const size_t ldc, const bool subtract = false) {
+    for (size_t i = 0; i < rows; ++i) {
+        const T* ar = a + i * lda;
+        const T* br = b + i * ldb;
+        T* cr = c + i * ldc;
+        if (subtract)
+            for (size_t j = 0; j < cols; ++j) cr[j] = ar[j] - br[j];
+        else
+            for (size_t j = 0; j < cols; ++j) cr[j] = ar[j] + br[j];
+    }
+}
+
+// C = A * B (m x k times k x n); C must not overlap A or B.
+template <typename T>
+void strassen(const size_t m, const size_t n, const size_t k, const T* a, const size_t lda, const T* b,
+              const size_t ldb, T* c, const size_t ldc, const size_t cutoff, strassen_arena<T>& arena,
+              util::thread_pool* pool = nullptr) {
+    if (std::min({m, n, k}) <= cutoff) {
+        gemm<T>(m, n, k, T(1), a, lda, b, ldb, T(0), c, ldc, pool);
+        return;
+    }
+    const size_t m2 = m / 2, n2 = n / 2, k2 = k / 2;
+    const T *a11 = a, *a12 = a + k2, *a21 = a + m2 * lda, *a22 = a21 + k2;
+    const T *b11 = b, *b12 = b + n2, *b21 = b + k2 * ldb, *b22 = b21 + n2;
+    T *c11 = c, *c12 = c + n2, *c21 = c + m2 * ldc, *c22 = c21 + n2;
+
+    const size_t mark = arena.mark();
+    const size_t ldx = arena.round(k2), ldy = arena.round(n2), ldp = ldy;
+    T* x = arena.take(m2 * ldx);
+    T* y = arena.take(k2 * ldy);
+    T* p = arena.take(m2 * ldp);
+    const auto multiply = [&](const T* lhs, const size_t ldl, const T* rhs, const size_t ldr, T* out) {
+        strassen(m2, n2, k2, lhs, ldl, rhs, ldr, out, ldc, cutoff, arena, pool);
+    };
+
+    strassen_add(m2, k2, a11, lda, a21, lda, x, ldx, true);     // S3 = A11 - A21
+    strassen_add(k2, n2, b22, ldb, b12, ldb, y, ldy, true);     // T3 = B22 - B12
+    multiply(x, ldx, y, ldy, c21);                              // P7 = S3 T3
+    strassen_add(m2, k2, a21, lda, a22, lda, x, ldx);           // S1 = A21 + A22
+    strassen_add(k2, n2, b12, ldb, b11, ldb, y, ldy, true);     // T1 = B12 - B11
+    multiply(x, ldx, y, ldy, c22);                              // P5 = S1 T1
+    strassen_add(m2, k2, x, ldx, a11, lda, x, ldx, true);       // S2 = S1 - A11
+    strassen_add(k2, n2, b22, ldb, y, ldy, y, ldy, true);       // T2 = B22 - T1
+    multiply(x, ldx, y, ldy, c12);                              // P6 = S2 T2
+    strassen(m2, n2, k2, a11, lda, b11, ldb, p, ldp, cutoff, arena, pool);  // P1 = A11 B11
+    strassen_add(m2, n2, c12, ldc, p, ldp, c12, ldc);           // U2 = P1 + P6
+    strassen_add(m2, n2, c21, ldc, c12, ldc, c21, ldc);         // U3 = U2 + P7
+    strassen_add(m2, n2, c12, ldc, c22, ldc, c12, ldc);         // U4 = U2 + P5
+    strassen_add(m2, n2, c22, ldc, c21, ldc, c22, ldc);         // C22 = U3 + P5
+    strassen_add(m2, k2, a12, lda, x, ldx, x, ldx, true);       // S4 = A12 - S2
+    multiply(x, ldx, b22, ldb, c11);                            // P3 = S4 B22
+    strassen_add(m2, n2, c12, ldc, c11, ldc, c12, ldc);         // C12 = U4 + P3
+    strassen_add(k2, n2, y, ldy, b21, ldb, y, ldy, true);       // T4 = T2 - B21
+    multiply(a22, lda, y, ldy, c11);                            // P4 = A22 T4
+    strassen_add(m2, n2, c21, ldc, c11, ldc, c21, ldc, true);   // C21 = U3 - P4
+    multiply(a12, lda, b21, ldb, c11);                          // P2 = A12 B21
+    strassen_add(m2, n2, c11, ldc, p, ldp, c11, ldc);           // C11 = P1 + P2
+    arena.release(mark);
+
+    // Peel whatever the halving dropped: the last inner index, then the last column and row.
+    const size_t me = 2 * m2, ne = 2 * n2, ke = 2 * k2;
+    if (k > ke)
+        gemm<T>(me, ne, k - ke, T(1), a + ke, lda, b + ke * ldb, ldb, T(1), c, ldc, pool);
+    if (n > ne)
+        gemm<T>(m, n - ne, k, T(1), a, lda, b + ne, ldb, T(0), c + ne, ldc, pool);
+    if (m > me)
+        gemm<T>(m - me, ne, k, T(1), a + me * lda, lda, b, ldb, T(0), c + me * ldc, ldc, pool);
+}
+
+// As above, with an arena of the right size.
+template <typename T>
+void strassen(const size_t m, const size_t n, const size_t k, const T* a, const size_t lda, const T* b,
+              const size_t ldb, T* c, const size_t ldc, const size_t cutoff = STRASSEN_CUTOFF,
+              util::thread_pool* pool = nullptr) {
+    strassen_arena<T> arena(strassen_workspace(m, n, k, cutoff, strassen_arena<T>::LINE));
+    strassen(m, n, k, a, lda, b, ldb, c, ldc, cutoff, arena, pool);
+}
+
+#endif
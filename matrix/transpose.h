@@ -0,0 +1,103 @@
+#ifndef TRANSPOSE_H
+#define TRANSPOSE_H
+
+// Transposes of row-major arrays with arbitrary leading dimensions.
+//
+// Out of place, the copy is cache-oblivious: the larger dimension is halved until a block fits
+// in a few cache lines each way, so at every level of the hierarchy the source rows and the
+// destination rows being touched stay resident, whatever the cache sizes. The recursion also
+// sidesteps most of the set conflicts a power-of-two stride causes a naive column walk, since a
+// block only ever touches TRANSPOSE_BLOCK rows of each array.
+//
+// In place, a square array swaps each block above the diagonal with its mirror image, again
+// recursively. A rectangular one has no such pairing: its elements move along the cycles of the
+// permutation i -> i * rows mod (rows * cols - 1), which are followed one at a time with a bitmap
+// of visited positions (one bit per element).
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Side of the blocks the recursion stops at: a 32 x 32 block of doubles from each array fits in
+// L1 together.
+constexpr size_t TRANSPOSE_BLOCK = 32;
+
+// dst (cols x rows, leading dimension ldd) = transpose of src (rows x cols, leading dimension lds).
+template <typename T>
+void transpose(const size_t rows, const size_t cols, const T* src, const size_t lds, T* dst, const size_t ldd) {
+    if (rows <= TRANSPOSE_BLOCK && cols <= TRANSPOSE_BLOCK) {
+        // Write each destination row in order; the reads hit lines the block already holds.
+        for (size_t j = 0; j < cols; ++j)
+            for (size_t i = 0; i < rows; ++i)
+                dst[j * ldd + i] = src[i * lds + j];
+        return;
+    }
+    if (rows >= cols) {
+        const size_t half = rows / 2;
+        transpose(half, cols, src, lds, dst, ldd);
+        transpose(rows - half, cols, src + half * lds, lds, dst + half, ldd);
+    } else {
+        const size_t half = cols / 2;
+        transpose(rows, half, src, lds, dst, ldd);
+        transpose(rows, cols - half, src + half, lds, dst + half * ldd, ldd);
+    }
+}
+
+// Swaps the rows x cols block a with the transpose of the cols x rows block b.
+template <typename T>
+void transpose_swap(const size_t rows, const size_t cols, T* a, T* b, const size_t ld) {
+    if (rows <= TRANSPOSE_BLOCK && cols <= TRANSPOSE_BLOCK) {
+        for (size_t i = 0; i < rows; ++i)
+            for (size_t j = 0; j < cols; ++j)
+                std::swap(a[i * ld + j], b[j * ld + i]);
+        return;
+    }
+    if (rows >= cols) {
+        const size_t half = rows / 2;
+        transpose_swap(half, cols, a, b, ld);
+        transpose_swap(rows - half, cols, a + half * ld, b + half, ld);
+    } else {
+        const size_t half = cols / 2;
+        transpose_swap(rows, half, a, b, ld);
+        transpose_swap(rows, cols - half, a + half, b + half * ld, ld);
+    }
+}
+
+// Transposes the n x n array a (leading dimension ld) in place.
+template <typename T>
+void transpose_square(const size_t n, T* a, const size_t ld) {
+    if (n <= TRANSPOSE_BLOCK) {
+        for (size_t i = 0; i < n; ++i)
+            for (size_t j = i + 1; j < n; ++j)
+                std::swap(a[i * ld + j], a[j * ld + i]);
+        return;
+    }
+    const size_t half = n / 2;
+    transpose_square(half, a, ld);
+    transpose_square(n - half, a + half * ld + half, ld);
+    transpose_swap(half, n - half, a + half, a + half * ld, ld);
+}
+
+// Transposes the dense (leading dimension cols) rows x cols array a into a dense cols x rows one.
+template <typename T>
+void transpose_dense(const size_t rows, const size_t cols, T* a) {
+    const size_t n = rows * cols;
+    if (rows <= 1 || cols <= 1) return;
+    // The first and last elements stay put.
+    std::vector<uint64_t> visited((n + 63) / 64);
+    for (size_t start = 1; start < n - 1; ++start) {
+        if (visited[start / 64] >> (start % 64) & 1) continue;
+        T carried = a[start];
+        size_t i = start;
+        do {
+            const size_t next = (size_t)((unsigned __int128)i * rows % (n - 1));
+            std::swap(carried, a[next]);
+            visited[next / 64] |= uint64_t(1) << (next % 64);
+            i = next;
+        } while (i != start);
+    }
+}
+
+#endif
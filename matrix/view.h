@@ -0,0 +1,258 @@
+#ifndef MATRIX_VIEW_H
+#define MATRIX_VIEW_H
+
+// Block matrices without the copies. MatrixView<T> is a non-owning window onto rows x cols
+// elements of a Matrix, row i at data() + i * stride(): a submatrix, a row, a column, or a window
+// of another view. hconcat(), vconcat() and kronecker() are lazy expression nodes like a + b (see
+// expression.h), reading their operands' elements as they are asked for. All of these are
+// expressions, so they feed elementwise arithmetic, products (views go to gemm with their own
+// stride) and each other without being copied. A Matrix is only built when one is asked for:
+// `Matrix<T> m = hconcat(a.row(0), b)`.
+//
+// Views of a non-const Matrix write through: `k.submatrix(i, j, 3, 3) += local` assembles a
+// block in place. Like expressions, a view is only good while its Matrix is alive and unresized.
+
+#include <type_traits>
+#include <vector>
+
+template <typename T> class MatrixView : public MatrixExpr<MatrixView<T>> {
+    private:
+        T* m_data;
+        unsigned int m_rows, m_cols;
+        size_t m_stride;
+    public:
+        using value_type = std::remove_const_t<T>;
+        static constexpr bool is_matrix = false;
+
+        MatrixView(T* data, unsigned int rows, unsigned int cols, size_t stride):
+            m_data(data), m_rows(rows), m_cols(cols), m_stride(stride) {}
+        MatrixView(const MatrixView<T>&) = default;
+        // A read-only view of the same elements
+        template <typename U, typename = std::enable_if_t<std::is_same<const U, T>::value>>
+        MatrixView(const MatrixView<U>& view): MatrixView(view.data(), view.rows(), view.cols(), view.stride()) {}
+
+        // Writes the elements of expr into the viewed ones. An element of expr may read the element
+        // it is written to, but no other element under the view: materialize expr first if it does.
+        template<typename E> MatrixView<T>& operator=(const MatrixExpr<E>& expr);
+        MatrixView<T>& operator=(const MatrixView<T>& rhs) { return *this = static_cast<const MatrixExpr<MatrixView<T>>&>(rhs); }
+        template<typename E> MatrixView<T>& operator+=(const MatrixExpr<E>& rhs) { return *this = *this + rhs; }
+        template<typename E> MatrixView<T>& operator-=(const MatrixExpr<E>& rhs) { return *this = *this - rhs; }
+
+        MatrixView<T> submatrix(unsigned int row, unsigned int col, unsigned int rows, unsigned int cols) const;
+        MatrixView<T> row(unsigned int i) const { return submatrix(i, 0, 1, m_cols); }
+        MatrixView<T> col(unsigned int j) const { return submatrix(0, j, m_rows, 1); }
+
+        Matrix<value_type> transpose() const;
+        std::vector<value_type> operator*(const std::vector<value_type>& rhs) const;
+
+        T* operator[](const unsigned int x) const { return m_data + x * m_stride; }
+        auto row_fn(unsigned int i) const { return [row = (*this)[i]](unsigned int j) { return row[j]; }; }
+
+        unsigned int rows() const { return m_rows; }
+        unsigned int cols() const { return m_cols; }
+        size_t stride() const { return m_stride; }
+        T* data() const { return m_data; }
+};
+
+template<typename T>
+template<typename E>
+MatrixView<T>& MatrixView<T>::operator=(const MatrixExpr<E>& expr) {
+    static_assert(!std::is_const<T>::value, "Can't write through a view of a const Matrix");
+    const E& e = expr.self();
+    if (e.rows() != m_rows || e.cols() != m_cols) {
+        warn("MatrixView::operator=", "Dimensions don't match up");
+        return *this;
+    }
+    for_matrix_rows(m_rows, m_cols, [&](unsigned int lo, unsigned int hi) {
+        for (unsigned int i = lo; i < hi; i++) {
+            T* out = (*this)[i];
+            const auto row = e.row_fn(i);
+            for (unsigned int j = 0; j < m_cols; j++)
+                out[j] = row(j);
+        }
+    });
+    return *this;
+}
+
+template<typename T>
+MatrixView<T> MatrixView<T>::submatrix(unsigned int row, unsigned int col, unsigned int rows, unsigned int cols) const {
+    if (row + rows > m_rows || col + cols > m_cols)
+        warn("MatrixView::submatrix", "Submatrix goes past the edge of the matrix");
+    return MatrixView<T>(m_data + row * m_stride + col, rows, cols, m_stride);
+}
+
+template<typename T>
+Matrix<typename MatrixView<T>::value_type> MatrixView<T>::transpose() const {
+    Matrix<value_type> result(m_cols, m_rows);
+    ::transpose<value_type>(m_rows, m_cols, m_data, m_stride, result.data(), result.stride());
+    return result;
+}
+
+template<typename T>
+std::vector<typename MatrixView<T>::value_type> MatrixView<T>::operator*(const std::vector<value_type>& rhs) const {
+    if (rhs.size() != m_cols)
+        warn("MatrixView::operator*(vector)", "Cannot multiply vector");
+
+    std::vector<value_type> result(m_rows);
+    for_matrix_rows(m_rows, m_cols, [&](unsigned int lo, unsigned int hi) {
+        for (unsigned int i = lo; i < hi; i++) {
+            double sum = 0.0;
+            for (unsigned int j = 0; j < m_cols; j++)
+                sum += (*this)[i][j] * rhs[j];
+            result[i] = sum;
+        }
+    });
+    return result;
+}
+
+// The product of two operands already in memory, Matrix or view, without copying either
+template <typename L, typename R>
+Matrix<typename L::value_type> strided_product(const L& lhs, const R& rhs) {
+    using T = typename L::value_type;
+    if (lhs.cols() != rhs.rows())
+        warn("Matrix::operator*", "Multiplying these won't work");
+
+    Matrix<T> result(lhs.rows(), rhs.cols());
+    gemm<T>(lhs.rows(), rhs.cols(), lhs.cols(), T(1), lhs.data(), lhs.stride(), rhs.data(), rhs.stride(),
+            T(0), result.data(), result.stride(), matrix_thread_pool());
+    return result;
+}
+
+// Without these, Matrix * view is ambiguous between the member (converting the view) and the
+// expression operator
+template <typename T, typename U>
+Matrix<T> operator*(const Matrix<T>& lhs, const MatrixView<U>& rhs) { return strided_product(lhs, rhs); }
+
+template <typename T, typename U>
+Matrix<T> operator*(const MatrixView<U>& lhs, const Matrix<T>& rhs) { return strided_product(lhs, rhs); }
+
+// [lhs rhs]
+template <typename L, typename R>
+class MatrixHConcat : public MatrixExpr<MatrixHConcat<L, R>> {
+    private:
+        matrix_expr_ref<L> m_lhs;
+        matrix_expr_ref<R> m_rhs;
+    public:
+        using value_type = typename L::value_type;
+        static constexpr bool is_matrix = false;
+
+        MatrixHConcat(const L& lhs, const R& rhs): m_lhs(lhs), m_rhs(rhs) {
+            if (lhs.rows() != rhs.rows())
+                warn("hconcat", "Number of rows doesn't match up");
+        }
+
+        unsigned int rows() const { return m_lhs.rows(); }
+        unsigned int cols() const { return m_lhs.cols() + m_rhs.cols(); }
+        auto row_fn(unsigned int i) const {
+            return [lhs = m_lhs.row_fn(i), rhs = m_rhs.row_fn(i), split = m_lhs.cols()](unsigned int j) -> value_type {
+                return j < split ? lhs(j) : rhs(j - split);
+            };
+        }
+};
+
+// [lhs; rhs]
+template <typename L, typename R>
+class MatrixVConcat : public MatrixExpr<MatrixVConcat<L, R>> {
+    private:
+        matrix_expr_ref<L> m_lhs;
+        matrix_expr_ref<R> m_rhs;
+    public:
+        using value_type = typename L::value_type;
+        static constexpr bool is_matrix = false;
+
+        MatrixVConcat(const L& lhs, const R& rhs): m_lhs(lhs), m_rhs(rhs) {
+            if (lhs.cols() != rhs.cols())
+                warn("vconcat", "Number of cols doesn't match up");
+        }
+
+        unsigned int rows() const { return m_lhs.rows() + m_rhs.rows(); }
+        unsigned int cols() const { return m_lhs.cols(); }
+        // Both sides need a row to build the callable from; the one not used gets a valid index
+        auto row_fn(unsigned int i) const {
+            const unsigned int split = m_lhs.rows();
+            const bool top = i < split;
+            return [top, lhs = m_lhs.row_fn(top ? i : 0), rhs = m_rhs.row_fn(top ? 0 : i - split)](unsigned int j) -> value_type {
+                return top ? lhs(j) : rhs(j);
+            };
+        }
+};
+
+// Element (i, j) of lhs (x) rhs is lhs(i / rhs.rows(), j / rhs.cols()) * rhs(i % rhs.rows(), j % rhs.cols())
+template <typename L, typename R>
+class MatrixKronecker : public MatrixExpr<MatrixKronecker<L, R>> {
+    private:
+        matrix_expr_ref<L> m_lhs;
+        matrix_expr_ref<R> m_rhs;
+    public:
+        using value_type = typename L::value_type;
+        static constexpr bool is_matrix = false;
+
+        MatrixKronecker(const L& lhs, const R& rhs): m_lhs(lhs), m_rhs(rhs) {}
+
+        unsigned int rows() const { return m_lhs.rows() * m_rhs.rows(); }
+        unsigned int cols() const { return m_lhs.cols() * m_rhs.cols(); }
+        auto row_fn(unsigned int i) const {
+            const unsigned int block_rows = std::max(1u, m_rhs.rows());
+            return [lhs = m_lhs.row_fn(i / block_rows), rhs = m_rhs.row_fn(i % block_rows),
+                    block_cols = m_rhs.cols()](unsigned int j) -> value_type {
+                return lhs(j / block_cols) * rhs(j % block_cols);
+            };
+        }
+};
+
+template <typename L, typename R>
+MatrixHConcat<L, R> hconcat(const MatrixExpr<L>& lhs, const MatrixExpr<R>& rhs) {
+    return {lhs.self(), rhs.self()};
+}
+
+template <typename L, typename R>
+MatrixVConcat<L, R> vconcat(const MatrixExpr<L>& lhs, const MatrixExpr<R>& rhs) {
+    return {lhs.self(), rhs.self()};
+}
+
+template <typename L, typename R>
+MatrixKronecker<L, R> kronecker(const MatrixExpr<L>& lhs, const MatrixExpr<R>& rhs) {
+    return {lhs.self(), rhs.self()};
+}
+
+// Matrix members that need MatrixView to be complete
+
+template<typename T>
+MatrixView<T> Matrix<T>::submatrix(unsigned int row, unsigned int col, unsigned int rows, unsigned int cols) {
+    return view().submatrix(row, col, rows, cols);
+}
+
+template<typename T>
+MatrixView<const T> Matrix<T>::submatrix(unsigned int row, unsigned int col, unsigned int rows, unsigned int cols) const {
+    return view().submatrix(row, col, rows, cols);
+}
+
+template<typename T>
+MatrixView<T> Matrix<T>::row(unsigned int i) { return view().row(i); }
+
+template<typename T>
+MatrixView<const T> Matrix<T>::row(unsigned int i) const { return view().row(i); }
+
+template<typename T>
+MatrixView<T> Matrix<T>::col(unsigned int j) { return view().col(j); }
+
+template<typename T>
+MatrixView<const T> Matrix<T>::col(unsigned int j) const { return view().col(j); }
+
+template<typename T>
+MatrixView<T> Matrix<T>::view() { return MatrixView<T>(data(), m_rows, m_cols, m_stride); }
+
+template<typename T>
+MatrixView<const T> Matrix<T>::view() const { return MatrixView<const T>(data(), m_rows, m_cols, m_stride); }
+
+template<typename T>
+Matrix<T> Matrix<T>::kronecker(const Matrix<T>& rhs) const {
+    return ::kronecker(*this, rhs);
+}
+
+template<typename T>
+Matrix<T> Matrix<T>::concat(const Matrix<T>& rhs) const {
+    return hconcat(*this, rhs);
+}
+
+#endif
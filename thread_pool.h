@@ -0,0 +1,193 @@
+#ifndef UTIL_THREAD_POOL
+#define UTIL_THREAD_POOL
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A work-stealing thread pool. Every worker owns a deque: tasks submitted from
+// inside a worker go to the back of its own deque and are popped LIFO, while
+// idle workers steal from the front of the other deques. Tasks submitted from
+// outside the pool are spread round-robin. The thread calling wait() helps
+// drain the queues instead of sleeping.
+namespace util {
+class thread_pool {
+  using task = std::function<void()>;
+
+  struct worker_queue {
+    std::mutex mutex;
+    std::deque<task> tasks;
+  };
+
+  std::vector<std::unique_ptr<worker_queue>> m_queues;
+  std::vector<std::thread> m_threads;
+  std::atomic<size_t> m_pending{0}; // Submitted but not yet finished
+  std::atomic<size_t> m_queued{0};  // Submitted but not yet started
+  std::atomic<size_t> m_next{0};    // Round-robin cursor for external submits
+  std::mutex m_mutex;
+  std::condition_variable m_work_cv, m_done_cv;
+  bool m_stop = false;
+
+  // Index of the calling thread's queue, or -1 if it isn't one of our workers.
+  int local_index() const {
+    return tls_pool() == this ? tls_index() : -1;
+  }
+  static const thread_pool *&tls_pool() {
+    static thread_local const thread_pool *pool = nullptr;
+    return pool;
+  }
+  static int &tls_index() {
+    static thread_local int index = -1;
+    return index;
+  }
+
+  bool try_pop(int self, task &out) {
+    const int n = m_queues.size();
+    if (self >= 0) {
+      worker_queue &q = *m_queues[self];
+      std::lock_guard<std::mutex> lock(q.mutex);
+      if (!q.tasks.empty()) {
+        out = std::move(q.tasks.back());
+        q.tasks.pop_back();
+        --m_queued;
+        return true;
+      }
+    }
+    const int start = self >= 0 ? self + 1 : 0;
+    for (int k = 0; k < n; ++k) {
+      worker_queue &q = *m_queues[(start + k) % n];
+      std::lock_guard<std::mutex> lock(q.mutex);
+      if (!q.tasks.empty()) {
+        out = std::move(q.tasks.front());
+        q.tasks.pop_front();
+        --m_queued;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void run(task &t) {
+    t();
+    if (--m_pending == 0) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_done_cv.notify_all();
+    }
+  }
+
+  void worker_loop(int self) {
+    tls_pool() = this;
+    tls_index() = self;
+    task t;
+    for (;;) {
+      if (try_pop(self, t)) {
+        run(t);
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_work_cv.wait(lock, [this] { return m_stop || m_queued > 0; });
+      if (m_stop && m_queued == 0)
+        return;
+    }
+  }
+
+public:
+  explicit thread_pool(
+      unsigned int num_threads = std::thread::hardware_concurrency()) {
+    num_threads = std::max(1u, num_threads);
+    for (unsigned int i = 0; i < num_threads; ++i)
+      m_queues.push_back(std::make_unique<worker_queue>());
+    for (unsigned int i = 0; i < num_threads; ++i)
+      m_threads.emplace_back(&thread_pool::worker_loop, this, (int)i);
+  }
+
+  thread_pool(const thread_pool &) = delete;
+  thread_pool &operator=(const thread_pool &) = delete;
+
+  ~thread_pool() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_work_cv.notify_all();
+    for (std::thread &t : m_threads)
+      t.join();
+  }
+
+  unsigned int size() const { return m_threads.size(); }
+
+  template <class F> void submit(F &&f) {
+    const int self = local_index();
+    const size_t idx = self >= 0 ? self : m_next++ % m_queues.size();
+    ++m_pending;
+    {
+      std::lock_guard<std::mutex> lock(m_queues[idx]->mutex);
+      m_queues[idx]->tasks.emplace_back(std::forward<F>(f));
+    }
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      ++m_queued;
+    }
+    m_work_cv.notify_one();
+  }
+
+  // Blocks until every submitted task (including tasks submitted by tasks)
+  // has finished, running queued tasks on the calling thread meanwhile.
+  // Only call this from outside the pool; tasks should use parallel_for.
+  void wait() {
+    const int self = local_index();
+    task t;
+    while (m_pending > 0) {
+      if (try_pop(self, t)) {
+        run(t);
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_done_cv.wait(lock, [this] { return m_pending == 0 || m_queued > 0; });
+    }
+  }
+
+  // Calls fn(lo, hi) over [begin, end) split into chunks of at least `grain`
+  // elements, and returns once every chunk is done. Ranges smaller than
+  // `grain` run inline on the calling thread. Safe to call from inside a task:
+  // the caller only waits for its own chunks, helping with any queued work.
+  template <class F>
+  void parallel_for(size_t begin, size_t end, size_t grain, F fn) {
+    if (end <= begin)
+      return;
+    grain = std::max<size_t>(grain, 1);
+    const size_t n = end - begin;
+    const size_t chunks =
+        std::min<size_t>((n + grain - 1) / grain, 4 * m_queues.size());
+    if (chunks <= 1) {
+      fn(begin, end);
+      return;
+    }
+    const size_t step = (n + chunks - 1) / chunks;
+    std::atomic<size_t> remaining{(n + step - 1) / step};
+    for (size_t lo = begin; lo < end; lo += step) {
+      const size_t hi = std::min(end, lo + step);
+      submit([&fn, &remaining, lo, hi] {
+        fn(lo, hi);
+        --remaining;
+      });
+    }
+    const int self = local_index();
+    task t;
+    while (remaining > 0) {
+      if (try_pop(self, t))
+        run(t);
+      else
+        std::this_thread::yield();
+    }
+  }
+};
+} // namespace util
+#endif // #ifndef UTIL_THREAD_POOL
@@ -0,0 +1,152 @@
+#pragma once
+
+// Per-point attributes (colour and intensity), coded in octree leaf order. The radix encoder
+// carries each key's original position through its permutation, so every leaf knows which input
+// points it holds: their attributes are averaged (a leaf of repeated points decodes as one point)
+// and coded right there, in the same traversal that emits the geometry. Leaves come out in BFS
+// order, Morton order within a level, which is also the order decodeStream returns points in;
+// consecutive leaves are therefore mostly close together, so each attribute is predicted from the
+// previous leaf's and only the difference is coded, with the range coder of entropy.h.
+
+#include "entropy.h"
+
+constexpr int ATTRIBUTE_CHANNELS = 4;
+using attribute = std::array<uint16_t, ATTRIBUTE_CHANNELS>;   // Red, green, blue, intensity
+
+// Residuals are zigzagged and binarized Exp-Golomb style: a zero flag, the bit length in unary,
+// then the bits below the leading one. The zero flag and the length are conditioned on the bit
+// length of the channel's previous residual.
+struct AttributeModel {
+    static constexpr int MAX_LENGTH = 17;
+    static constexpr int HISTORY = 6;
+    uint16_t zero[ATTRIBUTE_CHANNELS][HISTORY];
+    uint16_t length[ATTRIBUTE_CHANNELS][HISTORY][MAX_LENGTH];
+    uint16_t mantissa[ATTRIBUTE_CHANNELS][MAX_LENGTH + 1][MAX_LENGTH];
+    int history[ATTRIBUTE_CHANNELS] = {0};
+
+    AttributeModel() {
+        std::fill(&zero[0][0], &zero[0][0] + sizeof(zero) / sizeof(uint16_t), PROB_INIT);
+        std::fill(&length[0][0][0], &length[0][0][0] + sizeof(length) / sizeof(uint16_t), PROB_INIT);
+        std::fill(&mantissa[0][0][0], &mantissa[0][0][0] + sizeof(mantissa) / sizeof(uint16_t), PROB_INIT);
+    }
+
+    static uint32_t zigzag(const int32_t v) { return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31); }
+    static int32_t unzigzag(const uint32_t v) { return (int32_t)(v >> 1) ^ -(int32_t)(v & 1); }
+    static int bit_length(const uint32_t v) { return v ? 32 - __builtin_clz(v) : 0; }
+
+    void encode(RangeEncoder &encoder, const int c, const int32_t residual) {
+        const uint32_t v = zigzag(residual);
+        const int h = history[c];
+        encoder.encode(zero[c][h], v != 0);
+        const int len = bit_length(v);
+        history[c] = std::min(len, HISTORY - 1);
+        if (!v) return;
+        for (int i = 1; i < len; ++i) encoder.encode(length[c][h][i], 1);
+        if (len < MAX_LENGTH) encoder.encode(length[c][h][len], 0);
+        for (int i = len - 2; i >= 0; --i) encoder.encode(mantissa[c][len][i], (v >> i) & 1);
+    }
+
+    int32_t decode(RangeDecoder &decoder, const int c) {
+        const int h = history[c];
+        if (!decoder.decode(zero[c][h])) {
+            history[c] = 0;
+            return 0;
+        }
+        int len = 1;
+        while (len < MAX_LENGTH && decoder.decode(length[c][h][len])) ++len;
+        uint32_t v = 1;
+        for (int i = len - 2; i >= 0; --i) v = v << 1 | decoder.decode(mantissa[c][len][i]);
+        history[c] = std::min(len, HISTORY - 1);
+        return unzigzag(v);
+    }
+};
+
+// Codes one leaf's attribute as the difference from the previous leaf's.
+class AttributeEncoder {
+    std::unique_ptr<AttributeModel> m_model = std::make_unique<AttributeModel>();
+    RangeEncoder m_encoder;
+    attribute m_prev = {0};
+
+public:
+    explicit AttributeEncoder(bytestream &out): m_encoder(out) {}
+
+    void encode(const attribute &value) {
+        for (int c = 0; c < ATTRIBUTE_CHANNELS; ++c)
+            m_model->encode(m_encoder, c, (int32_t)value[c] - m_prev[c]);
+        m_prev = value;
+    }
+
+    void flush() { m_encoder.flush(); }
+};
+
+// The average of the attributes of points[indices[0, count)], rounded to nearest.
+inline attribute merge_attributes(const std::vector<attribute> &attributes, const uint32_t* indices, const int count) {
+    if (count == 1) return attributes[indices[0]];
+    uint64_t sums[ATTRIBUTE_CHANNELS] = {0};
+    for (int i = 0; i < count; ++i)
+        for (int c = 0; c < ATTRIBUTE_CHANNELS; ++c)
+            sums[c] += attributes[indices[i]][c];
+    attribute merged;
+    for (int c = 0; c < ATTRIBUTE_CHANNELS; ++c)
+        merged[c] = (sums[c] + count / 2) / count;
+    return merged;
+}
+
+// radixSortStream plus a third stream holding one attribute per decoded point: attributes[i]
+// belongs to points[i], and repeated points get the average of their attributes.
+template <int Bits = 16>
+std::tuple<bytestream, bitstream, bytestream> radixSortStreamWithAttributes(const std::vector<point> &points,
+                                                                            const std::vector<attribute> &attributes) {
+    using key_type = typename morton<Bits>::key_type;
+    const int num_points = points.size();
+    bytestream stream, attribute_stream;
+    bitstream bit_stream;
+    if (num_points == 0 || attributes.size() != points.size()) {
+        if (num_points) std::cout << "expected one attribute per point" << '\n';
+        return {stream, bit_stream, attribute_stream};
+    }
+    std::unique_ptr<key_type[]> keys[2] = {std::unique_ptr<key_type[]>(new key_type[num_points]),
+                                           std::unique_ptr<key_type[]>(new key_type[num_points])};
+    std::unique_ptr<uint32_t[]> order[2] = {std::unique_ptr<uint32_t[]>(new uint32_t[num_points]),
+                                            std::unique_ptr<uint32_t[]>(new uint32_t[num_points])};
+    morton<Bits>::encode_points(points.data(), num_points, keys[0].get());
+    for (int i = 0; i < num_points; ++i) order[0][i] = i;
+
+    stream.reserve(2 * num_points);
+    attribute_stream.reserve(num_points);
+    {
+        bitstream_writer bit_writer(bit_stream, (3 * Bits * (size_t)num_points + 7) / 8);
+        AttributeEncoder attribute_encoder(attribute_stream);
+        key_type* const data[2] = {keys[0].get(), keys[1].get()};
+        uint32_t* const index[2] = {order[0].get(), order[1].get()};
+        BfsQueue queue;
+        radix_bfs(data, 0, 0, num_points, morton<Bits>::top_depth,
+            [&](int, byte mask) { stream.push_back(mask); },
+            [&](int depth, key_type key, const uint32_t* indices, int count) {
+                stream.push_back(0);
+                encode_leaf<Bits>(bit_writer, depth, key);
+                attribute_encoder.encode(merge_attributes(attributes, indices, count));
+            }, queue, index);
+        bit_writer.finish();
+        attribute_encoder.flush();
+    }
+    return {stream, bit_stream, attribute_stream};
+}
+
+// Decodes the attributes of the first num_points points of decodeStream's output.
+inline std::vector<attribute> decodeAttributes(const bytestream &attribute_stream, const size_t num_points) {
+    std::unique_ptr<AttributeModel> model = std::make_unique<AttributeModel>();
+    RangeDecoder decoder(attribute_stream);
+    std::vector<attribute> attributes(num_points);
+    attribute prev = {0};
+    for (attribute& value : attributes) {
+        for (int c = 0; c < ATTRIBUTE_CHANNELS; ++c)
+            value[c] = prev[c] + model->decode(decoder, c);
+        prev = value;
+    }
+    if (!decoder.valid()) {
+        std::cout << "attribute stream too short" << '\n';
+        return {};
+    }
+    return attributes;
+}
@@ -0,0 +1,283 @@
+// Encoder benchmark suite: every encoder on uniform, clustered, LiDAR-like and duplicate-heavy
+// clouds, reporting throughput, output size, peak RSS and (where perf_event is available) cache
+// and branch misses. Every run is checked by decoding its output.
+//
+//   g++ -std=c++17 -O2 -march=native -pthread benchmark.cpp -o benchmark
+//   ./benchmark [num_points] [cloud]
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "tree.h"
+#include "external.h"
+#include "entropy.h"
+#include "encoder.h"
+
+// Hardware counters for the calling thread and any threads it starts while counting.
+class PerfCounters {
+    int m_fds[2] = {-1, -1};
+
+    static int open_counter(const uint64_t config) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    static long long read_counter(const int fd) {
+        long long value = -1;
+        if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value)) return -1;
+        return value;
+    }
+
+public:
+    PerfCounters() {
+        m_fds[0] = open_counter(PERF_COUNT_HW_CACHE_MISSES);
+        m_fds[1] = open_counter(PERF_COUNT_HW_BRANCH_MISSES);
+    }
+    ~PerfCounters() {
+        for (const int fd : m_fds) if (fd >= 0) close(fd);
+    }
+
+    void start() {
+        for (const int fd : m_fds) {
+            if (fd < 0) continue;
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+    void stop() {
+        for (const int fd : m_fds) if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+
+    // -1 when the counter is unavailable (no PMU, or perf_event_paranoid forbids it).
+    long long cache_misses() const { return read_counter(m_fds[0]); }
+    long long branch_misses() const { return read_counter(m_fds[1]); }
+};
+
+// Resets the kernel's peak-RSS watermark, so the next peak_rss() covers only what follows.
+void reset_peak_rss() {
+    std::ofstream("/proc/self/clear_refs") << "5";
+}
+
+// Peak resident set size in MB since the last reset_peak_rss().
+double peak_rss() {
+    std::ifstream status("/proc/self/status");
+    for (std::string line; std::getline(status, line);)
+        if (line.rfind("VmHWM:", 0) == 0) return std::stod(line.substr(6)) / 1024;
+    return -1;
+}
+
+// Points drawn uniformly from the whole grid.
+std::vector<point> uniform_cloud(const size_t num_points, std::mt19937 &rng) {
+    std::uniform_int_distribution<coord> dist(0, 0xFFFF);
+    std::vector<point> points(num_points);
+    for (point& p : points) p = {dist(rng), dist(rng), dist(rng)};
+    return points;
+}
+
+// Gaussian blobs of varying sizes around random centres.
+std::vector<point> clustered_cloud(const size_t num_points, std::mt19937 &rng) {
+    std::uniform_real_distribution<double> centre(4096, 61440), spread(64, 2048);
+    std::normal_distribution<double> normal;
+    std::vector<point> points;
+    points.reserve(num_points);
+    while (points.size() < num_points) {
+        const double cx = centre(rng), cy = centre(rng), cz = centre(rng), s = spread(rng);
+        for (size_t i = 0; i < 10000 && points.size() < num_points; ++i) {
+            const double x = cx + s * normal(rng), y = cy + s * normal(rng), z = cz + s * normal(rng);
+            if (x < 0 || y < 0 || z < 0 || x > 0xFFFF || y > 0xFFFF || z > 0xFFFF) continue;
+            points.push_back({(coord)x, (coord)y, (coord)z});
+        }
+    }
+    return points;
+}
+
+// A spinning sensor in the middle of a street: rings of beams hitting the ground plane, two rows
+// of building facades and some pillars, at 1 cm per unit with a little range noise. Points come
+// out in scan order, as a sensor delivers them.
+std::vector<point> lidar_cloud(const size_t num_points, std::mt19937 &rng) {
+    constexpr double sensor_height = 200, street = 1500, pillar_radius = 40;
+    const double origin = 32768;
+    std::normal_distribution<double> noise(0, 1.5);
+    std::vector<point> points;
+    points.reserve(num_points);
+    const int rings = 64;
+    const size_t per_ring = std::max<size_t>(num_points / rings, 1);
+    for (int r = 0; points.size() < num_points; r = (r + 1) % rings) {
+        const double elevation = -0.45 + 0.5 * r / rings;
+        for (size_t i = 0; i < per_ring && points.size() < num_points; ++i) {
+            const double azimuth = 2 * M_PI * (i + 0.5 * (r % 2)) / per_ring;
+            const double dx = std::cos(azimuth) * std::cos(elevation), dy = std::sin(azimuth) * std::cos(elevation);
+            const double dz = std::sin(elevation);
+            double t = 30000;
+            if (dz < 0) t = std::min(t, sensor_height / -dz);                      // ground
+            if (dy != 0) t = std::min(t, street / std::abs(dy));                   // facades
+            for (int k = -6; k <= 6; ++k) {                                         // pillars
+                const double px = 800.0 * k, py = k % 2 ? 600 : -600;
+                const double b = dx * px + dy * py, c = px * px + py * py - pillar_radius * pillar_radius;
+                const double disc = b * b - (dx * dx + dy * dy) * c;
+                if (disc >= 0 && b > 0) t = std::min(t, (b - std::sqrt(disc)) / (dx * dx + dy * dy));
+            }
+            t += noise(rng);
+            const double x = origin + t * dx, y = origin + t * dy, z = origin + sensor_height + t * dz;
+            points.push_back({(coord)std::clamp(x, 0.0, 65535.0), (coord)std::clamp(y, 0.0, 65535.0),
+                              (coord)std::clamp(z, 0.0, 65535.0)});
+        }
+    }
+    return points;
+}
+
+// A few thousand distinct points, each repeated many times.
+std::vector<point> duplicate_cloud(const size_t num_points, std::mt19937 &rng) {
+    const std::vector<point> distinct = uniform_cloud(std::max<size_t>(num_points / 1000, 1), rng);
+    std::uniform_int_distribution<size_t> pick(0, distinct.size() - 1);
+    std::vector<point> points(num_points);
+    for (point& p : points) p = distinct[pick(rng)];
+    return points;
+}
+
+std::vector<point> distinct_sorted(std::vector<point> points) {
+    std::sort(points.begin(), points.end());
+    points.erase(std::unique(points.begin(), points.end()), points.end());
+    return points;
+}
+
+struct Result {
+    bytestream stream, bits;
+    size_t output_bytes;
+};
+
+// Runs `encode` once under the counters and prints one line of results.
+template <typename EncodeFn>
+Result run(const char* cloud, const char* encoder, const std::vector<point> &points, EncodeFn &&encode) {
+    using seconds = std::chrono::duration<double>;
+    PerfCounters counters;
+    reset_peak_rss();
+    counters.start();
+    const auto start = std::chrono::high_resolution_clock::now();
+    Result result = encode();
+    const auto finish = std::chrono::high_resolution_clock::now();
+    counters.stop();
+    const auto per_point = [&](const long long count) {
+        std::ostringstream out;
+        if (count < 0) out << "n/a";
+        else out << std::setprecision(3) << (double)count / points.size();
+        return out.str();
+    };
+    std::cout << std::left << std::setw(10) << cloud << std::setw(26) << encoder << std::right << std::fixed
+              << std::setprecision(2) << std::setw(10) << points.size() / seconds(finish - start).count() / 1e6
+              << std::setw(10) << 8.0 * result.output_bytes / points.size() << std::setw(10) << peak_rss()
+              << std::setw(12) << per_point(counters.cache_misses()) << std::setw(12)
+              << per_point(counters.branch_misses()) << '\n'
+              << std::defaultfloat;
+    return result;
+}
+
+bool check(const bool ok, const char* cloud, const char* what) {
+    if (!ok) std::cout << "FAILED: " << what << " on " << cloud << '\n';
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    const size_t num_points = argc > 1 ? std::stod(argv[1]) : 2e6;
+    const std::string only = argc > 2 ? argv[2] : "";
+    using generator = std::vector<point> (*)(size_t, std::mt19937&);
+    const std::pair<const char*, generator> clouds[] = {
+        {"uniform", uniform_cloud}, {"clustered", clustered_cloud}, {"lidar", lidar_cloud}, {"duplicate", duplicate_cloud}};
+    util::thread_pool pool;
+    RadixEncoder<> radix_encoder;
+    const char* points_path = "/tmp/octree-bench-points.bin";
+    const char* stream_path = "/tmp/octree-bench-stream.bin";
+    const char* bitstream_path = "/tmp/octree-bench-bitstream.bin";
+    const auto slurp = [](const char* path) {
+        std::ifstream file(path, std::ios::binary);
+        return bytestream(std::istreambuf_iterator<char>(file), {});
+    };
+
+    std::cout << std::left << std::setw(10) << "cloud" << std::setw(26) << "encoder" << std::right << std::setw(10)
+              << "Mpts/s" << std::setw(10) << "bits/pt" << std::setw(10) << "peak MB" << std::setw(12) << "cmiss/pt"
+              << std::setw(12) << "bmiss/pt" << '\n';
+    bool ok = true;
+    for (const auto& [cloud, generate] : clouds) {
+        if (!only.empty() && only != cloud) continue;
+        std::mt19937 rng(42);
+        const std::vector<point> points = generate(num_points, rng);
+        const std::vector<point> expected = distinct_sorted(points);
+        const auto round_trip = [&](const Result &result) {
+            return distinct_sorted(decodeStream(result.stream, result.bits)) == expected;
+        };
+        const auto streams = [](std::pair<bytestream, bitstream> encoded) {
+            const size_t bytes = encoded.first.size() + encoded.second.size();
+            return Result{std::move(encoded.first), std::move(encoded.second), bytes};
+        };
+
+        const Result reference = run(cloud, "radixSortStream", points, [&] { return streams(radixSortStream(points)); });
+        ok &= check(round_trip(reference), cloud, "radixSortStream round trip");
+        const Result std_sort = run(cloud, "stdSortStream", points, [&] { return streams(stdSortStream(points)); });
+        ok &= check(std_sort.stream == reference.stream && std_sort.bits == reference.bits, cloud, "stdSortStream");
+        const Result parallel = run(cloud, "parallelRadixSortStream", points,
+                                    [&] { return streams(parallelRadixSortStream(points, pool)); });
+        ok &= check(parallel.stream == reference.stream && parallel.bits == reference.bits, cloud,
+                    "parallelRadixSortStream");
+        radix_encoder.encode(points);
+        const Result context = run(cloud, "RadixEncoder (warm)", points, [&] {
+            const auto& [stream, bits] = radix_encoder.encode(points);
+            return Result{stream, bits, stream.size() + bits.size()};
+        });
+        ok &= check(context.stream == reference.stream && context.bits == reference.bits, cloud, "RadixEncoder");
+        bytestream sink_stream, sink_bits;
+        radix_encoder.encode(points.data(), points.size(), BufferSink{sink_stream}, BufferSink{sink_bits});
+        ok &= check(sink_stream == reference.stream && sink_bits == reference.bits, cloud, "RadixEncoder sinks");
+        Result compressed = run(cloud, "radix + compressOccupancy", points, [&] {
+            auto [stream, bits] = radixSortStream(points);
+            bytestream occupancy = compressOccupancy(stream);
+            // Before the moves below empty them
+            const size_t bytes = occupancy.size() + bits.size();
+            return Result{std::move(occupancy), std::move(bits), bytes};
+        });
+        ok &= check(compressed.output_bytes == compressed.stream.size() + compressed.bits.size() &&
+                    compressed.bits == reference.bits, cloud, "compressOccupancy size");
+        compressed.stream = decompressOccupancy(compressed.stream);
+        ok &= check(round_trip(compressed), cloud, "compressOccupancy round trip");
+
+        ok &= check(writePointFile(points_path, points), cloud, "writePointFile");
+        Result external = run(cloud, "externalSortStream (64M)", points, [&] {
+            externalSortStream(points_path, stream_path, bitstream_path, 64 << 20);
+            struct stat stream_stat, bits_stat;
+            stat(stream_path, &stream_stat);
+            stat(bitstream_path, &bits_stat);
+            return Result{{}, {}, (size_t)(stream_stat.st_size + bits_stat.st_size)};
+        });
+        external.stream = slurp(stream_path);
+        external.bits = slurp(bitstream_path);
+        ok &= check(external.stream == reference.stream && external.bits == reference.bits, cloud,
+                    "externalSortStream");
+    }
+    std::remove(points_path);
+    std::remove(stream_path);
+    std::remove(bitstream_path);
+    std::cout << (ok ? "all round trips passed" : "ROUND TRIP FAILURES") << '\n';
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+// A reusable encoding context for streams of frames. radixSortStream allocates its key and scratch
+// arrays, its queue and both output streams on every call; RadixEncoder keeps all of them between
+// frames, so once its buffers have grown to the largest frame seen, encoding allocates nothing.
+// Output is either returned as views of the context's buffers, which copies nothing, or handed in
+// chunks to caller-supplied sinks as it is produced: any callable taking (const byte* data, size_t size).
+
+#include <unistd.h>
+#include <cerrno>
+#include "tree.h"
+
+// Appends to a caller-owned buffer; clear() it between frames to reuse its capacity.
+struct BufferSink {
+    bytestream& buffer;
+    void operator()(const byte* data, const size_t size) const {
+        buffer.insert(buffer.end(), data, data + size);
+    }
+};
+
+// Writes to a file descriptor, retrying short writes.
+struct FdSink {
+    int fd;
+    bool ok = true;
+    void operator()(const byte* data, size_t size) {
+        while (ok && size) {
+            const ssize_t n = ::write(fd, data, size);
+            if (n < 0 && errno == EINTR) continue;
+            ok = n > 0;
+            data += ok ? n : 0;
+            size -= ok ? n : 0;
+        }
+    }
+};
+
+template <int Bits = 16>
+class RadixEncoder {
+    using key_type = typename morton<Bits>::key_type;
+    std::vector<key_type> m_data[2];
+    BfsQueue m_queue;
+    bytestream m_stream;
+    bitstream m_bits;
+
+    // Occupancy bytes buffered before the sink overload hands them (and the leaf bits written so
+    // far) to the sinks.
+    static constexpr size_t FLUSH_BYTES = 1 << 16;
+
+    // Encodes one frame into m_stream and m_bits, calling flush(bit_writer) whenever m_stream
+    // reaches flush_bytes; flush may empty both. Whatever is left stays in the buffers.
+    template <typename FlushFn>
+    void encode_frame(const point* points, const size_t num_points, const size_t flush_bytes, FlushFn&& flush) {
+        if (m_data[0].size() < num_points) {
+            m_data[0].resize(num_points);
+            m_data[1].resize(num_points);
+        }
+        m_stream.clear();
+        m_stream.reserve(std::min(flush_bytes, 2 * num_points));
+        m_bits.clear();
+        if (num_points == 0) return;
+        bitstream_writer bit_writer(m_bits, (3 * Bits * std::min(flush_bytes, num_points) + 7) / 8);
+        morton<Bits>::encode_points(points, num_points, m_data[0].data());
+        key_type* data[2] = {m_data[0].data(), m_data[1].data()};
+        const auto push = [&](const byte mask) {
+            m_stream.push_back(mask);
+            if (m_stream.size() == flush_bytes) flush(bit_writer);
+        };
+        radix_bfs(data, 0, 0, (int)num_points, morton<Bits>::top_depth,
+            [&](int, byte mask) { push(mask); },
+            [&](int depth, key_type key) {
+                encode_leaf<Bits>(bit_writer, depth, key);
+                push(0);
+            }, m_queue);
+        bit_writer.finish();
+    }
+
+public:
+    // Encodes one frame into the context's own buffers and returns views of them; they stay valid
+    // until the next call. Produces exactly the streams of radixSortStream<Bits>.
+    std::pair<const bytestream&, const bitstream&> encode(const point* points, const size_t num_points) {
+        encode_frame(points, num_points, SIZE_MAX, [](bitstream_writer&) {});
+        return {m_stream, m_bits};
+    }
+
+    std::pair<const bytestream&, const bitstream&> encode(const std::vector<point> &points) {
+        return encode(points.data(), points.size());
+    }
+
+    // Encodes one frame, handing the occupancy bytes to stream_sink and the leaf bits to bit_sink
+    // every FLUSH_BYTES nodes as they are produced, so the context never holds a whole frame's output.
+    template <typename StreamSink, typename BitSink>
+    void encode(const point* points, const size_t num_points, StreamSink&& stream_sink, BitSink&& bit_sink) {
+        encode_frame(points, num_points, FLUSH_BYTES, [&](bitstream_writer &bit_writer) {
+            stream_sink(m_stream.data(), m_stream.size());
+            m_stream.clear();
+            bit_writer.drain(bit_sink);
+        });
+        stream_sink(m_stream.data(), m_stream.size());
+        bit_sink(m_bits.data(), m_bits.size());
+    }
+
+    template <typename StreamSink, typename BitSink>
+    void encode(const std::vector<point> &points, StreamSink&& stream_sink, BitSink&& bit_sink) {
+        encode(points.data(), points.size(), stream_sink, bit_sink);
+    }
+};
@@ -0,0 +1,188 @@
+#pragma once
+
+// Context-adaptive binary arithmetic coding of the occupancy bytestream. Each node is coded as a
+// leaf flag followed (for internal nodes) by its eight occupancy bits. Both are modelled from
+// what the decoder already knows when it reaches the node: its level, its parent's occupancy mask
+// and its octant among its siblings, and (for the occupancy bits) how many bits of its own mask
+// are set so far. The coder is an LZMA-style binary range coder with 11-bit probabilities.
+
+#include "tree.h"
+
+constexpr int PROB_BITS = 11;
+constexpr uint16_t PROB_INIT = 1 << (PROB_BITS - 1);
+constexpr int PROB_ADAPT = 5;
+
+class RangeEncoder {
+    bytestream& m_out;
+    uint64_t m_low = 0;
+    uint32_t m_range = 0xFFFFFFFF;
+    byte m_cache = 0;
+    uint64_t m_cache_size = 1;
+
+    void shift_low() {
+        if ((uint32_t)m_low < 0xFF000000 || (m_low >> 32) != 0) {
+            const byte carry = m_low >> 32;
+            byte temp = m_cache;
+            do {
+                m_out.push_back(temp + carry);
+                temp = 0xFF;
+            } while (--m_cache_size != 0);
+            m_cache = (m_low >> 24) & 0xFF;
+        }
+        ++m_cache_size;
+        m_low = (m_low & 0x00FFFFFF) << 8;
+    }
+
+public:
+    explicit RangeEncoder(bytestream& out): m_out(out) {}
+
+    void encode(uint16_t& prob, const int bit) {
+        const uint32_t bound = (m_range >> PROB_BITS) * prob;
+        if (!bit) {
+            m_range = bound;
+            prob += ((1 << PROB_BITS) - prob) >> PROB_ADAPT;
+        } else {
+            m_low += bound;
+            m_range -= bound;
+            prob -= prob >> PROB_ADAPT;
+        }
+        while (m_range < (1u << 24)) {
+            m_range <<= 8;
+            shift_low();
+        }
+    }
+
+    void flush() {
+        for (int i = 0; i < 5; ++i) shift_low();
+    }
+};
+
+class RangeDecoder {
+    const byte* m_data;
+    size_t m_size, m_pos = 0;
+    uint32_t m_range = 0xFFFFFFFF, m_code = 0;
+
+    byte next() { return m_pos < m_size ? m_data[m_pos++] : (++m_pos, 0); }
+
+public:
+    explicit RangeDecoder(const bytestream& in): m_data(in.data()), m_size(in.size()) {
+        for (int i = 0; i < 5; ++i) m_code = (m_code << 8) | next();
+    }
+
+    int decode(uint16_t& prob) {
+        const uint32_t bound = (m_range >> PROB_BITS) * prob;
+        int bit;
+        if (m_code < bound) {
+            m_range = bound;
+            prob += ((1 << PROB_BITS) - prob) >> PROB_ADAPT;
+            bit = 0;
+        } else {
+            m_code -= bound;
+            m_range -= bound;
+            prob -= prob >> PROB_ADAPT;
+            bit = 1;
+        }
+        while (m_range < (1u << 24)) {
+            m_range <<= 8;
+            m_code = (m_code << 8) | next();
+        }
+        return bit;
+    }
+
+    // Whether the decoder never ran past the end of its input.
+    bool valid() const { return m_pos <= m_size; }
+};
+
+// Adaptive probabilities for every context. A node's context is (parent mask << 3 | octant); the
+// root uses parent mask 0, which no real parent has.
+struct OccupancyModel {
+    // Trees have one level per bit of the widest (21-bit) grid, plus the level splitting duplicates.
+    static constexpr int MAX_LEVEL = 21;
+    uint16_t leaf[(MAX_LEVEL + 1) * 9];
+    uint16_t bits[256 * 8 * 8 * 4];
+
+    OccupancyModel() {
+        std::fill(std::begin(leaf), std::end(leaf), PROB_INIT);
+        std::fill(std::begin(bits), std::end(bits), PROB_INIT);
+    }
+
+    uint16_t& leaf_prob(const int level, const uint16_t ctx) {
+        return leaf[std::min(level, MAX_LEVEL) * 9 + __builtin_popcount(ctx >> 3)];
+    }
+    uint16_t& bit_prob(const uint16_t ctx, const int i, const byte partial) {
+        return bits[((ctx * 8 + i) << 2) + std::min(__builtin_popcount(partial), 3)];
+    }
+};
+
+// Walks the occupancy stream level by level. For every node, code(level, ctx) must return its byte
+// (coding or decoding it along the way); the walk returns false if the tree is malformed.
+template <typename CodeFn>
+bool walk_occupancy(CodeFn&& code) {
+    std::vector<uint16_t> level{0}, next;
+    for (int l = 0; !level.empty(); ++l) {
+        next.clear();
+        for (const uint16_t ctx : level) {
+            const int mask = code(l, ctx);
+            if (mask < 0) return false;
+            for (unsigned int m = mask; m; m &= m - 1)
+                next.push_back(mask << 3 | __builtin_ctz(m));
+        }
+        level.swap(next);
+    }
+    return true;
+}
+
+// The empty stream of an empty cloud codes as an empty stream, and back.
+bytestream compressOccupancy(const bytestream& stream) {
+    if (stream.empty()) return {};
+    bytestream out;
+    out.reserve(stream.size() / 2);
+    std::unique_ptr<OccupancyModel> model = std::make_unique<OccupancyModel>();
+    RangeEncoder encoder(out);
+    auto stream_it = stream.cbegin();
+    const bool ok = walk_occupancy([&](const int l, const uint16_t ctx) {
+        if (stream_it == stream.cend() || l > OccupancyModel::MAX_LEVEL) return -1;
+        const byte mask = *stream_it++;
+        encoder.encode(model->leaf_prob(l, ctx), mask == 0);
+        if (mask == 0) return 0;
+        byte partial = 0;
+        for (int i = 0; i < 8; ++i) {
+            const int bit = (mask >> i) & 1;
+            // A non-leaf mask is never zero, so a last bit following seven zeros is implied.
+            if (i == 7 && partial == 0) break;
+            encoder.encode(model->bit_prob(ctx, i, partial), bit);
+            partial |= bit << i;
+        }
+        return (int)mask;
+    });
+    if (!ok || stream_it != stream.cend()) {
+        std::cout << "malformed occupancy stream" << '\n';
+        return {};
+    }
+    encoder.flush();
+    return out;
+}
+
+bytestream decompressOccupancy(const bytestream& compressed) {
+    if (compressed.empty()) return {};
+    bytestream stream;
+    stream.reserve(3 * compressed.size());
+    std::unique_ptr<OccupancyModel> model = std::make_unique<OccupancyModel>();
+    RangeDecoder decoder(compressed);
+    const bool ok = walk_occupancy([&](const int l, const uint16_t ctx) {
+        if (l > OccupancyModel::MAX_LEVEL || !decoder.valid()) return -1;
+        byte mask = 0;
+        if (!decoder.decode(model->leaf_prob(l, ctx))) {
+            for (int i = 0; i < 7; ++i)
+                mask |= decoder.decode(model->bit_prob(ctx, i, mask)) << i;
+            mask |= (mask == 0 || decoder.decode(model->bit_prob(ctx, 7, mask))) << 7;
+        }
+        stream.push_back(mask);
+        return (int)mask;
+    });
+    if (!ok || !decoder.valid()) {
+        std::cout << "malformed compressed occupancy stream" << '\n';
+        return {};
+    }
+    return stream;
+}
@@ -0,0 +1,323 @@
+#pragma once
+
+// Out-of-core encoding for clouds that don't fit in memory. Points are read from a
+// memory-mapped file of raw `point`s, interleaved and sorted in budget-sized runs which are
+// spilled to disk, and the runs are k-way merged into one sorted key stream. A single pass over
+// that stream emits the octree in DFS order; since every BFS level lists its nodes in Morton order,
+// writing each level to its own spill file and concatenating them yields exactly the streams of
+// stdSortStream/radixSortStream.
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "tree.h"
+
+// Owners of the files and the mapping held by externalSortStream, so that every way out of it
+// releases them.
+struct FileCloser {
+    void operator()(FILE* file) const { fclose(file); }
+};
+using file_ptr = std::unique_ptr<FILE, FileCloser>;
+
+struct MappedFile {
+    int fd = -1;
+    void* map = nullptr;
+    size_t size = 0;
+
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { release(); }
+
+    void release() {
+        if (map) munmap(map, size);
+        if (fd >= 0) close(fd);
+        map = nullptr;
+        fd = -1;
+    }
+};
+
+// An anonymous temporary file in `dir`, removed as soon as it is closed.
+file_ptr spill_file(const std::string &dir) {
+    std::string path = dir + "/octree-spill-XXXXXX";
+    const int fd = mkstemp(&path[0]);
+    if (fd < 0) return nullptr;
+    unlink(path.c_str());
+    FILE* file = fdopen(fd, "w+b");
+    if (!file) close(fd);
+    return file_ptr(file);
+}
+
+// Flushes a spill file and goes back to its start for reading. Unlike rewind(), this reports a
+// failed flush instead of clearing it.
+bool rewind_spill(FILE* file) {
+    return fflush(file) == 0 && fseek(file, 0, SEEK_SET) == 0;
+}
+
+// Buffered reader over one sorted run of keys.
+template <typename Key>
+struct SpillRun {
+    FILE* file;
+    std::vector<Key> buffer;
+    size_t pos = 0, size = 0;
+
+    bool refill() {
+        size = fread(buffer.data(), sizeof(Key), buffer.size(), file);
+        pos = 0;
+        return size != 0;
+    }
+    // Whether the run still has keys; refills the buffer if needed.
+    bool has_next() { return pos < size || refill(); }
+    Key peek() const { return buffer[pos]; }
+};
+
+// Merges `runs` (each sorted and deduplicated) into one sorted stream of unique keys, calling
+// sink(key). False if a run couldn't be read back in full.
+template <typename Key, typename Sink>
+bool merge_runs(const std::vector<file_ptr> &runs, const size_t buffer_keys, Sink &&sink) {
+    std::vector<SpillRun<Key>> readers(runs.size());
+    using entry = std::pair<Key, size_t>;
+    std::priority_queue<entry, std::vector<entry>, std::greater<entry>> heap;
+    for (size_t r = 0; r < runs.size(); ++r) {
+        if (!rewind_spill(runs[r].get())) return false;
+        readers[r].file = runs[r].get();
+        readers[r].buffer.resize(buffer_keys);
+        if (readers[r].has_next()) heap.emplace(readers[r].peek(), r);
+    }
+    bool first = true;
+    Key last = 0;
+    while (!heap.empty()) {
+        const auto [key, r] = heap.top(); heap.pop();
+        if (first || key != last) sink(key);
+        first = false;
+        last = key;
+        ++readers[r].pos;
+        if (readers[r].has_next()) heap.emplace(readers[r].peek(), r);
+    }
+    for (const file_ptr &run : runs)
+        if (ferror(run.get())) return false;
+    return true;
+}
+
+// Streaming BFS emitter fed with sorted unique keys. m_mask[l] and m_multi[l] describe the
+// currently open node on level l: the occupancy mask of its children so far, and whether it has
+// seen more than one key. A node is emitted when it closes, provided its parent is internal.
+template <int Bits = 16>
+class DfsEmitter {
+public:
+    using key_type = typename morton<Bits>::key_type;
+    // Levels 0 .. Bits - 1 split on octants at depth top_depth .. 0; level Bits holds the
+    // duplicates split at depth 0.
+    static constexpr int NUM_LEVELS = Bits + 1;
+
+private:
+    FILE* m_bytes[NUM_LEVELS];
+    FILE* m_leaves[NUM_LEVELS];
+    byte m_mask[NUM_LEVELS] = {0};
+    bool m_multi[NUM_LEVELS] = {false};
+    key_type m_last = 0;
+    bool m_empty = true;
+    bool m_ok = true;
+
+    static int octant(const key_type key, const int level) { return (key >> (morton<Bits>::top_depth - 3 * level)) & 7; }
+
+    // Closes the open node on `level`; its parent is internal iff parent_multi.
+    void close(const int level, const bool parent_multi) {
+        if (!parent_multi) return;                       // Inside a leaf: nothing to emit
+        if (m_multi[level]) {
+            m_ok &= fputc(m_mask[level], m_bytes[level]) != EOF;
+        } else {
+            m_ok &= fputc(0, m_bytes[level]) != EOF;
+            m_ok &= fwrite(&m_last, sizeof(m_last), 1, m_leaves[level]) == 1;
+        }
+    }
+
+public:
+    DfsEmitter(const file_ptr bytes[NUM_LEVELS], const file_ptr leaves[NUM_LEVELS]) {
+        for (int l = 0; l < NUM_LEVELS; ++l) {
+            m_bytes[l] = bytes[l].get();
+            m_leaves[l] = leaves[l].get();
+        }
+    }
+
+    // Whether everything emitted so far was written.
+    bool ok() const { return m_ok; }
+
+    void push(const key_type key) {
+        // The first level whose node differs from the previous key's: everything from there down closes.
+        int split = 0;
+        if (!m_empty) {
+            split = 1;
+            while (split < NUM_LEVELS && octant(key, split - 1) == octant(m_last, split - 1)) ++split;
+            for (int l = NUM_LEVELS - 1; l >= split; --l)
+                close(l, l == split || m_multi[l - 1]);
+            for (int l = 0; l < split; ++l) m_multi[l] = true;
+        }
+        for (int l = split; l < NUM_LEVELS; ++l) {
+            m_mask[l] = 0;
+            m_multi[l] = false;
+        }
+        for (int l = 0; l < NUM_LEVELS - 1; ++l) m_mask[l] |= 1 << octant(key, l);
+        m_last = key;
+        m_empty = false;
+    }
+
+    // Closes every open node, root last.
+    void finish() {
+        if (m_empty) return;
+        for (int l = NUM_LEVELS - 1; l > 0; --l)
+            close(l, m_multi[l - 1]);
+        close(0, true);
+    }
+};
+
+// Writes `points` as a raw point file readable by externalSortStream.
+bool writePointFile(const char* path, const std::vector<point> &points) {
+    FILE* file = fopen(path, "wb");
+    if (!file) return false;
+    // An empty vector's data() may be null, which fwrite doesn't accept even for no elements.
+    const bool ok = points.empty() || fwrite(points.data(), sizeof(point), points.size(), file) == points.size();
+    return fclose(file) == 0 && ok;
+}
+
+// Encodes the raw point file at points_path into stream_path and bitstream_path, producing the same
+// bytes as radixSortStream<Bits> would for the whole cloud. Memory use is bounded by roughly
+// `memory_budget` bytes (plus stdio buffers); spill files go to spill_dir.
+template <int Bits = 16>
+bool externalSortStream(const char* points_path, const char* stream_path, const char* bitstream_path,
+                        const size_t memory_budget, const std::string &spill_dir = "/tmp") {
+    using key_type = typename morton<Bits>::key_type;
+    constexpr int NUM_LEVELS = DfsEmitter<Bits>::NUM_LEVELS;
+    MappedFile input;
+    input.fd = open(points_path, O_RDONLY);
+    if (input.fd < 0) {
+        std::cout << "cannot open " << points_path << '\n';
+        return false;
+    }
+    struct stat st;
+    if (fstat(input.fd, &st) != 0) {
+        std::cout << "cannot stat " << points_path << '\n';
+        return false;
+    }
+    if (st.st_size % sizeof(point) != 0) {
+        std::cout << "truncated point file " << points_path << '\n';
+        return false;
+    }
+    const size_t num_points = st.st_size / sizeof(point);
+    const point* points = nullptr;
+    if (num_points) {
+        void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, input.fd, 0);
+        if (map == MAP_FAILED) {
+            std::cout << "cannot map " << points_path << '\n';
+            return false;
+        }
+        input.map = map;
+        input.size = st.st_size;
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        points = static_cast<const point*>(map);
+    }
+
+    // Phase 1: sorted, deduplicated runs of at most run_keys keys each.
+    const size_t run_keys = std::max<size_t>(memory_budget / sizeof(key_type), 1024);
+    std::vector<file_ptr> runs;
+    {
+        std::vector<key_type> keys(std::min(run_keys, num_points));
+        for (size_t begin = 0; begin < num_points; begin += run_keys) {
+            const size_t n = std::min(run_keys, num_points - begin);
+            morton<Bits>::encode_points(points + begin, n, keys.data());
+            // These pages won't be read again.
+            madvise((void*)((uintptr_t)(points + begin) & ~(uintptr_t)4095), n * sizeof(point), MADV_DONTNEED);
+            std::sort(keys.begin(), keys.begin() + n);
+            const size_t unique = std::unique(keys.begin(), keys.begin() + n) - keys.begin();
+            file_ptr run = spill_file(spill_dir);
+            if (!run || fwrite(keys.data(), sizeof(key_type), unique, run.get()) != unique) {
+                std::cout << "cannot spill to " << spill_dir << '\n';
+                return false;
+            }
+            runs.push_back(std::move(run));
+        }
+    }
+    input.release();
+
+    // Merge passes: each reader gets an equal share of the budget; keep at least 4K keys per reader.
+    const size_t min_buffer = 4096;
+    const size_t fan_in = std::max<size_t>(2, memory_budget / sizeof(key_type) / min_buffer);
+    while (runs.size() > fan_in) {
+        std::vector<file_ptr> merged;
+        for (size_t i = 0; i < runs.size(); i += fan_in) {
+            const std::vector<file_ptr> group(std::make_move_iterator(runs.begin() + i),
+                                              std::make_move_iterator(runs.begin() + std::min(runs.size(), i + fan_in)));
+            file_ptr out = spill_file(spill_dir);
+            bool written = true;
+            const bool read = out && merge_runs<key_type>(group, std::max<size_t>(run_keys / (group.size() + 1), 1), [&](key_type key) {
+                written &= fwrite(&key, sizeof(key), 1, out.get()) == 1;
+            });
+            if (!read || !written) {
+                std::cout << "cannot spill to " << spill_dir << '\n';
+                return false;
+            }
+            merged.push_back(std::move(out));
+        }
+        runs.swap(merged);
+    }
+
+    // Phase 2: merge the remaining runs straight into the per-level emitter.
+    file_ptr level_bytes[NUM_LEVELS];
+    file_ptr level_leaves[NUM_LEVELS];
+    for (int l = 0; l < NUM_LEVELS; ++l) {
+        level_bytes[l] = spill_file(spill_dir);
+        level_leaves[l] = spill_file(spill_dir);
+        if (!level_bytes[l] || !level_leaves[l]) {
+            std::cout << "cannot spill to " << spill_dir << '\n';
+            return false;
+        }
+    }
+    DfsEmitter<Bits> emitter(level_bytes, level_leaves);
+    const bool merged = merge_runs<key_type>(runs, std::max<size_t>(run_keys / (runs.size() + 1), 1), [&](key_type key) { emitter.push(key); });
+    emitter.finish();
+    if (!merged || !emitter.ok()) {
+        std::cout << "cannot spill to " << spill_dir << '\n';
+        return false;
+    }
+    runs.clear();
+
+    // Phase 3: concatenate the levels, encoding the leaves as we go.
+    file_ptr stream_out(fopen(stream_path, "wb"));
+    file_ptr bits_out(fopen(bitstream_path, "wb"));
+    if (!stream_out || !bits_out) {
+        std::cout << "cannot open output files" << '\n';
+        return false;
+    }
+    std::vector<char> copy_buffer(1 << 16);
+    bool ok = true;
+    bitstream bit_stream;
+    bitstream_writer bit_writer(bit_stream);
+    const auto write_bits = [&](const byte* data, size_t size) { ok &= fwrite(data, 1, size, bits_out.get()) == size; };
+    std::vector<key_type> leaves(std::max<size_t>(memory_budget / 2 / sizeof(key_type), 1024));
+    for (int l = 0; l < NUM_LEVELS && ok; ++l) {
+        FILE* const bytes = level_bytes[l].get();
+        FILE* const level = level_leaves[l].get();
+        ok &= rewind_spill(bytes) && rewind_spill(level);
+        size_t n;
+        while (ok && (n = fread(copy_buffer.data(), 1, copy_buffer.size(), bytes)))
+            ok &= fwrite(copy_buffer.data(), 1, n, stream_out.get()) == n;
+        while (ok && (n = fread(leaves.data(), sizeof(key_type), leaves.size(), level))) {
+            encode_leaves<Bits>(bit_writer, morton<Bits>::top_depth - 3 * l, leaves.data(), n);
+            bit_writer.drain(write_bits);
+        }
+        ok &= !ferror(bytes) && !ferror(level);
+        level_bytes[l].reset();
+        level_leaves[l].reset();
+    }
+    bit_writer.finish();
+    write_bits(bit_stream.data(), bit_stream.size());
+    ok &= fclose(stream_out.release()) == 0;
+    ok &= fclose(bits_out.release()) == 0;
+    if (!ok) std::cout << "failed writing output files" << '\n';
+    return ok;
+}
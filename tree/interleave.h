@@ -1,29 +1,26 @@
-
 #pragma once
 
 #include <cstdint>
+#include <cstddef>
 #include <array>
+#include <immintrin.h>
+#include <type_traits>
 
 #define MAX_MORTON_KEY 1317624576693539401
 
-std::array<uint32_t, 256> mkeys;
-
-template <uint32_t i>
-struct _morton {
-    enum { value = (_morton<i-1>::value - MAX_MORTON_KEY) & MAX_MORTON_KEY };
-    static void add_values(std::array<uint32_t, 256> &v) {
-        _morton<i-1>::add_values(v);
+// Spreads the bits of an 8-bit value so that bit i lands on bit 3i.
+// Counting up in the masked space (v - MAX) & MAX enumerates exactly these values.
+constexpr std::array<uint32_t, 256> _morton_table() {
+    std::array<uint32_t, 256> v{};
+    uint64_t value = 0;
+    for (int i = 1; i < 256; ++i) {
+        value = (value - MAX_MORTON_KEY) & MAX_MORTON_KEY;
         v[i] = value;
     }
-};
+    return v;
+}
 
-template <>
-struct _morton<0> {
-    enum { value = 0 };
-    static void add_values(std::array<uint32_t, 256> &v) {
-        v[0] = value;
-    }
-};
+constexpr std::array<uint32_t, 256> mkeys = _morton_table();
 
 inline uint64_t _interleave(const uint16_t x, const uint16_t y, const uint16_t z) {
     uint64_t result = 0;
@@ -32,15 +29,310 @@ inline uint64_t _interleave(const uint16_t x, const uint16_t y, const uint16_t z
     return result;
 }
 
+// Bits 0, 3, 6, ..., 45: the x-axis bits of a 48-bit key.
+constexpr uint64_t MORTON_X_MASK = 0x249249249249;
+
+// Magic-number compaction: the inverse of the bit spread, without a per-bit loop.
+inline uint64_t _compact(uint64_t v) {
+    v &= MAX_MORTON_KEY;
+    v = (v ^ (v >> 2)) & 0x10c30c30c30c30c3;
+    v = (v ^ (v >> 4)) & 0x100f00f00f00f00f;
+    v = (v ^ (v >> 8)) & 0x1f0000ff0000ff;
+    v = (v ^ (v >> 16)) & 0x1f00000000ffff;
+    v = (v ^ (v >> 32)) & 0x1fffff;
+    return v;
+}
+
+// Magic-number spread: bit i of a (<= 21-bit) value lands on bit 3i.
+inline uint64_t _spread(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | (v << 32)) & 0x1f00000000ffff;
+    v = (v | (v << 16)) & 0x1f0000ff0000ff;
+    v = (v | (v << 8)) & 0x100f00f00f00f00f;
+    v = (v | (v << 4)) & 0x10c30c30c30c30c3;
+    v = (v | (v << 2)) & 0x1249249249249249;
+    return v;
+}
+
 inline void _unpack(uint64_t val, uint16_t &x, uint16_t &y, uint16_t &z) {
-    const uint64_t x_mask = 0b001001001001001001001001'001001001001001001001001;
-    const uint64_t y_mask = 0b010010010010010010010010'010010010010010010010010;
-    const uint64_t z_mask = 0b100100100100100100100100'100100100100100100100100;
-    x = y = z = 0;
-    for (int i = 15; i-->0; ) {
-        x = 2 * x + ((val >> (3 * i + 0)) & 1);
-        y = 2 * y + ((val >> (3 * i + 1)) & 1);
-        z = 2 * z + ((val >> (3 * i + 2)) & 1);
+#ifdef __BMI2__
+    x = _pext_u64(val, MORTON_X_MASK);
+    y = _pext_u64(val, MORTON_X_MASK << 1);
+    z = _pext_u64(val, MORTON_X_MASK << 2);
+#else
+    x = _compact(val);
+    y = _compact(val >> 1);
+    z = _compact(val >> 2);
+#endif
+}
+
+// Batch kernels over arrays of points. Each backend produces exactly the keys of _interleave
+// (coordinates are truncated to 16 bits) and exactly the coordinates of _unpack.
+using _point3 = std::array<uint32_t, 3>;
+
+inline void _interleave_table(const _point3 *points, size_t n, uint64_t *keys) {
+    for (size_t i = 0; i < n; ++i)
+        keys[i] = _interleave(points[i][0], points[i][1], points[i][2]);
+}
+
+inline void _unpack_scalar(const uint64_t *keys, size_t n, _point3 *points) {
+    for (size_t i = 0; i < n; ++i)
+        points[i] = {(uint32_t)_compact(keys[i]), (uint32_t)_compact(keys[i] >> 1), (uint32_t)_compact(keys[i] >> 2)};
+}
+
+__attribute__((target("bmi2")))
+inline void _interleave_bmi2(const _point3 *points, size_t n, uint64_t *keys) {
+    for (size_t i = 0; i < n; ++i)
+        keys[i] = _pdep_u64(points[i][0], MORTON_X_MASK)
+                | _pdep_u64(points[i][1], MORTON_X_MASK << 1)
+                | _pdep_u64(points[i][2], MORTON_X_MASK << 2);
+}
+
+__attribute__((target("bmi2")))
+inline void _unpack_bmi2(const uint64_t *keys, size_t n, _point3 *points) {
+    for (size_t i = 0; i < n; ++i)
+        points[i] = {(uint32_t)_pext_u64(keys[i], MORTON_X_MASK),
+                     (uint32_t)_pext_u64(keys[i], MORTON_X_MASK << 1),
+                     (uint32_t)_pext_u64(keys[i], MORTON_X_MASK << 2)};
+}
+
+// Both take the coordinate (or key) mask, so that other grid sizes than 16 bits can use them.
+__attribute__((target("avx2")))
+inline __m256i _spread_avx2(__m256i v, const uint64_t coord_mask = 0xFFFF) {
+    v = _mm256_and_si256(v, _mm256_set1_epi64x(coord_mask));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi64(v, 32)), _mm256_set1_epi64x(0x1f00000000ffff));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi64(v, 16)), _mm256_set1_epi64x(0x1f0000ff0000ff));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi64(v, 8)), _mm256_set1_epi64x(0x100f00f00f00f00f));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi64(v, 4)), _mm256_set1_epi64x(0x10c30c30c30c30c3));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi64(v, 2)), _mm256_set1_epi64x(0x1249249249249249));
+    return v;
+}
+
+__attribute__((target("avx2")))
+inline __m256i _compact_avx2(__m256i v, const uint64_t x_mask = MORTON_X_MASK) {
+    v = _mm256_and_si256(v, _mm256_set1_epi64x(x_mask));
+    v = _mm256_and_si256(_mm256_xor_si256(v, _mm256_srli_epi64(v, 2)), _mm256_set1_epi64x(0x10c30c30c30c30c3));
+    v = _mm256_and_si256(_mm256_xor_si256(v, _mm256_srli_epi64(v, 4)), _mm256_set1_epi64x(0x100f00f00f00f00f));
+    v = _mm256_and_si256(_mm256_xor_si256(v, _mm256_srli_epi64(v, 8)), _mm256_set1_epi64x(0x1f0000ff0000ff));
+    v = _mm256_and_si256(_mm256_xor_si256(v, _mm256_srli_epi64(v, 16)), _mm256_set1_epi64x(0x1f00000000ffff));
+    v = _mm256_and_si256(_mm256_xor_si256(v, _mm256_srli_epi64(v, 32)), _mm256_set1_epi64x(0x1fffff));
+    return v;
+}
+
+// Four points per iteration: 12 packed uint32s are gathered into x, y and z lanes, spread, and merged.
+__attribute__((target("avx2")))
+inline void _interleave_avx2(const _point3 *points, size_t n, uint64_t *keys) {
+    const uint32_t *flat = points->data();
+    const __m128i idx = _mm_setr_epi32(0, 3, 6, 9);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const int *base = (const int *)(flat + 3 * i);
+        const __m256i x = _mm256_cvtepu32_epi64(_mm_i32gather_epi32(base + 0, idx, 4));
+        const __m256i y = _mm256_cvtepu32_epi64(_mm_i32gather_epi32(base + 1, idx, 4));
+        const __m256i z = _mm256_cvtepu32_epi64(_mm_i32gather_epi32(base + 2, idx, 4));
+        const __m256i key = _mm256_or_si256(_spread_avx2(x),
+                            _mm256_or_si256(_mm256_slli_epi64(_spread_avx2(y), 1),
+                                            _mm256_slli_epi64(_spread_avx2(z), 2)));
+        _mm256_storeu_si256((__m256i *)(keys + i), key);
     }
+    _interleave_table(points + i, n - i, keys + i);
 }
 
+__attribute__((target("avx2")))
+inline void _unpack_avx2(const uint64_t *keys, size_t n, _point3 *points) {
+    size_t i = 0;
+    alignas(32) uint64_t x[4], y[4], z[4];
+    for (; i + 4 <= n; i += 4) {
+        const __m256i key = _mm256_loadu_si256((const __m256i *)(keys + i));
+        _mm256_store_si256((__m256i *)x, _compact_avx2(key));
+        _mm256_store_si256((__m256i *)y, _compact_avx2(_mm256_srli_epi64(key, 1)));
+        _mm256_store_si256((__m256i *)z, _compact_avx2(_mm256_srli_epi64(key, 2)));
+        for (int j = 0; j < 4; ++j)
+            points[i + j] = {(uint32_t)x[j], (uint32_t)y[j], (uint32_t)z[j]};
+    }
+    _unpack_scalar(keys + i, n - i, points + i);
+}
+
+// Runtime dispatch, resolved once. PDEP/PEXT wins where it is fast, but AMD parts before Zen 3
+// microcode it and we can't cheaply tell them apart, so AMD takes the AVX2 path.
+using _interleave_kernel = void (*)(const _point3 *, size_t, uint64_t *);
+using _unpack_kernel = void (*)(const uint64_t *, size_t, _point3 *);
+
+inline bool _fast_bmi2() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("bmi2") && !__builtin_cpu_is("amd");
+}
+
+inline _interleave_kernel _select_interleave() {
+    if (_fast_bmi2()) return &_interleave_bmi2;
+    if (__builtin_cpu_supports("avx2")) return &_interleave_avx2;
+    return &_interleave_table;
+}
+
+inline _unpack_kernel _select_unpack() {
+    if (_fast_bmi2()) return &_unpack_bmi2;
+    if (__builtin_cpu_supports("avx2")) return &_unpack_avx2;
+    return &_unpack_scalar;
+}
+
+// Interleaves points[0, n) into keys[0, n).
+inline void interleave_points(const _point3 *points, size_t n, uint64_t *keys) {
+    static const _interleave_kernel kernel = _select_interleave();
+    kernel(points, n, keys);
+}
+
+// Recovers the (16-bit) coordinates of keys[0, n) into points[0, n).
+inline void unpack_keys(const uint64_t *keys, size_t n, _point3 *points) {
+    static const _unpack_kernel kernel = _select_unpack();
+    kernel(keys, n, points);
+}
+
+// The batch kernels for grids of other sizes (see morton<Bits> below): coordinates are truncated to
+// Bits bits, keys take 3 * Bits bits and are stored as Key, which may be 32 bits wide. Dispatched
+// the same way as the 16-bit kernels.
+template <typename Key> using _encode_kernel = void (*)(const _point3 *, size_t, Key *);
+template <typename Key> using _decode_kernel = void (*)(const Key *, size_t, _point3 *);
+
+template <int Bits>
+constexpr uint64_t _x_mask = MAX_MORTON_KEY & ((1ULL << (3 * Bits)) - 1);
+
+template <int Bits, typename Key>
+inline void _encode_scalar(const _point3 *points, size_t n, Key *keys) {
+    constexpr uint32_t mask = (1u << Bits) - 1;
+    for (size_t i = 0; i < n; ++i)
+        keys[i] = _spread(points[i][0] & mask) | _spread(points[i][1] & mask) << 1 | _spread(points[i][2] & mask) << 2;
+}
+
+template <int Bits, typename Key>
+inline void _decode_scalar(const Key *keys, size_t n, _point3 *points) {
+    for (size_t i = 0; i < n; ++i)
+        points[i] = {(uint32_t)_compact(keys[i]), (uint32_t)_compact((uint64_t)keys[i] >> 1),
+                     (uint32_t)_compact((uint64_t)keys[i] >> 2)};
+}
+
+template <int Bits, typename Key>
+__attribute__((target("bmi2")))
+inline void _encode_bmi2(const _point3 *points, size_t n, Key *keys) {
+    for (size_t i = 0; i < n; ++i)
+        keys[i] = _pdep_u64(points[i][0], _x_mask<Bits>)
+                | _pdep_u64(points[i][1], _x_mask<Bits> << 1)
+                | _pdep_u64(points[i][2], _x_mask<Bits> << 2);
+}
+
+template <int Bits, typename Key>
+__attribute__((target("bmi2")))
+inline void _decode_bmi2(const Key *keys, size_t n, _point3 *points) {
+    for (size_t i = 0; i < n; ++i)
+        points[i] = {(uint32_t)_pext_u64(keys[i], _x_mask<Bits>),
+                     (uint32_t)_pext_u64(keys[i], _x_mask<Bits> << 1),
+                     (uint32_t)_pext_u64(keys[i], _x_mask<Bits> << 2)};
+}
+
+// As _interleave_avx2; 32-bit keys are narrowed from the 64-bit lanes before the store.
+template <int Bits, typename Key>
+__attribute__((target("avx2")))
+inline void _encode_avx2(const _point3 *points, size_t n, Key *keys) {
+    constexpr uint64_t coord_mask = (1u << Bits) - 1;
+    const uint32_t *flat = points->data();
+    const __m128i idx = _mm_setr_epi32(0, 3, 6, 9);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const int *base = (const int *)(flat + 3 * i);
+        const __m256i x = _mm256_cvtepu32_epi64(_mm_i32gather_epi32(base + 0, idx, 4));
+        const __m256i y = _mm256_cvtepu32_epi64(_mm_i32gather_epi32(base + 1, idx, 4));
+        const __m256i z = _mm256_cvtepu32_epi64(_mm_i32gather_epi32(base + 2, idx, 4));
+        const __m256i key = _mm256_or_si256(_spread_avx2(x, coord_mask),
+                            _mm256_or_si256(_mm256_slli_epi64(_spread_avx2(y, coord_mask), 1),
+                                            _mm256_slli_epi64(_spread_avx2(z, coord_mask), 2)));
+        if constexpr (sizeof(Key) == 4)
+            _mm_storeu_si128((__m128i *)(keys + i),
+                             _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(key, _mm256_setr_epi32(0, 2, 4, 6, 0, 0, 0, 0))));
+        else
+            _mm256_storeu_si256((__m256i *)(keys + i), key);
+    }
+    _encode_scalar<Bits>(points + i, n - i, keys + i);
+}
+
+template <int Bits, typename Key>
+__attribute__((target("avx2")))
+inline void _decode_avx2(const Key *keys, size_t n, _point3 *points) {
+    size_t i = 0;
+    alignas(32) uint64_t x[4], y[4], z[4];
+    for (; i + 4 <= n; i += 4) {
+        __m256i key;
+        if constexpr (sizeof(Key) == 4)
+            key = _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i *)(keys + i)));
+        else
+            key = _mm256_loadu_si256((const __m256i *)(keys + i));
+        _mm256_store_si256((__m256i *)x, _compact_avx2(key, _x_mask<Bits>));
+        _mm256_store_si256((__m256i *)y, _compact_avx2(_mm256_srli_epi64(key, 1), _x_mask<Bits>));
+        _mm256_store_si256((__m256i *)z, _compact_avx2(_mm256_srli_epi64(key, 2), _x_mask<Bits>));
+        for (int j = 0; j < 4; ++j)
+            points[i + j] = {(uint32_t)x[j], (uint32_t)y[j], (uint32_t)z[j]};
+    }
+    _decode_scalar<Bits>(keys + i, n - i, points + i);
+}
+
+template <int Bits, typename Key>
+inline _encode_kernel<Key> _select_encode() {
+    if (_fast_bmi2()) return &_encode_bmi2<Bits, Key>;
+    if (__builtin_cpu_supports("avx2")) return &_encode_avx2<Bits, Key>;
+    return &_encode_scalar<Bits, Key>;
+}
+
+template <int Bits, typename Key>
+inline _decode_kernel<Key> _select_decode() {
+    if (_fast_bmi2()) return &_decode_bmi2<Bits, Key>;
+    if (__builtin_cpu_supports("avx2")) return &_decode_avx2<Bits, Key>;
+    return &_decode_scalar<Bits, Key>;
+}
+
+// Morton keys for a grid of `Bits` bits per axis. Keys take 3 * Bits bits and are stored in the
+// narrowest unsigned type that holds them; the root's octant sits at bit top_depth.
+template <int Bits>
+struct morton {
+    static_assert(1 <= Bits && Bits <= 21, "Morton keys hold at most 21 bits per axis");
+    using key_type = std::conditional_t<3 * Bits <= 32, uint32_t, uint64_t>;
+    static constexpr int bits = Bits;
+    static constexpr int top_depth = 3 * (Bits - 1);
+    static constexpr uint32_t coord_mask = (1u << Bits) - 1;
+    static constexpr uint64_t x_mask = _x_mask<Bits>;
+
+    static key_type encode(const uint32_t x, const uint32_t y, const uint32_t z) {
+#ifdef __BMI2__
+        return _pdep_u64(x, x_mask) | _pdep_u64(y, x_mask << 1) | _pdep_u64(z, x_mask << 2);
+#else
+        return _spread(x & coord_mask) | _spread(y & coord_mask) << 1 | _spread(z & coord_mask) << 2;
+#endif
+    }
+
+    static void decode(const key_type key, uint32_t &x, uint32_t &y, uint32_t &z) {
+#ifdef __BMI2__
+        x = _pext_u64(key, x_mask);
+        y = _pext_u64(key, x_mask << 1);
+        z = _pext_u64(key, x_mask << 2);
+#else
+        x = _compact(key);
+        y = _compact((uint64_t)key >> 1);
+        z = _compact((uint64_t)key >> 2);
+#endif
+    }
+
+    static void encode_points(const _point3 *points, size_t n, key_type *keys) {
+        if constexpr (Bits == 16) {
+            interleave_points(points, n, keys);
+        } else {
+            static const _encode_kernel<key_type> kernel = _select_encode<Bits, key_type>();
+            kernel(points, n, keys);
+        }
+    }
+
+    static void decode_keys(const key_type *keys, size_t n, _point3 *points) {
+        if constexpr (Bits == 16) {
+            unpack_keys(keys, n, points);
+        } else {
+            static const _decode_kernel<key_type> kernel = _select_decode<Bits, key_type>();
+            kernel(keys, n, points);
+        }
+    }
+};
@@ -4,9 +4,39 @@
 #include <bitset>
 #include <chrono>
 #include <cassert>
+#include <thread>
+#include <tuple>
+#include <fstream>
+#include <iterator>
+#include <cstdio>
+#include <random>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <unordered_map>
 
 #include "interleave.h"
 #include "tree.h"
+#include "external.h"
+#include "entropy.h"
+#include "stream_index.h"
+#include "encoder.h"
+#include "temporal.h"
+#include "quantize.h"
+#include "attributes.h"
+#include "query.h"
+
+// Counts heap allocations, so benchmarks can report allocations per frame.
+static std::atomic<size_t> num_allocations{0};
+
+// Kept out of line so the compiler doesn't pair the inlined malloc() and free() with `new` and `delete`.
+__attribute__((noinline)) void* operator new(size_t size) {
+    ++num_allocations;
+    if (void* ptr = std::malloc(size)) return ptr;
+    throw std::bad_alloc();
+}
+__attribute__((noinline)) void operator delete(void* ptr) noexcept { std::free(ptr); }
+__attribute__((noinline)) void operator delete(void* ptr, size_t) noexcept { std::free(ptr); }
 
 std::ostream& operator<< (std::ostream &os, bytestream stream) {
     os << "stream{ ";
@@ -19,11 +49,76 @@ std::ostream& operator<< (std::ostream &os, bytestream stream) {
 
 uint16_t rnd() { return rand() & ((1 << 16) - 1); }
 
+void benchmark_interleave(const std::vector<point> template_points) {
+    using milli = std::chrono::milliseconds;
+    const size_t num_points = template_points.size();
+    std::vector<uint64_t> keys(num_points), reference(num_points);
+    std::vector<point> unpacked(num_points);
+    _interleave_table(template_points.data(), num_points, reference.data());
+    const bool bmi2 = __builtin_cpu_supports("bmi2"), avx2 = __builtin_cpu_supports("avx2");
+    const std::tuple<const char*, _interleave_kernel, bool> interleavers[] = {
+        {"table", &_interleave_table, true}, {"bmi2", &_interleave_bmi2, bmi2}, {"avx2", &_interleave_avx2, avx2}};
+    const std::tuple<const char*, _unpack_kernel, bool> unpackers[] = {
+        {"scalar", &_unpack_scalar, true}, {"bmi2", &_unpack_bmi2, bmi2}, {"avx2", &_unpack_avx2, avx2}};
+    for (const auto& [name, kernel, supported] : interleavers) {
+	if (!supported) continue;
+	const auto& start = std::chrono::high_resolution_clock::now();
+	kernel(template_points.data(), num_points, keys.data());
+	const auto& finish = std::chrono::high_resolution_clock::now();
+	std::cout << "interleave (" << name << ") of " << num_points << " points took "
+		  << std::chrono::duration_cast<milli>(finish - start).count()
+		  << " milliseconds\n";
+	assert(keys == reference);
+    }
+    for (const auto& [name, kernel, supported] : unpackers) {
+	if (!supported) continue;
+	const auto& start = std::chrono::high_resolution_clock::now();
+	kernel(reference.data(), num_points, unpacked.data());
+	const auto& finish = std::chrono::high_resolution_clock::now();
+	std::cout << "unpack (" << name << ") of " << num_points << " points took "
+		  << std::chrono::duration_cast<milli>(finish - start).count()
+		  << " milliseconds\n";
+	assert(unpacked == template_points);
+    }
+}
+
+void benchmark_bitstream(const std::vector<point> template_points) {
+    using seconds = std::chrono::duration<double>;
+    const size_t num_points = template_points.size();
+    std::vector<uint64_t> keys(num_points);
+    interleave_points(template_points.data(), num_points, keys.data());
+    for (int depth : {45, 21}) {
+	bitstream bit_stream;
+	const auto& start = std::chrono::high_resolution_clock::now();
+	{
+	    bitstream_writer writer(bit_stream, 6 * num_points);
+	    encode_leaves(writer, depth, keys.data(), num_points);
+	    writer.finish();
+	}
+	const auto& middle = std::chrono::high_resolution_clock::now();
+	bitstream_reader reader(bit_stream);
+	const int bits = leaf_bits(depth);
+	const uint64_t mask = (1ULL << bits) - 1;
+	bool ok = true;
+	for (size_t i = 0; i < num_points; ++i) {
+	    const coord x = reader.read(bits), y = reader.read(bits), z = reader.read(bits);
+	    ok &= x == (template_points[i][0] & mask) && y == (template_points[i][1] & mask) && z == (template_points[i][2] & mask);
+	}
+	const auto& finish = std::chrono::high_resolution_clock::now();
+	const double megabytes = bit_stream.size() / 1e6;
+	std::cout << "encode_leaves() of " << num_points << " " << 3 * bits << "-bit residuals: writer "
+		  << megabytes / seconds(middle - start).count() << " MB/s, reader "
+		  << megabytes / seconds(finish - middle).count() << " MB/s\n";
+	assert(ok && reader.valid());
+    }
+}
+
 void benchmark_stdsortstream(const std::vector<point> template_points) {
     using milli = std::chrono::milliseconds;
     const size_t max_points = template_points.size();
 
     for (size_t num_points : {10e3, 25e3, 10e4, 25e4, 10e5, 25e5, 10e6, 25e6}) {
+	assert(num_points <= max_points);
 	const std::vector<point> points(template_points.begin(), template_points.begin() + num_points);
 	const auto& start = std::chrono::high_resolution_clock::now();
 	const auto& [stream, bitstream] = stdSortStream(points);
@@ -31,8 +126,9 @@ void benchmark_stdsortstream(const std::vector<point> template_points) {
 	std::cout << "stdSortStream() with " << num_points << " points took "
 		  << std::chrono::duration_cast<milli>(finish - start).count()
 		  << " milliseconds\n";
-	continue;
-        assert(validByteStream(stream, bitstream));
+	// validByteStream builds the whole tree out of heap nodes, so keep it to the smaller clouds.
+	if (num_points <= 25e5)
+	    assert(validByteStream(stream, bitstream));
     }
 }
 
@@ -48,15 +144,13 @@ void benchmark_radixsortstream(const std::vector<point> template_points) {
 	std::cout << "radixSortStream() with " << num_points << " points took "
 		  << std::chrono::duration_cast<milli>(finish - start).count()
 		  << " milliseconds\n";
-	continue;
-        const auto &[std_stream, std_bitstream] = stdSortStream(points);
-	assert(validByteStream(std_stream, std_bitstream));
-        assert(validByteStream(radix_stream, radix_bitstream));
-        const auto &[std_it, radix_it] = std::mismatch(std_stream.begin(), std_stream.end(), radix_stream.begin());
+	const auto &[std_stream, std_bitstream] = stdSortStream(points);
+	assert(radix_bitstream == std_bitstream);
+        const auto &[std_it, radix_it] = std::mismatch(std_stream.begin(), std_stream.end(), radix_stream.begin(), radix_stream.end());
         const size_t first_mismatch = std_it - std_stream.begin();
 	if (radix_stream != std_stream) {
 	    std::cout << "First mismatch: " << first_mismatch << '\n';
-	    if (first_mismatch != std_stream.size()) {
+	    if (std_it != std_stream.end() && radix_it != radix_stream.end()) {
 		std::cout << "(std)" << std::bitset<8>(*std_it) << " != " << "(rad)" << std::bitset<8>(*radix_it) << '\n';
 	    }
 	    std::cout << radix_stream.size() << ", " << std_stream.size() << '\n';
@@ -65,13 +159,470 @@ void benchmark_radixsortstream(const std::vector<point> template_points) {
     }
 }
 
+void benchmark_parallelradixsortstream(const std::vector<point> template_points) {
+    using milli = std::chrono::milliseconds;
+    const size_t max_points = template_points.size();
+    std::vector<unsigned int> thread_counts;
+    for (unsigned int t = 1; t < std::thread::hardware_concurrency(); t *= 2)
+        thread_counts.push_back(t);
+    thread_counts.push_back(std::max(1u, std::thread::hardware_concurrency()));
+    for (size_t num_points : {10e3, 25e3, 10e4, 25e4, 10e5, 25e5, 10e6, 25e6}) {
+	assert(num_points <= max_points);
+	const std::vector<point> points(template_points.begin(), template_points.begin() + num_points);
+	const auto& [serial_stream, serial_bitstream] = radixSortStream(points);
+	for (unsigned int num_threads : thread_counts) {
+	    util::thread_pool pool(num_threads);
+	    const auto& start = std::chrono::high_resolution_clock::now();
+	    const auto& [stream, bitstream] = parallelRadixSortStream(points, pool);
+	    const auto& finish = std::chrono::high_resolution_clock::now();
+	    std::cout << "parallelRadixSortStream() with " << num_points << " points on "
+		      << num_threads << " threads took "
+		      << std::chrono::duration_cast<milli>(finish - start).count()
+		      << " milliseconds\n";
+	    assert(stream == serial_stream);
+	    assert(bitstream == serial_bitstream);
+	}
+    }
+}
+
+void benchmark_decodestream(const std::vector<point> template_points) {
+    using seconds = std::chrono::duration<double>;
+    const size_t max_points = template_points.size();
+    for (size_t num_points : {10e3, 25e3, 10e4, 25e4, 10e5, 25e5, 10e6, 25e6}) {
+	assert(num_points <= max_points);
+	const std::vector<point> points(template_points.begin(), template_points.begin() + num_points);
+	const auto& encode_start = std::chrono::high_resolution_clock::now();
+	const auto& [stream, bitstream] = radixSortStream(points);
+	const auto& encode_finish = std::chrono::high_resolution_clock::now();
+	const std::vector<point> decoded = decodeStream(stream, bitstream);
+	const auto& decode_finish = std::chrono::high_resolution_clock::now();
+	std::cout << "decodeStream() with " << num_points << " points: "
+		  << num_points / seconds(decode_finish - encode_finish).count() / 1e6 << " Mpoints/s (encode "
+		  << num_points / seconds(encode_finish - encode_start).count() / 1e6 << " Mpoints/s)\n";
+	std::vector<point> expected(points), actual(decoded);
+	std::sort(expected.begin(), expected.end());
+	expected.erase(std::unique(expected.begin(), expected.end()), expected.end());
+	std::sort(actual.begin(), actual.end());
+	assert(actual == expected);
+    }
+}
+
+void benchmark_externalsortstream(const std::vector<point> template_points) {
+    using milli = std::chrono::milliseconds;
+    const size_t max_points = template_points.size();
+    const size_t memory_budget = 64 << 20;
+    const char* points_path = "/tmp/octree-points.bin";
+    const char* stream_path = "/tmp/octree-stream.bin";
+    const char* bitstream_path = "/tmp/octree-bitstream.bin";
+    const auto slurp = [](const char* path) {
+	std::ifstream file(path, std::ios::binary);
+	return bytestream(std::istreambuf_iterator<char>(file), {});
+    };
+    for (size_t num_points : {10e3, 25e3, 10e4, 25e4, 10e5, 25e5, 10e6, 25e6}) {
+	assert(num_points <= max_points);
+	const std::vector<point> points(template_points.begin(), template_points.begin() + num_points);
+	const bool written = writePointFile(points_path, points);
+	assert(written);
+	const auto& start = std::chrono::high_resolution_clock::now();
+	const bool ok = externalSortStream(points_path, stream_path, bitstream_path, memory_budget);
+	const auto& finish = std::chrono::high_resolution_clock::now();
+	std::cout << "externalSortStream() with " << num_points << " points and a "
+		  << (memory_budget >> 20) << " MB budget took "
+		  << std::chrono::duration_cast<milli>(finish - start).count()
+		  << " milliseconds\n";
+	assert(ok);
+	const auto& [stream, bitstream] = radixSortStream(points);
+	assert(slurp(stream_path) == stream);
+	assert(slurp(bitstream_path) == bitstream);
+    }
+    // A partial trailing record is rejected rather than silently dropped.
+    const bool rejected = truncate(points_path, 1000 * sizeof(point) + 1) == 0 &&
+			  !externalSortStream(points_path, stream_path, bitstream_path, memory_budget);
+    assert(rejected);
+    std::remove(points_path);
+    std::remove(stream_path);
+    std::remove(bitstream_path);
+}
+
+void benchmark_compressoccupancy(const std::vector<point> template_points) {
+    using seconds = std::chrono::duration<double>;
+    const size_t max_points = template_points.size();
+    for (size_t num_points : {10e3, 25e3, 10e4, 25e4, 10e5, 25e5, 10e6, 25e6}) {
+	assert(num_points <= max_points);
+	const std::vector<point> points(template_points.begin(), template_points.begin() + num_points);
+	const auto& [stream, bitstream] = radixSortStream(points);
+	const auto& start = std::chrono::high_resolution_clock::now();
+	const bytestream compressed = compressOccupancy(stream);
+	const auto& middle = std::chrono::high_resolution_clock::now();
+	const bytestream decompressed = decompressOccupancy(compressed);
+	const auto& finish = std::chrono::high_resolution_clock::now();
+	const double megabytes = stream.size() / 1e6;
+	std::cout << "compressOccupancy() with " << num_points << " points: "
+		  << 8.0 * stream.size() / num_points << " -> " << 8.0 * compressed.size() / num_points
+		  << " occupancy bits/point, coder " << megabytes / seconds(middle - start).count()
+		  << " MB/s, decoder " << megabytes / seconds(finish - middle).count() << " MB/s\n";
+	assert(decompressed == stream);
+    }
+}
+
+template <int Bits>
+void benchmark_keywidth(const size_t num_points) {
+    using milli = std::chrono::milliseconds;
+    std::mt19937 rng(Bits);
+    std::uniform_int_distribution<coord> dist(0, morton<Bits>::coord_mask);
+    std::vector<point> points(num_points);
+    for (point& p : points) p = {dist(rng), dist(rng), dist(rng)};
+    const auto& start = std::chrono::high_resolution_clock::now();
+    const auto& [stream, bitstream] = radixSortStream<Bits>(points);
+    const auto& finish = std::chrono::high_resolution_clock::now();
+    std::cout << "radixSortStream<" << Bits << ">() with " << num_points << " points ("
+	      << 8 * sizeof(typename morton<Bits>::key_type) << "-bit keys) took "
+	      << std::chrono::duration_cast<milli>(finish - start).count()
+	      << " milliseconds\n";
+    assert(stream == stdSortStream<Bits>(points).first);
+    std::vector<point> expected(points), actual = decodeStream<Bits>(stream, bitstream);
+    std::sort(expected.begin(), expected.end());
+    expected.erase(std::unique(expected.begin(), expected.end()), expected.end());
+    std::sort(actual.begin(), actual.end());
+    assert(actual == expected);
+}
+
+void benchmark_keywidths() {
+    for (size_t num_points : {10e4, 10e5, 10e6}) {
+	benchmark_keywidth<10>(num_points);
+	benchmark_keywidth<16>(num_points);
+	benchmark_keywidth<21>(num_points);
+    }
+}
+
+void benchmark_streamindex(const std::vector<point> template_points) {
+    using micro = std::chrono::microseconds;
+    const size_t max_points = template_points.size();
+    for (size_t num_points : {10e4, 10e5, 10e6}) {
+	assert(num_points <= max_points);
+	const std::vector<point> points(template_points.begin(), template_points.begin() + num_points);
+	const auto& [stream, bitstream] = radixSortStream(points);
+	const StreamIndex index = buildStreamIndex(stream);
+	const size_t index_bytes = index.serialize().size();
+	assert(StreamIndex::deserialize(index.serialize()).matches(stream));
+	assert(!index.matches<12>(stream) && !index.matches(bytestream(stream.begin(), stream.end() - 1)));
+	std::cout << "StreamIndex for " << num_points << " points: " << index_bytes << " bytes ("
+		  << 100.0 * index_bytes / (stream.size() + bitstream.size()) << "% of the streams)\n";
+
+	const auto& full_start = std::chrono::high_resolution_clock::now();
+	const std::vector<point> all = decodeStream(stream, bitstream);
+	const auto& full_finish = std::chrono::high_resolution_clock::now();
+	std::cout << "  full decode: " << std::chrono::duration_cast<micro>(full_finish - full_start).count()
+		  << " microseconds\n";
+
+	for (size_t level : {4, 6, 8}) {
+	    const auto& start = std::chrono::high_resolution_clock::now();
+	    const std::vector<point> lod = decodeLevels(stream, bitstream, index, level);
+	    const auto& finish = std::chrono::high_resolution_clock::now();
+	    std::cout << "  decodeLevels(" << level << "): " << lod.size() << " cells in "
+		      << std::chrono::duration_cast<micro>(finish - start).count() << " microseconds\n";
+	}
+
+	for (coord side : {1 << 12, 1 << 14}) {
+	    const point lo{20000, 20000, 20000}, hi{20000 + side - 1, 20000 + side - 1, 20000 + side - 1};
+	    const auto& start = std::chrono::high_resolution_clock::now();
+	    const std::vector<point> box = decodeBox(stream, bitstream, index, lo, hi);
+	    const auto& finish = std::chrono::high_resolution_clock::now();
+	    std::cout << "  decodeBox(side " << side << "): " << box.size() << " points in "
+		      << std::chrono::duration_cast<micro>(finish - start).count() << " microseconds\n";
+	    const size_t expected = std::count_if(all.begin(), all.end(), [&](const point& p) {
+		return lo[0] <= p[0] && p[0] <= hi[0] && lo[1] <= p[1] && p[1] <= hi[1] && lo[2] <= p[2] && p[2] <= hi[2];
+	    });
+	    assert(box.size() == expected);
+	}
+    }
+}
+
+void benchmark_streamquery(const std::vector<point> template_points) {
+    using micro = std::chrono::duration<double, std::micro>;
+    const size_t num_queries = 100;
+    std::mt19937 rng(14);
+    std::uniform_int_distribution<coord> dist(0, 0xFFFF);
+    const auto distance2 = [](const point &a, const point &b) {
+	uint64_t d2 = 0;
+	for (int i = 0; i < 3; ++i) d2 += ((int64_t)a[i] - b[i]) * ((int64_t)a[i] - b[i]);
+	return d2;
+    };
+    for (size_t num_points : {10e4, 10e5, 10e6}) {
+	assert(num_points <= template_points.size());
+	const std::vector<point> points(template_points.begin(), template_points.begin() + num_points);
+	const auto& [stream, bitstream] = radixSortStream(points);
+	auto start = std::chrono::high_resolution_clock::now();
+	const StreamQuery<> query(stream, bitstream);
+	auto finish = std::chrono::high_resolution_clock::now();
+	std::cout << "StreamQuery for " << num_points << " points: built in " << micro(finish - start).count()
+		  << " microseconds, " << query.overhead() << " bytes\n";
+	start = std::chrono::high_resolution_clock::now();
+	const std::vector<point> all = decodeStream(stream, bitstream);
+	finish = std::chrono::high_resolution_clock::now();
+	const double decode_time = micro(finish - start).count();
+
+	std::vector<point> centres(num_queries);
+	for (point& c : centres) c = {dist(rng), dist(rng), dist(rng)};
+	const coord side = 2048;
+	const double radius = 1024;
+	const size_t k = 16;
+	double box_time = 0, radius_time = 0, knn_time = 0, brute_time = 0;
+	for (const point& c : centres) {
+	    const point lo = c, hi{c[0] + side - 1, c[1] + side - 1, c[2] + side - 1};
+	    start = std::chrono::high_resolution_clock::now();
+	    std::vector<point> box = query.box(lo, hi);
+	    auto t1 = std::chrono::high_resolution_clock::now();
+	    std::vector<point> ball = query.radius(c, radius);
+	    auto t2 = std::chrono::high_resolution_clock::now();
+	    const std::vector<point> nearest = query.knn(c, k);
+	    auto t3 = std::chrono::high_resolution_clock::now();
+	    box_time += micro(t1 - start).count();
+	    radius_time += micro(t2 - t1).count();
+	    knn_time += micro(t3 - t2).count();
+
+	    // Brute force over the decoded cloud, one scan per query kind.
+	    start = std::chrono::high_resolution_clock::now();
+	    std::vector<point> expected_box, expected_ball;
+	    std::vector<uint64_t> distances;
+	    distances.reserve(all.size());
+	    for (const point& p : all) {
+		if (lo[0] <= p[0] && p[0] <= hi[0] && lo[1] <= p[1] && p[1] <= hi[1] && lo[2] <= p[2] && p[2] <= hi[2])
+		    expected_box.push_back(p);
+		const uint64_t d2 = distance2(p, c);
+		if (d2 <= radius * radius) expected_ball.push_back(p);
+		distances.push_back(d2);
+	    }
+	    std::nth_element(distances.begin(), distances.begin() + k - 1, distances.end());
+	    finish = std::chrono::high_resolution_clock::now();
+	    brute_time += micro(finish - start).count();
+
+	    std::sort(box.begin(), box.end());
+	    std::sort(expected_box.begin(), expected_box.end());
+	    std::sort(ball.begin(), ball.end());
+	    std::sort(expected_ball.begin(), expected_ball.end());
+	    assert(box == expected_box && ball == expected_ball);
+	    assert(nearest.size() == k && distance2(nearest.back(), c) == distances[k - 1]);
+	}
+	std::cout << "  per query: box " << box_time / num_queries << ", radius " << radius_time / num_queries
+		  << ", " << k << "-NN " << knn_time / num_queries << " microseconds; full decode "
+		  << decode_time << " + brute force scan " << brute_time / num_queries << " microseconds\n";
+    }
+}
+
+void benchmark_radixencoder(const std::vector<point> template_points) {
+    using milli = std::chrono::duration<double, std::milli>;
+    const size_t num_frames = 30, frame_points = 10e5;
+    assert(num_frames * frame_points <= template_points.size());
+    std::vector<std::vector<point>> frames;
+    for (size_t f = 0; f < num_frames; ++f)
+	frames.emplace_back(template_points.begin() + f * frame_points, template_points.begin() + (f + 1) * frame_points);
+
+    size_t allocations = num_allocations;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (const auto& frame : frames) {
+	const auto& [stream, bitstream] = radixSortStream(frame);
+	assert(!stream.empty());
+    }
+    auto finish = std::chrono::high_resolution_clock::now();
+    std::cout << "radixSortStream() on " << num_frames << " frames of " << frame_points << " points: "
+	      << milli(finish - start).count() / num_frames << " ms/frame, "
+	      << (double)(num_allocations - allocations) / num_frames << " allocations/frame\n";
+
+    // Warm the context up on the first frame, then measure the steady state.
+    RadixEncoder<> encoder;
+    bytestream stream_out, bits_out;
+    encoder.encode(frames[0], BufferSink{stream_out}, BufferSink{bits_out});
+    allocations = num_allocations;
+    start = std::chrono::high_resolution_clock::now();
+    for (const auto& frame : frames) {
+	stream_out.clear();
+	bits_out.clear();
+	encoder.encode(frame, BufferSink{stream_out}, BufferSink{bits_out});
+    }
+    finish = std::chrono::high_resolution_clock::now();
+    std::cout << "RadixEncoder::encode() on " << num_frames << " frames of " << frame_points << " points: "
+	      << milli(finish - start).count() / num_frames << " ms/frame, "
+	      << (double)(num_allocations - allocations) / num_frames << " allocations/frame\n";
+    const auto& [stream, bitstream] = radixSortStream(frames.back());
+    assert(stream_out == stream && bits_out == bitstream);
+}
+
+void benchmark_voxelsortstream(const std::vector<point> template_points) {
+    using milli = std::chrono::milliseconds;
+    const size_t num_points = 10e6;
+    assert(num_points <= template_points.size());
+    // Sensor-style input: metres in [0, 65.536) with a 1 mm voxel.
+    std::vector<float> xyz(3 * num_points);
+    for (size_t i = 0; i < num_points; ++i)
+	for (int a = 0; a < 3; ++a)
+	    xyz[3 * i + a] = (template_points[i][a] + 0.5f) / 1000;
+    const VoxelGrid<float> grid{{0, 0, 0}, {65.5355f, 65.5355f, 65.5355f}, 0.001f};
+    const float inv = 1 / grid.voxel_size;
+    util::thread_pool pool;
+
+    const auto& start = std::chrono::high_resolution_clock::now();
+    std::vector<point> points(num_points);
+    for (size_t i = 0; i < num_points; ++i)
+	for (int a = 0; a < 3; ++a)
+	    points[i][a] = xyz[3 * i + a] * inv;
+    const auto& [stream, bitstream] = radixSortStream(points);
+    const auto& middle = std::chrono::high_resolution_clock::now();
+    const auto& [serial_stream, serial_bitstream] = voxelSortStream(xyz.data(), num_points, grid);
+    const auto& serial = std::chrono::high_resolution_clock::now();
+    const auto& [voxel_stream, voxel_bitstream] = voxelSortStream(xyz.data(), num_points, grid, &pool);
+    const auto& finish = std::chrono::high_resolution_clock::now();
+    std::cout << "voxelSortStream() with " << num_points << " float points took "
+	      << std::chrono::duration_cast<milli>(serial - middle).count() << " milliseconds ("
+	      << std::chrono::duration_cast<milli>(finish - serial).count() << " with " << pool.size()
+	      << " threads); quantize + radixSortStream() took "
+	      << std::chrono::duration_cast<milli>(middle - start).count() << " milliseconds\n";
+    assert(serial_stream == stream && serial_bitstream == bitstream);
+    assert(voxel_stream == stream && voxel_bitstream == bitstream);
+}
+
+// Checks that the decoded attributes, in leaf order, are the rounded averages of the attributes of
+// the input points in each leaf's voxel.
+void check_attributes(const std::vector<point> &points, const std::vector<attribute> &attributes,
+		      const bytestream &stream, const bitstream &bitstream, const bytestream &attribute_stream) {
+    std::unordered_map<uint64_t, std::pair<std::array<uint64_t, ATTRIBUTE_CHANNELS>, uint64_t>> voxels;
+    for (size_t i = 0; i < points.size(); ++i) {
+	auto& [sums, count] = voxels[interleave(points[i])];
+	for (int c = 0; c < ATTRIBUTE_CHANNELS; ++c) sums[c] += attributes[i][c];
+	++count;
+    }
+    const std::vector<point> decoded = decodeStream(stream, bitstream);
+    const std::vector<attribute> decoded_attributes = decodeAttributes(attribute_stream, decoded.size());
+    assert(decoded.size() == voxels.size() && decoded_attributes.size() == decoded.size());
+    for (size_t i = 0; i < decoded.size(); ++i) {
+	const auto& [sums, count] = voxels.at(interleave(decoded[i]));
+	for (int c = 0; c < ATTRIBUTE_CHANNELS; ++c)
+	    assert(decoded_attributes[i][c] == (sums[c] + count / 2) / count);
+    }
+}
+
+void benchmark_attributes(const std::vector<point> template_points) {
+    using milli = std::chrono::milliseconds;
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<int> noise(-2, 2);
+    for (size_t num_points : {10e4, 10e5, 10e6}) {
+	assert(num_points <= template_points.size());
+	// A dense clustered patch with a colour gradient and a smooth intensity, plus sensor noise.
+	std::vector<point> points(num_points);
+	std::vector<attribute> attributes(num_points);
+	for (size_t i = 0; i < num_points; ++i) {
+	    const point& p = template_points[i];
+	    points[i] = {p[0] >> 6, p[1] >> 6, p[2] >> 6};
+	    attributes[i] = {(uint16_t)(points[i][0] / 4 + noise(rng) + 2), (uint16_t)(points[i][1] / 4 + noise(rng) + 2),
+			     (uint16_t)((points[i][0] + points[i][2]) / 8 + noise(rng) + 2),
+			     (uint16_t)(1000 + 10 * points[i][2] + noise(rng))};
+	}
+	const auto& start = std::chrono::high_resolution_clock::now();
+	const auto& [stream, bitstream, attribute_stream] = radixSortStreamWithAttributes(points, attributes);
+	const auto& middle = std::chrono::high_resolution_clock::now();
+	const auto& [plain_stream, plain_bitstream] = radixSortStream(points);
+	const auto& finish = std::chrono::high_resolution_clock::now();
+	bytestream input_order;
+	{
+	    AttributeEncoder encoder(input_order);
+	    for (const attribute& a : attributes) encoder.encode(a);
+	    encoder.flush();
+	}
+	const std::vector<point> decoded = decodeStream(stream, bitstream);
+	std::cout << "radixSortStreamWithAttributes() with " << num_points << " points took "
+		  << std::chrono::duration_cast<milli>(middle - start).count() << " milliseconds (geometry only "
+		  << std::chrono::duration_cast<milli>(finish - middle).count() << "); attributes "
+		  << (double)attribute_stream.size() / decoded.size() << " bytes/leaf in leaf order vs "
+		  << (double)input_order.size() / num_points << " bytes/point in input order\n";
+	assert(stream == plain_stream && bitstream == plain_bitstream);
+	check_attributes(points, attributes, stream, bitstream, attribute_stream);
+	// Coarser voxels, so that most leaves merge many points.
+	std::vector<point> coarse(points);
+	for (point& p : coarse)
+	    for (coord& c : p) c >>= 6;
+	const auto& [coarse_stream, coarse_bitstream, coarse_attribute_stream] = radixSortStreamWithAttributes(coarse, attributes);
+	check_attributes(coarse, attributes, coarse_stream, coarse_bitstream, coarse_attribute_stream);
+    }
+}
+
+// A sequence of frames in which a small fraction of the points moves by one voxel or is replaced
+// between consecutive frames, as when a sensor rescans a mostly static scene.
+std::vector<std::vector<point>> make_sequence(const std::vector<point> &template_points, const size_t num_frames,
+                                              const size_t frame_points, const double churn) {
+    std::mt19937 rng(1);
+    std::uniform_int_distribution<size_t> pick(0, frame_points - 1);
+    std::uniform_int_distribution<int> step(-1, 1);
+    std::vector<std::vector<point>> frames{{template_points.begin(), template_points.begin() + frame_points}};
+    size_t next = frame_points;
+    for (size_t f = 1; f < num_frames; ++f) {
+	frames.push_back(frames.back());
+	for (size_t i = 0; i < churn * frame_points; ++i) {
+	    point& p = frames.back()[pick(rng)];
+	    if (i % 2 && next < template_points.size()) p = template_points[next++];
+	    else for (coord& c : p) c = (c + step(rng)) & 0xFFFF;
+	}
+    }
+    return frames;
+}
+
+void benchmark_sequence(const std::vector<point> template_points) {
+    using seconds = std::chrono::duration<double>;
+    const size_t num_frames = 20, frame_points = 10e5;
+    for (const double churn : {0.01, 0.05, 0.2}) {
+	const auto frames = make_sequence(template_points, num_frames, frame_points, churn);
+	size_t intra_bytes = 0, inter_bytes = 0;
+	auto start = std::chrono::high_resolution_clock::now();
+	for (const auto& frame : frames) {
+	    const auto& [stream, bitstream] = radixSortStream(frame);
+	    intra_bytes += compressOccupancy(stream).size() + bitstream.size();
+	}
+	auto finish = std::chrono::high_resolution_clock::now();
+	const double intra_fps = num_frames / seconds(finish - start).count();
+
+	SequenceEncoder<> encoder;
+	SequenceDecoder<> decoder;
+	std::vector<bytestream> encoded;
+	start = std::chrono::high_resolution_clock::now();
+	for (const auto& frame : frames) {
+	    encoded.push_back(encoder.encode(frame));
+	    inter_bytes += encoded.back().size();
+	}
+	auto middle = std::chrono::high_resolution_clock::now();
+	for (const auto& frame : encoded) decoder.decode(frame);
+	finish = std::chrono::high_resolution_clock::now();
+	std::cout << "SequenceEncoder on " << num_frames << " frames of " << frame_points << " points with "
+		  << 100 * churn << "% churn: " << inter_bytes / num_frames << " bytes/frame, "
+		  << num_frames / seconds(middle - start).count() << " fps encode, "
+		  << num_frames / seconds(finish - middle).count() << " fps decode; intra-only "
+		  << intra_bytes / num_frames << " bytes/frame, " << intra_fps << " fps\n";
+
+	std::vector<point> expected(frames.back()), actual(decoder.points());
+	std::sort(expected.begin(), expected.end());
+	expected.erase(std::unique(expected.begin(), expected.end()), expected.end());
+	std::sort(actual.begin(), actual.end());
+	assert(actual == expected);
+    }
+}
+
 int main() {
-    _morton<255>::add_values(mkeys);
     const size_t max_points = 10e7;
-    std::vector<point> template_points(max_points, {0, 0, 0});
-    for (size_t i = 128; i < template_points.size(); ++i)
-        template_points[i] = {rnd(), rnd(), rnd()};
+    std::vector<point> template_points(max_points);
+    for (point& p : template_points)
+        p = {rnd(), rnd(), rnd()};
 
+    benchmark_interleave(template_points);
+    benchmark_bitstream(template_points);
     benchmark_stdsortstream(template_points);
     benchmark_radixsortstream(template_points);
+    benchmark_parallelradixsortstream(template_points);
+    benchmark_decodestream(template_points);
+    benchmark_externalsortstream(template_points);
+    benchmark_compressoccupancy(template_points);
+    benchmark_keywidths();
+    benchmark_streamindex(template_points);
+    benchmark_streamquery(template_points);
+    benchmark_radixencoder(template_points);
+    benchmark_sequence(template_points);
+    benchmark_voxelsortstream(template_points);
+    benchmark_attributes(template_points);
 }
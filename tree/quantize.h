@@ -0,0 +1,181 @@
+#pragma once
+
+// Input stage for sensor clouds in floating point. One pass over packed xyz triples quantizes each
+// point to its voxel, interleaves it straight into a Morton key, drops points outside the bounding
+// box, and drops keys equal to the previous kept key (scan-ordered sensor data puts neighbours
+// next to each other). The keys go straight to radixSortKeys, so no `point` copy of the cloud is
+// ever made. Repeated voxels don't change the stream, so the partial deduplication doesn't either.
+
+#include <cmath>
+#include "tree.h"
+
+// Voxel v along an axis covers [lo + v * voxel_size, lo + (v + 1) * voxel_size); points outside
+// [lo, hi] on any axis, or NaN, are dropped.
+template <typename T>
+struct VoxelGrid {
+    static_assert(std::is_floating_point_v<T>, "VoxelGrid expects float or double coordinates");
+    T lo[3], hi[3];
+    T voxel_size;
+};
+
+template <int Bits, typename T>
+inline size_t _quantize_scalar(const T* xyz, const size_t n, const VoxelGrid<T> &grid, const T inv,
+                               typename morton<Bits>::key_type* keys, bool &has_last,
+                               typename morton<Bits>::key_type &last) {
+    size_t out = 0;
+    for (size_t i = 0; i < n; ++i) {
+        const T x = xyz[3 * i], y = xyz[3 * i + 1], z = xyz[3 * i + 2];
+        if (!(grid.lo[0] <= x && x <= grid.hi[0] && grid.lo[1] <= y && y <= grid.hi[1] &&
+              grid.lo[2] <= z && z <= grid.hi[2]))
+            continue;
+        const auto key = morton<Bits>::encode((uint32_t)((x - grid.lo[0]) * inv), (uint32_t)((y - grid.lo[1]) * inv),
+                                              (uint32_t)((z - grid.lo[2]) * inv));
+        if (has_last && key == last) continue;
+        keys[out++] = last = key;
+        has_last = true;
+    }
+    return out;
+}
+
+// Compacts the keys of one vector of points into keys[out...], skipping lanes outside the box.
+template <typename Key, int Lanes>
+inline size_t _compact_lanes(const uint64_t (&lane_keys)[Lanes], int valid, Key* keys, size_t out,
+                             bool &has_last, Key &last) {
+    for (; valid; valid &= valid - 1) {
+        const Key key = lane_keys[__builtin_ctz(valid)];
+        if (has_last && key == last) continue;
+        keys[out++] = last = key;
+        has_last = true;
+    }
+    return out;
+}
+
+// Eight float points per iteration: x, y and z are gathered, scaled and truncated in 32-bit lanes,
+// then widened to two halves of four 64-bit lanes for the spread.
+__attribute__((target("avx2,fma")))
+inline size_t _quantize_avx2(const float* xyz, const size_t n, const VoxelGrid<float> &grid, const float inv,
+                             uint64_t* keys, bool &has_last, uint64_t &last) {
+    const __m256i idx = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+    __m256 lo[3], hi[3];
+    for (int a = 0; a < 3; ++a) {
+        lo[a] = _mm256_set1_ps(grid.lo[a]);
+        hi[a] = _mm256_set1_ps(grid.hi[a]);
+    }
+    const __m256 scale = _mm256_set1_ps(inv), all = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+    size_t i = 0, out = 0;
+    alignas(32) uint64_t lane_keys[8];
+    for (; i + 8 <= n; i += 8) {
+        __m256i q[3];
+        __m256 inside = all;
+        for (int a = 0; a < 3; ++a) {
+            const __m256 v = _mm256_mask_i32gather_ps(_mm256_setzero_ps(), xyz + 3 * i + a, idx, all, 4);
+            inside = _mm256_and_ps(inside, _mm256_and_ps(_mm256_cmp_ps(lo[a], v, _CMP_LE_OQ),
+                                                         _mm256_cmp_ps(v, hi[a], _CMP_LE_OQ)));
+            q[a] = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_sub_ps(v, lo[a]), scale));
+        }
+        for (int h = 0; h < 2; ++h) {
+            __m256i wide[3];
+            for (int a = 0; a < 3; ++a)
+                wide[a] = _mm256_cvtepu32_epi64(h ? _mm256_extracti128_si256(q[a], 1) : _mm256_castsi256_si128(q[a]));
+            const __m256i key = _mm256_or_si256(_spread_avx2(wide[0]),
+                                _mm256_or_si256(_mm256_slli_epi64(_spread_avx2(wide[1]), 1),
+                                                _mm256_slli_epi64(_spread_avx2(wide[2]), 2)));
+            _mm256_store_si256((__m256i *)(lane_keys + 4 * h), key);
+        }
+        out = _compact_lanes(lane_keys, _mm256_movemask_ps(inside), keys, out, has_last, last);
+    }
+    return out + _quantize_scalar<16>(xyz + 3 * i, n - i, grid, inv, keys + out, has_last, last);
+}
+
+// Four double points per iteration.
+__attribute__((target("avx2,fma")))
+inline size_t _quantize_avx2(const double* xyz, const size_t n, const VoxelGrid<double> &grid, const double inv,
+                             uint64_t* keys, bool &has_last, uint64_t &last) {
+    const __m128i idx = _mm_setr_epi32(0, 3, 6, 9);
+    __m256d lo[3], hi[3];
+    for (int a = 0; a < 3; ++a) {
+        lo[a] = _mm256_set1_pd(grid.lo[a]);
+        hi[a] = _mm256_set1_pd(grid.hi[a]);
+    }
+    const __m256d scale = _mm256_set1_pd(inv), all = _mm256_castsi256_pd(_mm256_set1_epi32(-1));
+    size_t i = 0, out = 0;
+    alignas(32) uint64_t lane_keys[4];
+    for (; i + 4 <= n; i += 4) {
+        __m256i q[3];
+        __m256d inside = all;
+        for (int a = 0; a < 3; ++a) {
+            const __m256d v = _mm256_mask_i32gather_pd(_mm256_setzero_pd(), xyz + 3 * i + a, idx, all, 8);
+            inside = _mm256_and_pd(inside, _mm256_and_pd(_mm256_cmp_pd(lo[a], v, _CMP_LE_OQ),
+                                                         _mm256_cmp_pd(v, hi[a], _CMP_LE_OQ)));
+            q[a] = _mm256_cvtepu32_epi64(_mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_sub_pd(v, lo[a]), scale)));
+        }
+        const __m256i key = _mm256_or_si256(_spread_avx2(q[0]),
+                            _mm256_or_si256(_mm256_slli_epi64(_spread_avx2(q[1]), 1),
+                                            _mm256_slli_epi64(_spread_avx2(q[2]), 2)));
+        _mm256_store_si256((__m256i *)lane_keys, key);
+        out = _compact_lanes(lane_keys, _mm256_movemask_pd(inside), keys, out, has_last, last);
+    }
+    return out + _quantize_scalar<16>(xyz + 3 * i, n - i, grid, inv, keys + out, has_last, last);
+}
+
+// Quantizes xyz[0, 3n) into keys, which must have room for n keys, and returns how many were kept.
+// With a pool, chunks are quantized in parallel and then closed up. Returns 0 (and prints why) if
+// the box needs more than 2^Bits voxels along some axis.
+template <int Bits = 16, typename T>
+size_t quantizePoints(const T* xyz, const size_t n, const VoxelGrid<T> &grid,
+                      typename morton<Bits>::key_type* keys, util::thread_pool* pool = nullptr) {
+    using key_type = typename morton<Bits>::key_type;
+    const T inv = 1 / grid.voxel_size;
+    for (int a = 0; a < 3; ++a) {
+        if (!(grid.lo[a] <= grid.hi[a]) || !((grid.hi[a] - grid.lo[a]) * inv < (T)(1u << Bits))) {
+            std::cout << "bounding box doesn't fit a " << Bits << "-bit grid" << '\n';
+            return 0;
+        }
+    }
+    static const bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    const auto quantize = [&](const size_t begin, const size_t end, bool &has_last, key_type &last) {
+        if constexpr (Bits == 16) {
+            if (avx2) return _quantize_avx2(xyz + 3 * begin, end - begin, grid, inv, keys + begin, has_last, last);
+        }
+        return _quantize_scalar<Bits>(xyz + 3 * begin, end - begin, grid, inv, keys + begin, has_last, last);
+    };
+
+    const size_t num_chunks = pool && n >= (1 << 16) ? 4 * pool->size() : 1;
+    const size_t chunk = (n + num_chunks - 1) / num_chunks;
+    std::vector<size_t> kept(num_chunks);
+    std::vector<key_type> firsts(num_chunks);
+    const auto run = [&](const size_t lo, const size_t hi) {
+        for (size_t c = lo; c < hi; ++c) {
+            bool has_last = false;
+            key_type last = 0;
+            const size_t begin = std::min(c * chunk, n);
+            kept[c] = quantize(begin, std::min(begin + chunk, n), has_last, last);
+            if (kept[c]) firsts[c] = keys[begin];
+        }
+    };
+    if (num_chunks == 1) run(0, 1);
+    else pool->parallel_for(0, num_chunks, 1, run);
+
+    // Close the gaps between chunks, dropping a chunk's first key if it repeats the previous one.
+    size_t out = kept[0];
+    for (size_t c = 1; c < num_chunks; ++c) {
+        if (!kept[c]) continue;
+        const size_t skip = out && firsts[c] == keys[out - 1];
+        std::memmove(keys + out, keys + c * chunk + skip, (kept[c] - skip) * sizeof(key_type));
+        out += kept[c] - skip;
+    }
+    return out;
+}
+
+// Encodes a floating-point cloud of n packed xyz triples on `grid`, producing the streams that
+// radixSortStream would for the quantized points.
+template <int Bits = 16, typename T>
+std::pair<bytestream, bitstream> voxelSortStream(const T* xyz, const size_t n, const VoxelGrid<T> &grid,
+                                                 util::thread_pool* pool = nullptr) noexcept {
+    using key_type = typename morton<Bits>::key_type;
+    std::unique_ptr<key_type[]> data[2] = {std::unique_ptr<key_type[]>(new key_type[n]), nullptr};
+    const size_t num_keys = quantizePoints<Bits>(xyz, n, grid, data[0].get(), pool);
+    data[1].reset(new key_type[num_keys]);
+    key_type* const arrays[2] = {data[0].get(), data[1].get()};
+    return radixSortKeys<Bits>(arrays, num_keys);
+}
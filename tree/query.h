@@ -0,0 +1,172 @@
+#pragma once
+
+// Spatial queries answered straight from a (bytestream, bitstream) pair, without decoding the
+// cloud. The engine keeps only a StreamIndex: an internal node's first child sits at the start of
+// the next level plus the children of the nodes before it, and a leaf's residuals sit at its
+// level's bit offset plus its rank among that level's leaves; both counts come from the index's
+// block checkpoints and a popcount over at most one block. Queries then descend from the root into
+// occupied octants only, pruning every cell that can't contain an answer, and decode just the
+// leaves they reach.
+
+#include "stream_index.h"
+
+template <int Bits = 16>
+class StreamQuery {
+    using key_type = typename morton<Bits>::key_type;
+    struct node {
+        size_t pos;
+        int level;
+        key_type prefix;
+    };
+
+    const bytestream& m_stream;
+    const bitstream& m_bits;
+    StreamIndex m_index;
+
+    int depth(const int level) const { return m_index.depth(level); }
+
+    // The minimum corner and side length of a node's cell.
+    void cell(const node &n, uint32_t corner[3], uint32_t &side) const {
+        morton<Bits>::decode(n.prefix, corner[0], corner[1], corner[2]);
+        side = 1u << leaf_bits(depth(n.level));
+    }
+
+    point leaf_point(bitstream_reader &reader, const node &n) const {
+        const int bits = leaf_bits(depth(n.level));
+        uint64_t children, leaves;
+        m_index.count_before(m_stream, n.level, n.pos - m_index.level_offsets[n.level], children, leaves);
+        reader.seek(m_index.level_bits[n.level] + leaves * 3 * bits);
+        const uint32_t rx = reader.read(bits), ry = reader.read(bits), rz = reader.read(bits);
+        point p;
+        morton<Bits>::decode(n.prefix | morton<Bits>::encode(rx, ry, rz), p[0], p[1], p[2]);
+        return p;
+    }
+
+    // Calls visit(child) for every child of the internal node n.
+    template <typename VisitFn>
+    void children(const node &n, VisitFn &&visit) const {
+        const byte mask = m_stream[n.pos];
+        uint64_t children, leaves;
+        m_index.count_before(m_stream, n.level, n.pos - m_index.level_offsets[n.level], children, leaves);
+        size_t child = m_index.level_offsets[n.level + 1] + children;
+        for (unsigned int m = mask; m; m &= m - 1, ++child)
+            visit(node{child, n.level + 1, n.prefix | (key_type)__builtin_ctz(m) << depth(n.level)});
+    }
+
+    // Depth-first search over the cells accepted by keep_cell(corner, side), collecting the points
+    // accepted by keep_point.
+    template <typename CellFn, typename PointFn>
+    std::vector<point> search(CellFn &&keep_cell, PointFn &&keep_point) const {
+        std::vector<point> points;
+        if (m_stream.empty()) return points;
+        bitstream_reader reader(m_bits);
+        std::vector<node> stack{{0, 0, 0}};
+        while (!stack.empty()) {
+            const node n = stack.back();
+            stack.pop_back();
+            uint32_t corner[3], side;
+            cell(n, corner, side);
+            if (!keep_cell(corner, side)) continue;
+            if (!m_stream[n.pos]) {
+                const point p = leaf_point(reader, n);
+                if (keep_point(p)) points.push_back(p);
+                continue;
+            }
+            children(n, [&](const node &child) { stack.push_back(child); });
+        }
+        return points;
+    }
+
+    static uint64_t distance2(const point &a, const point &b) {
+        uint64_t d2 = 0;
+        for (int i = 0; i < 3; ++i) {
+            const int64_t d = (int64_t)a[i] - b[i];
+            d2 += d * d;
+        }
+        return d2;
+    }
+
+    // Squared distance from `p` to the nearest point of the cell.
+    static uint64_t cell_distance2(const point &p, const uint32_t corner[3], const uint32_t side) {
+        uint64_t d2 = 0;
+        for (int i = 0; i < 3; ++i) {
+            const uint64_t lo = corner[i], hi = (uint64_t)corner[i] + side - 1;
+            const uint64_t d = p[i] < lo ? lo - p[i] : p[i] > hi ? p[i] - hi : 0;
+            d2 += d * d;
+        }
+        return d2;
+    }
+
+public:
+    // The streams must outlive the engine.
+    StreamQuery(const bytestream &stream, const bitstream &bit_stream)
+        : m_stream(stream), m_bits(bit_stream), m_index(buildStreamIndex<Bits>(stream)) {}
+
+    // Points inside [lo, hi], inclusive on every axis.
+    std::vector<point> box(const point &lo, const point &hi) const {
+        return search(
+            [&](const uint32_t corner[3], const uint32_t side) {
+                for (int i = 0; i < 3; ++i)
+                    if ((uint64_t)corner[i] + side - 1 < lo[i] || corner[i] > hi[i]) return false;
+                return true;
+            },
+            [&](const point &p) {
+                return lo[0] <= p[0] && p[0] <= hi[0] && lo[1] <= p[1] && p[1] <= hi[1] && lo[2] <= p[2] && p[2] <= hi[2];
+            });
+    }
+
+    // Points within `radius` of `centre`, inclusive.
+    std::vector<point> radius(const point &centre, const double radius) const {
+        const uint64_t r2 = (uint64_t)(radius * radius);
+        return search([&](const uint32_t corner[3], const uint32_t side) { return cell_distance2(centre, corner, side) <= r2; },
+                      [&](const point &p) { return distance2(p, centre) <= r2; });
+    }
+
+    // The k points nearest to `centre`, nearest first. Cells are expanded best-first, so the search
+    // stops as soon as the nearest unexpanded cell is farther away than the k-th point found.
+    std::vector<point> knn(const point &centre, const size_t k) const {
+        std::vector<point> points;
+        if (m_stream.empty() || k == 0) return points;
+        bitstream_reader reader(m_bits);
+        using entry = std::pair<uint64_t, node>;
+        const auto farther = [](const entry &a, const entry &b) { return a.first > b.first; };
+        const auto nearer = [](const std::pair<uint64_t, point> &a, const std::pair<uint64_t, point> &b) {
+            return a.first < b.first;
+        };
+        std::priority_queue<entry, std::vector<entry>, decltype(farther)> cells(farther);
+        std::priority_queue<std::pair<uint64_t, point>, std::vector<std::pair<uint64_t, point>>, decltype(nearer)> best(nearer);
+        cells.push({0, node{0, 0, 0}});
+        while (!cells.empty()) {
+            const auto [d2, n] = cells.top();
+            cells.pop();
+            if (best.size() == k && d2 > best.top().first) break;
+            if (!m_stream[n.pos]) {
+                const point p = leaf_point(reader, n);
+                const uint64_t pd2 = distance2(p, centre);
+                if (best.size() < k) best.push({pd2, p});
+                else if (pd2 < best.top().first) {
+                    best.pop();
+                    best.push({pd2, p});
+                }
+                continue;
+            }
+            children(n, [&](const node &child) {
+                uint32_t corner[3], side;
+                cell(child, corner, side);
+                const uint64_t cd2 = cell_distance2(centre, corner, side);
+                if (best.size() < k || cd2 <= best.top().first) cells.push({cd2, child});
+            });
+        }
+        points.resize(best.size());
+        for (size_t i = points.size(); i-- > 0; best.pop()) points[i] = best.top().second;
+        return points;
+    }
+
+    // Bytes of the in-memory index, on top of the streams.
+    size_t overhead() const {
+        size_t bytes = (m_index.level_offsets.size() + m_index.level_bits.size()) * sizeof(uint64_t);
+        for (size_t l = 0; l < m_index.num_levels(); ++l)
+            bytes += (m_index.children_before[l].size() + m_index.leaves_before[l].size()) * sizeof(uint64_t);
+        return bytes;
+    }
+};
@@ -0,0 +1,261 @@
+#pragma once
+
+// An optional sidecar index for random access into a (bytestream, bitstream) pair. Every BFS level
+// is a contiguous run of the bytestream, and every level's leaf residuals are a contiguous run of
+// the bitstream, so the index records where each level starts in both. Within a level, a node's
+// children sit at (start of next level + number of children of the nodes before it), so the index
+// also checkpoints, every BLOCK nodes, the running child and leaf counts; anything between two
+// checkpoints is recovered with a short popcount scan.
+
+#include "tree.h"
+
+struct StreamIndex {
+    static constexpr size_t BLOCK = 256;
+    int top_depth = 45;
+    std::vector<uint64_t> level_offsets;                 // Byte offset of each level, plus the end
+    std::vector<uint64_t> level_bits;                    // Bit offset of each level's first residual
+    std::vector<std::vector<uint64_t>> children_before;  // Per level, per block: children of earlier nodes
+    std::vector<std::vector<uint64_t>> leaves_before;    // Per level, per block: earlier leaves
+
+    size_t num_levels() const { return level_bits.size(); }
+    size_t level_size(const size_t level) const { return level_offsets[level + 1] - level_offsets[level]; }
+    int depth(const size_t level) const { return top_depth - 3 * (int)level; }
+
+    // Children and leaves among the first `i` nodes of a level: the checkpoint of i's block plus a
+    // popcount over the rest of the block, eight bytes at a time.
+    void count_before(const bytestream &stream, size_t level, size_t i, uint64_t &children, uint64_t &leaves) const;
+
+    // Whether this can be an index of `stream` for a grid of Bits bits per axis: the depths match,
+    // the levels tile the stream exactly and every level has its checkpoints. An index that came
+    // from deserialize() should pass this before it is used; the decoders below check it.
+    template <int Bits = 16>
+    bool matches(const bytestream &stream) const;
+
+    bytestream serialize() const;
+    static StreamIndex deserialize(const bytestream &data);
+};
+
+template <int Bits>
+bool StreamIndex::matches(const bytestream &stream) const {
+    if (top_depth != morton<Bits>::top_depth || level_offsets.size() != num_levels() + 1 ||
+        children_before.size() != num_levels() || leaves_before.size() != num_levels() ||
+        level_offsets.front() != 0 || level_offsets.back() != stream.size())
+        return false;
+    for (size_t l = 0; l < num_levels(); ++l) {
+        if (level_offsets[l + 1] < level_offsets[l]) return false;
+        const size_t blocks = (level_size(l) + BLOCK - 1) / BLOCK;
+        if (children_before[l].size() != blocks || leaves_before[l].size() != blocks) return false;
+    }
+    return true;
+}
+
+template <int Bits = 16>
+StreamIndex buildStreamIndex(const bytestream &stream) {
+    StreamIndex index;
+    index.top_depth = morton<Bits>::top_depth;
+    uint64_t offset = 0, bits = 0, level_size = stream.empty() ? 0 : 1;
+    for (int l = 0; level_size; ++l) {
+        index.level_offsets.push_back(offset);
+        index.level_bits.push_back(bits);
+        index.children_before.emplace_back();
+        index.leaves_before.emplace_back();
+        uint64_t children = 0, leaves = 0;
+        for (uint64_t i = 0; i < level_size && offset + i < stream.size(); ++i) {
+            if (i % StreamIndex::BLOCK == 0) {
+                index.children_before.back().push_back(children);
+                index.leaves_before.back().push_back(leaves);
+            }
+            const byte mask = stream[offset + i];
+            children += __builtin_popcount(mask);
+            leaves += mask == 0;
+        }
+        bits += leaves * 3 * leaf_bits(index.depth(l));
+        offset += level_size;
+        level_size = children;
+    }
+    index.level_offsets.push_back(offset);
+    return index;
+}
+
+void StreamIndex::count_before(const bytestream &stream, const size_t level, const size_t i, uint64_t &children,
+                               uint64_t &leaves) const {
+    constexpr uint64_t LOW = 0x7F7F7F7F7F7F7F7Full;
+    size_t pos = i / BLOCK * BLOCK;
+    children = children_before[level][i / BLOCK];
+    leaves = leaves_before[level][i / BLOCK];
+    const byte* bytes = stream.data() + level_offsets[level];
+    for (; pos + 8 <= i; pos += 8) {
+        uint64_t word;
+        std::memcpy(&word, bytes + pos, sizeof(word));
+        children += __builtin_popcountll(word);
+        // The top bit of each byte of ~(...) is set iff that byte is zero; adding LOW can't carry
+        // between bytes.
+        leaves += __builtin_popcountll(~(((word & LOW) + LOW) | word | LOW));
+    }
+    for (; pos < i; ++pos) {
+        children += __builtin_popcount(bytes[pos]);
+        leaves += bytes[pos] == 0;
+    }
+}
+
+bytestream StreamIndex::serialize() const {
+    bytestream out;
+    const auto put = [&](const uint64_t v, const int bytes) {
+        for (int i = 0; i < bytes; ++i) out.push_back(v >> (8 * i));
+    };
+    put(top_depth, 1);
+    put(num_levels(), 1);
+    for (size_t l = 0; l < num_levels(); ++l) {
+        put(level_offsets[l + 1] - level_offsets[l], 8);
+        put(level_bits[l], 8);
+    }
+    // The block tables are implied by the level sizes.
+    for (size_t l = 0; l < num_levels(); ++l)
+        for (size_t b = 0; b < children_before[l].size(); ++b) {
+            put(children_before[l][b], 8);
+            put(leaves_before[l][b], 8);
+        }
+    return out;
+}
+
+StreamIndex StreamIndex::deserialize(const bytestream &data) {
+    StreamIndex index;
+    size_t pos = 0;
+    bool truncated = false;
+    const auto get = [&](const int bytes) {
+        uint64_t v = 0;
+        truncated |= pos + bytes > data.size();
+        for (int i = 0; i < bytes && pos < data.size(); ++i) v |= (uint64_t)data[pos++] << (8 * i);
+        return v;
+    };
+    index.top_depth = get(1);
+    const size_t num_levels = get(1);
+    index.level_offsets.push_back(0);
+    for (size_t l = 0; l < num_levels; ++l) {
+        index.level_offsets.push_back(index.level_offsets.back() + get(8));
+        index.level_bits.push_back(get(8));
+    }
+    index.children_before.resize(num_levels);
+    index.leaves_before.resize(num_levels);
+    for (size_t l = 0; l < num_levels; ++l)
+        for (size_t b = 0; b < (index.level_size(l) + BLOCK - 1) / BLOCK && !truncated; ++b) {
+            index.children_before[l].push_back(get(8));
+            index.leaves_before[l].push_back(get(8));
+        }
+    // A short or overlong input leaves an index with no levels, which matches() rejects.
+    if (truncated || pos != data.size()) return StreamIndex{};
+    return index;
+}
+
+// Running child/leaf counts up to some position of one level. Positions must only move forward;
+// the cursor jumps to a checkpoint when that skips a whole block.
+struct LevelCursor {
+    size_t pos = 0;
+    uint64_t children = 0, leaves = 0;
+
+    void advance(const bytestream &stream, const StreamIndex &index, const size_t level, const size_t target) {
+        if (target / StreamIndex::BLOCK > pos / StreamIndex::BLOCK) {
+            const size_t b = target / StreamIndex::BLOCK;
+            pos = b * StreamIndex::BLOCK;
+            children = index.children_before[level][b];
+            leaves = index.leaves_before[level][b];
+        }
+        const byte* bytes = stream.data() + index.level_offsets[level];
+        for (; pos < target; ++pos) {
+            children += __builtin_popcount(bytes[pos]);
+            leaves += bytes[pos] == 0;
+        }
+    }
+};
+
+// Decodes the top `max_level` levels only. Leaves above max_level are returned exactly; every node
+// on level max_level is returned as the minimum corner of its cell. Only the bytes of those levels
+// and the residuals of their leaves are touched.
+template <int Bits = 16>
+std::vector<point> decodeLevels(const bytestream &stream, const bitstream &bit_stream, const StreamIndex &index,
+                                size_t max_level) {
+    using key_type = typename morton<Bits>::key_type;
+    if (stream.empty()) return {};
+    if (!index.matches<Bits>(stream)) {
+        std::cout << "stream index doesn't match the stream" << '\n';
+        return {};
+    }
+    max_level = std::min(max_level, index.num_levels());
+    std::vector<key_type> level{0}, next, keys;
+    keys.reserve(index.level_offsets[max_level]);
+    bitstream_reader reader(bit_stream);
+    for (size_t l = 0; l < max_level; ++l) {
+        const int depth = index.depth(l);
+        const int bits = leaf_bits(depth);
+        const byte* bytes = stream.data() + index.level_offsets[l];
+        next.clear();
+        for (size_t i = 0; i < level.size(); ++i) {
+            const byte mask = bytes[i];
+            if (!mask) {
+                const uint32_t x = reader.read(bits), y = reader.read(bits), z = reader.read(bits);
+                keys.push_back(level[i] | morton<Bits>::encode(x, y, z));
+                continue;
+            }
+            for (unsigned int m = mask; m; m &= m - 1)
+                next.push_back(level[i] | (key_type)__builtin_ctz(m) << depth);
+        }
+        level.swap(next);
+    }
+    keys.insert(keys.end(), level.begin(), level.end());
+    std::vector<point> points(keys.size());
+    morton<Bits>::decode_keys(keys.data(), keys.size(), points.data());
+    return points;
+}
+
+// Decodes the points inside the box [lo, hi] (inclusive on every axis), descending only into the
+// octants that overlap it. Child positions and residual offsets come from the index.
+template <int Bits = 16>
+std::vector<point> decodeBox(const bytestream &stream, const bitstream &bit_stream, const StreamIndex &index,
+                             const point &lo, const point &hi) {
+    using key_type = typename morton<Bits>::key_type;
+    struct node { size_t idx; key_type prefix; };
+    std::vector<node> level{{0, 0}}, next;
+    std::vector<point> points;
+    if (stream.empty()) return points;
+    if (!index.matches<Bits>(stream)) {
+        std::cout << "stream index doesn't match the stream" << '\n';
+        return points;
+    }
+    bitstream_reader reader(bit_stream);
+    const auto inside = [&](const uint32_t x, const uint32_t y, const uint32_t z) {
+        return lo[0] <= x && x <= hi[0] && lo[1] <= y && y <= hi[1] && lo[2] <= z && z <= hi[2];
+    };
+    for (size_t l = 0; l < index.num_levels() && !level.empty(); ++l) {
+        const int depth = index.depth(l);
+        const int bits = leaf_bits(depth);
+        // Children are on level l + 1, so their cells have leaf_bits(depth - 3) free bits per axis;
+        // below depth 0 that is -1, and the children (duplicates) are single voxels.
+        const uint32_t child_extent = (1u << std::max(0, leaf_bits(depth - 3))) - 1;
+        const byte* bytes = stream.data() + index.level_offsets[l];
+        LevelCursor cursor;
+        next.clear();
+        for (const node& n : level) {
+            cursor.advance(stream, index, l, n.idx);
+            const byte mask = bytes[n.idx];
+            if (!mask) {
+                reader.seek(index.level_bits[l] + cursor.leaves * 3 * bits);
+                const uint32_t rx = reader.read(bits), ry = reader.read(bits), rz = reader.read(bits);
+                uint32_t x, y, z;
+                morton<Bits>::decode(n.prefix | morton<Bits>::encode(rx, ry, rz), x, y, z);
+                if (inside(x, y, z)) points.push_back({x, y, z});
+                continue;
+            }
+            size_t child = cursor.children;
+            for (unsigned int m = mask; m; m &= m - 1, ++child) {
+                const key_type prefix = n.prefix | (key_type)__builtin_ctz(m) << depth;
+                uint32_t x, y, z;
+                morton<Bits>::decode(prefix, x, y, z);
+                if (x <= hi[0] && lo[0] <= x + child_extent && y <= hi[1] && lo[1] <= y + child_extent &&
+                    z <= hi[2] && lo[2] <= z + child_extent)
+                    next.push_back({child, prefix});
+            }
+        }
+        level.swap(next);
+    }
+    return points;
+}
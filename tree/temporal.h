@@ -0,0 +1,199 @@
+#pragma once
+
+// Inter-frame coding of point-cloud sequences. Each frame is coded as the set of its occupied
+// voxels, relative to the previous frame's: both ends keep the previous frame's sorted keys, and
+// the tree of the new frame is walked depth-first alongside the old one. A node the old tree also
+// has first sends one flag saying whether its whole subtree is unchanged; if it is, nothing below
+// it is sent. Otherwise its occupancy mask is sent as the XOR against the old node's mask, which
+// is mostly zero bits when the frames are similar. Nodes the old tree lacks send their mask as is.
+// Everything goes through the adaptive range coder of entropy.h, whose probabilities also carry
+// over from frame to frame. Call reset() on both ends to start over from an intra frame.
+//
+// Unlike radixSortStream, there are no early leaves or residual bits: every node is split down to
+// single voxels, and repeated points within a frame are coded once.
+
+#include "entropy.h"
+
+template <int Bits = 16>
+struct SequenceModel {
+    using key_type = typename morton<Bits>::key_type;
+    static constexpr int NUM_LEVELS = Bits;
+
+    uint16_t empty = PROB_INIT;
+    uint16_t same[NUM_LEVELS];
+    uint16_t delta[NUM_LEVELS * 8 * 2 * 4];
+    OccupancyModel intra;
+
+    SequenceModel() {
+        std::fill(std::begin(same), std::end(same), PROB_INIT);
+        std::fill(std::begin(delta), std::end(delta), PROB_INIT);
+    }
+
+    // Delta bit i of a node on `level`, given bit i of the old mask and the delta bits so far.
+    uint16_t& delta_prob(const int level, const int i, const int old_bit, const byte partial) {
+        return delta[(((level * 8 + i) << 1 | old_bit) << 2) + std::min(__builtin_popcount(partial), 3)];
+    }
+
+    static int level(const int depth) { return (morton<Bits>::top_depth - depth) / 3; }
+
+    // Splits the sorted keys [begin, end) of one node at `depth` into its eight octants.
+    static byte split(const key_type* keys, const size_t begin, const size_t end, const int depth, size_t bounds[9]) {
+        byte mask = 0;
+        bounds[0] = begin;
+        for (int o = 0; o < 8; ++o) {
+            bounds[o + 1] = std::partition_point(keys + bounds[o], keys + end,
+                [&](const key_type key) { return (int)((key >> depth) & 7) <= o; }) - keys;
+            mask |= (bounds[o + 1] != bounds[o]) << o;
+        }
+        return mask;
+    }
+};
+
+template <int Bits = 16>
+class SequenceEncoder {
+    using key_type = typename morton<Bits>::key_type;
+    using model_type = SequenceModel<Bits>;
+    std::unique_ptr<model_type> m_model = std::make_unique<model_type>();
+    std::vector<key_type> m_prev, m_cur;
+    bytestream m_out;
+
+    void encode_mask(RangeEncoder &encoder, const int level, const uint16_t ctx, const byte mask,
+                     const bool has_prev, const byte prev_mask) {
+        byte partial = 0;
+        for (int i = 0; i < 8; ++i) {
+            // The new mask is never zero, so its last bit is implied when the first seven are zero.
+            if (i == 7 && ((has_prev ? prev_mask ^ partial : partial) & 0x7F) == 0) break;
+            if (has_prev) {
+                const int bit = ((mask ^ prev_mask) >> i) & 1;
+                encoder.encode(m_model->delta_prob(level, i, (prev_mask >> i) & 1, partial), bit);
+                partial |= bit << i;
+            } else {
+                const int bit = (mask >> i) & 1;
+                encoder.encode(m_model->intra.bit_prob(ctx, i, partial), bit);
+                partial |= bit << i;
+            }
+        }
+    }
+
+    void encode_node(RangeEncoder &encoder, const int depth, const size_t cur_begin, const size_t cur_end,
+                     const size_t prev_begin, const size_t prev_end, const bool has_prev, const uint16_t ctx) {
+        const int level = model_type::level(depth);
+        if (has_prev) {
+            const bool same = cur_end - cur_begin == prev_end - prev_begin &&
+                std::equal(m_cur.data() + cur_begin, m_cur.data() + cur_end, m_prev.data() + prev_begin);
+            encoder.encode(m_model->same[level], same);
+            if (same) return;
+        }
+        size_t cur[9], prev[9];
+        const byte mask = model_type::split(m_cur.data(), cur_begin, cur_end, depth, cur);
+        const byte prev_mask = has_prev ? model_type::split(m_prev.data(), prev_begin, prev_end, depth, prev) : 0;
+        encode_mask(encoder, level, ctx, mask, has_prev, prev_mask);
+        if (depth == 0) return;
+        for (unsigned int m = mask; m; m &= m - 1) {
+            const int o = __builtin_ctz(m);
+            const bool child_prev = (prev_mask >> o) & 1;
+            encode_node(encoder, depth - 3, cur[o], cur[o + 1], child_prev ? prev[o] : 0, child_prev ? prev[o + 1] : 0,
+                        child_prev, mask << 3 | o);
+        }
+    }
+
+public:
+    // Encodes the next frame and returns its bytes; they stay valid until the next call.
+    const bytestream& encode(const std::vector<point> &points) {
+        m_cur.resize(points.size());
+        morton<Bits>::encode_points(points.data(), points.size(), m_cur.data());
+        std::sort(m_cur.begin(), m_cur.end());
+        m_cur.erase(std::unique(m_cur.begin(), m_cur.end()), m_cur.end());
+
+        m_out.clear();
+        RangeEncoder encoder(m_out);
+        encoder.encode(m_model->empty, m_cur.empty());
+        if (!m_cur.empty())
+            encode_node(encoder, morton<Bits>::top_depth, 0, m_cur.size(), 0, m_prev.size(), !m_prev.empty(), 0);
+        encoder.flush();
+        m_prev.swap(m_cur);
+        return m_out;
+    }
+
+    // Forgets the previous frame and the adapted probabilities; the next frame is coded on its own.
+    void reset() {
+        m_prev.clear();
+        *m_model = model_type();
+    }
+};
+
+template <int Bits = 16>
+class SequenceDecoder {
+    using key_type = typename morton<Bits>::key_type;
+    using model_type = SequenceModel<Bits>;
+    std::unique_ptr<model_type> m_model = std::make_unique<model_type>();
+    std::vector<key_type> m_prev, m_cur;
+    std::vector<point> m_points;
+
+    byte decode_mask(RangeDecoder &decoder, const int level, const uint16_t ctx, const bool has_prev,
+                     const byte prev_mask) {
+        byte partial = 0;
+        for (int i = 0; i < 8; ++i) {
+            if (i == 7 && ((has_prev ? prev_mask ^ partial : partial) & 0x7F) == 0) {
+                partial |= (has_prev ? ~prev_mask & 0x80 : 0x80);
+                break;
+            }
+            if (has_prev)
+                partial |= decoder.decode(m_model->delta_prob(level, i, (prev_mask >> i) & 1, partial)) << i;
+            else
+                partial |= decoder.decode(m_model->intra.bit_prob(ctx, i, partial)) << i;
+        }
+        return has_prev ? partial ^ prev_mask : partial;
+    }
+
+    bool decode_node(RangeDecoder &decoder, const int depth, const size_t prev_begin, const size_t prev_end,
+                     const bool has_prev, const uint16_t ctx, const key_type prefix) {
+        if (!decoder.valid()) return false;
+        const int level = model_type::level(depth);
+        if (has_prev && decoder.decode(m_model->same[level])) {
+            m_cur.insert(m_cur.end(), m_prev.begin() + prev_begin, m_prev.begin() + prev_end);
+            return true;
+        }
+        size_t prev[9];
+        const byte prev_mask = has_prev ? model_type::split(m_prev.data(), prev_begin, prev_end, depth, prev) : 0;
+        const byte mask = decode_mask(decoder, level, ctx, has_prev, prev_mask);
+        for (unsigned int m = mask; m; m &= m - 1) {
+            const int o = __builtin_ctz(m);
+            const key_type child = prefix | (key_type)o << depth;
+            if (depth == 0) {
+                m_cur.push_back(child);
+                continue;
+            }
+            const bool child_prev = (prev_mask >> o) & 1;
+            if (!decode_node(decoder, depth - 3, child_prev ? prev[o] : 0, child_prev ? prev[o + 1] : 0,
+                             child_prev, mask << 3 | o, child))
+                return false;
+        }
+        return true;
+    }
+
+public:
+    // Decodes the next frame; its distinct points, in Morton order, are then available from points().
+    // Returns false on a malformed frame, after which the decoder must be reset.
+    bool decode(const bytestream &frame) {
+        RangeDecoder decoder(frame);
+        m_cur.clear();
+        const bool empty = decoder.decode(m_model->empty);
+        if ((!empty && !decode_node(decoder, morton<Bits>::top_depth, 0, m_prev.size(), !m_prev.empty(), 0, 0)) ||
+            !decoder.valid()) {
+            std::cout << "malformed sequence frame" << '\n';
+            return false;
+        }
+        m_prev.swap(m_cur);
+        m_points.resize(m_prev.size());
+        morton<Bits>::decode_keys(m_prev.data(), m_prev.size(), m_points.data());
+        return true;
+    }
+
+    const std::vector<point>& points() const { return m_points; }
+
+    void reset() {
+        m_prev.clear();
+        *m_model = model_type();
+    }
+};
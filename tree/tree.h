@@ -4,6 +4,9 @@
 #define likely(x)       __builtin_expect((x), 1)
 #define unlikely(x)     __builtin_expect((x), 0)
 
+#include <iostream>
+#include <cstring>
+#include <cstddef>
 #include <unordered_set>
 #include <set>
 #include <iomanip>
@@ -12,14 +15,16 @@
 #include <algorithm>
 #include <vector>
 #include <queue>
+#include <deque>
+#include <tuple>
 #include "interleave.h"
+#include "../thread_pool.h"
 
 using byte = uint8_t;
 using coord = uint32_t;
 using point = std::array<coord, 3>;
 using bytestream = std::vector<byte>;
 using bitstream = std::vector<byte>;
-using stream_istate = std::pair<byte, int>;
 
 uint64_t interleave(const point &arr) {
     return _interleave(arr[0], arr[1], arr[2]);
@@ -52,65 +57,180 @@ bool validByteStream(const bytestream &stream, const bitstream& bitstream) {
     return stream_it == stream.cend();
 }
 
-inline void bitstream_append(bitstream &bit_stream, stream_istate& state, const uint64_t val, int num_bits) {
-    if (state.second + num_bits <= 8) {
-        state.first = (state.first << num_bits) | val;
-        state.second += num_bits;
-        if (state.second == 8) {
-            bit_stream.push_back(state.first);
-            state.first = 0;
-            state.second = 0;
-        }
-    } else {
-        const int first_amt = 8 - state.second;
-        byte to_write = (state.first << first_amt) | (val >> (num_bits - first_amt));
-        bit_stream.push_back(to_write);
-        num_bits -= first_amt;
-        while (num_bits >= 8) {
-            to_write = val >> (num_bits - 8);
-            bit_stream.push_back(to_write);
-            num_bits -= 8;
-        }
-        state.first = val & ((1 << num_bits) - 1);
-        state.second = num_bits;
+// Appends bits to a bitstream, most significant bit first. Bits collect in a 64-bit accumulator
+// and are stored a whole (big-endian) word at a time into spare capacity at the end of the
+// stream; finish() writes out the final partial word, zero-padding the last byte.
+class bitstream_writer {
+    bitstream& m_out;
+    size_t m_size;          // Bytes of m_out actually written
+    uint64_t m_acc = 0;     // Pending bits, left-aligned
+    int m_bits = 0;         // Number of pending bits, < 64
+
+    void store(const uint64_t word) {
+        if (unlikely(m_out.size() < m_size + 8))
+            m_out.resize(std::max<size_t>(2 * m_out.size(), m_size + 64));
+        const uint64_t be = __builtin_bswap64(word);
+        std::memcpy(m_out.data() + m_size, &be, 8);
+        m_size += 8;
+    }
+
+public:
+    explicit bitstream_writer(bitstream& out, const size_t expected_bytes = 0): m_out(out), m_size(out.size()) {
+        m_out.resize(m_size + expected_bytes + 8);
+    }
+    bitstream_writer(const bitstream_writer&) = delete;
+    ~bitstream_writer() { finish(); }
+
+    // Hands every completed byte to sink(data, size) and drops them from the stream, keeping the
+    // pending bits. Lets a caller stream output out without holding all of it.
+    template <typename Sink>
+    void drain(Sink&& sink) {
+        sink(m_out.data(), m_size);
+        m_size = 0;
+    }
+
+    // Appends the low num_bits (<= 64) bits of val, which must be zero above them.
+    void write(const uint64_t val, const int num_bits) {
+        if (m_bits + num_bits < 64) {
+            m_acc |= num_bits ? val << (64 - m_bits - num_bits) : 0;
+            m_bits += num_bits;
+            return;
+        }
+        // Fill the accumulator to exactly 64 bits, store it, and keep what's left over.
+        const int rest = m_bits + num_bits - 64;
+        store(m_acc | (val >> rest));
+        m_acc = rest ? val << (64 - rest) : 0;
+        m_bits = rest;
     }
+
+    // Writes out the pending bits and trims the stream to its final size. Idempotent.
+    void finish() {
+        if (m_out.size() < m_size + 8)
+            m_out.resize(m_size + 8);
+        for (; m_bits > 0; m_bits -= 8) {
+            m_out[m_size++] = m_acc >> 56;
+            m_acc <<= 8;
+        }
+        m_bits = 0;
+        m_out.resize(m_size);
+    }
+};
+
+// Number of bits per axis a leaf at `depth` has left to store: its ancestors already fixed bits
+// [depth + 3, 48) of the key, so (depth + 3) / 3 bits of each coordinate remain.
+constexpr int leaf_bits(const int depth) {
+    return (depth + 3) / 3;
 }
 
-inline void encode_leaf(bitstream &bit_stream, stream_istate& state, const int depth, const uint64_t val) {
-    uint16_t x, y, z;
-    _unpack(val, x, y, z);
-    const uint64_t mask = (1LL << depth) - 1;
+// Leaves are stored as the remaining low bits of x, then y, then z, most significant bit first.
+template <int Bits = 16>
+inline void encode_leaf(bitstream_writer &writer, const int depth, const uint64_t val) {
+    const int bits = leaf_bits(depth);
+    if (bits == 0) return;
+    uint32_t x, y, z;
+    morton<Bits>::decode(val, x, y, z);
+    const uint64_t mask = (1ULL << bits) - 1;
     uint64_t value = 0;
-    value = (value << depth) | (x & mask);
-    value = (value << depth) | (y & mask);
-    value = (value << depth) | (z & mask);
-    bitstream_append(bit_stream, state, value, 3 * depth);
+    value = (value << bits) | (x & mask);
+    value = (value << bits) | (y & mask);
+    value = (value << bits) | (z & mask);
+    writer.write(value, 3 * bits);
 }
 
+// Packs the residuals of n leaves that all sit at `depth`, e.g. one level of a BFS, in one call.
+template <int Bits = 16, typename Key>
+inline void encode_leaves(bitstream_writer &writer, const int depth, const Key* keys, const size_t n) {
+    const int bits = leaf_bits(depth);
+    if (bits == 0) return;
+    const uint64_t mask = (1ULL << bits) - 1;
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t x, y, z;
+        morton<Bits>::decode(keys[i], x, y, z);
+        writer.write((x & mask) << (2 * bits) | (y & mask) << bits | (z & mask), 3 * bits);
+    }
+}
+
+// Reads back what bitstream_writer wrote, most significant bit first. The accumulator is refilled
+// a whole word at a time while at least eight bytes remain.
+class bitstream_reader {
+    const byte* m_data;
+    size_t m_size, m_pos = 0;
+    uint64_t m_acc = 0;     // Buffered bits, left-aligned
+    int m_bits = 0;         // Number of valid buffered bits
+    uint64_t m_consumed = 0;
+
+    void refill() {
+        if (likely(m_pos + 8 <= m_size)) {
+            uint64_t word;
+            std::memcpy(&word, m_data + m_pos, 8);
+            // Bits below m_bits + 8 * (bytes consumed) are reloaded next time; they're identical.
+            m_acc |= __builtin_bswap64(word) >> m_bits;
+            m_pos += (63 - m_bits) >> 3;
+            m_bits |= 56;
+        } else {
+            for (; m_bits <= 56; m_bits += 8, ++m_pos)
+                m_acc |= (uint64_t)(m_pos < m_size ? m_data[m_pos] : 0) << (56 - m_bits);
+        }
+    }
+
+public:
+    explicit bitstream_reader(const bitstream& bit_stream): m_data(bit_stream.data()), m_size(bit_stream.size()) {}
+
+    // Reads num_bits <= 56 bits. Reading past the end yields zeros.
+    uint64_t read(const int num_bits) {
+        if (num_bits == 0) return 0;
+        if (m_bits < num_bits) refill();
+        const uint64_t val = m_acc >> (64 - num_bits);
+        m_acc <<= num_bits;
+        m_bits -= num_bits;
+        m_consumed += num_bits;
+        return val;
+    }
+
+    // Repositions the reader at an absolute bit offset.
+    void seek(const uint64_t bit) {
+        m_pos = bit >> 3;
+        m_acc = 0;
+        m_bits = 0;
+        m_consumed = bit;
+        if (const int skip = bit & 7) {
+            refill();
+            m_acc <<= skip;
+            m_bits -= skip;
+        }
+    }
+
+    // Whether every read so far was backed by real data.
+    bool valid() const { return m_consumed <= 8 * m_size; }
+};
+
+// The encoders below are templated on the number of bits per axis (see morton<Bits>): narrower
+// grids use narrower keys and shallower trees. The default matches the original 16-bit format.
+template <int Bits = 16>
 std::pair<bytestream, bitstream> stdSortStream(const std::vector<point> &points) noexcept {
+    using key_type = typename morton<Bits>::key_type;
     bytestream bfs_stream;
     bfs_stream.reserve(2 * points.size()); // An upper bound for the memory usage.
     bitstream bit_stream;
-    stream_istate bit_stream_state{0, 0};
 
     // Interleave the bits
-    uint64_t *interleaved = new uint64_t[points.size()];
-    std::transform(points.begin(), points.end(), interleaved, &interleave);
+    key_type *interleaved = new key_type[points.size()];
+    morton<Bits>::encode_points(points.data(), points.size(), interleaved);
     // Sort and remove duplicates: now the elements, interpreted as octal literals, are in leaf-DFS order.
     std::sort(interleaved, interleaved + points.size()); 
     const int num_unique = std::unique(interleaved, interleaved + points.size()) - interleaved;
-    bit_stream.reserve(num_unique * 12);
+    bitstream_writer bit_writer(bit_stream, (3 * Bits * (size_t)num_unique + 7) / 8);
     
     // We instantiate a queue, holding elements of the form [lower, upper) and a bit depth to start looking for the octant
-    // In particular, we've concluded that the bits [depth + 3 .. 45] are identical for all elements in [lower, upper).
+    // In particular, we've concluded that the bits [depth + 3 .. top_depth + 3) are identical for all elements in [lower, upper).
     std::deque<std::tuple<int, int, int>> pq;
-    pq.emplace_back(0, num_unique, 45);
+    pq.emplace_back(0, num_unique, morton<Bits>::top_depth);
     while (!pq.empty()) {
         const auto [lower, upper, depth] = pq.front(); pq.pop_front();
         // If lower == upper - 1, our range contains a single point, so here's where we encode the leaf (currently just appending (byte)0)
         if (lower == upper - 1) {
             bfs_stream.push_back(0);
-            encode_leaf(bit_stream, bit_stream_state, depth, interleaved[lower]);
+            encode_leaf<Bits>(bit_writer, depth, interleaved[lower]);
             continue;
         }
         // Here's the occupancy mask: the i-th bit corresponds to the existence of the i-th child.
@@ -132,95 +252,367 @@ std::pair<bytestream, bitstream> stdSortStream(const std::vector<point> &points)
         bfs_stream.push_back(mask);
     }
     delete[] interleaved;
+    bit_writer.finish();
     return {bfs_stream, bit_stream};
 }
 
-std::pair<bytestream, bitstream> radixSortStream(const std::vector<point> &points) noexcept {
+// Work queue for radix_bfs. Every node on a BFS level has the same depth and reads from the
+// same array, so a level is just a list of [lower, upper) ranges; keeping the two levels in
+// reusable vectors lets an encoder run frame after frame without reallocating its queue.
+struct BfsQueue {
+    std::vector<std::pair<int, int>> current, next;
+};
+
+// The BFS bucket-sort loop shared by the radix encoders. It processes the subtree of keys in
+// data[which][lower, upper) whose octant bits start at `depth`, calling on_node(depth, mask) for
+// every internal node and on_leaf(depth, key) for every leaf, in BFS order.
+//
+// Because our implementation requires some scratch space, we use two arrays of length n:
+// one of which is the 'data'(interleaved) array, and the other is the scratch array.
+// The `which` boolean indicates which array provides the data; it flips with every level.
+//
+// If `index` is given, index[which][lower, upper) is a payload (e.g. original point positions)
+// that is permuted along with the keys, and a leaf callback that takes
+// on_leaf(depth, key, const uint32_t* indices, int count) receives the payload of the leaf's keys.
+template <typename Key, typename NodeFn, typename LeafFn>
+void radix_bfs(Key* const data[2], int which, const int lower, const int upper, int depth,
+               NodeFn&& on_node, LeafFn&& on_leaf, BfsQueue& pq, uint32_t* const index[2] = nullptr) {
+    // These are counter arrays which are encountered in bucket sorting. 
+    // We have 8 buckets and thus need 8 counters.
+    int cnts[8], offsets[8];
+    pq.current.clear();
+    pq.current.emplace_back(lower, upper);
+    for (; !pq.current.empty(); which = 1 - which, depth -= 3) {
+        pq.next.clear();
+        const Key* interleaved = data[which];
+        Key* scratch = data[1-which];
+        for (const auto& [lower, upper] : pq.current) {
+            const Key representative = interleaved[lower];
+            const auto leaf = [&] {
+                if constexpr (std::is_invocable_v<LeafFn&, int, Key, const uint32_t*, int>)
+                    on_leaf(depth, representative, index[which] + lower, upper - lower);
+                else
+                    on_leaf(depth, representative);
+            };
+
+            // Below the last octant there is nothing left to split: the range is a (possibly repeated) leaf.
+            if (unlikely(depth < 0)) {
+                leaf();
+                continue;
+            }
+
+            for (int i = 0; i < 8; ++i) cnts[i] = 0;
+            int all_same = 1;
+
+            // Count the number of elements in each bucket
+            for (int i = lower; i < upper; ++i) {
+                all_same &= (interleaved[i] == representative);
+                const int oct = (interleaved[i] >> depth) & 7;
+                ++cnts[oct];
+            }
+
+            // If all the elements in our set are the same, this is a leaf.
+            if (unlikely(all_same)) {
+                leaf();
+                continue;
+            }
+
+            // Calculate the bucket offsets and the occupancy byte
+            offsets[0] = lower;
+            byte mask = !!cnts[0];
+            for (int i = 1; i < 8; ++i) { 
+                offsets[i] = offsets[i-1] + cnts[i-1];
+                mask |= (!!cnts[i]) << i;
+            }
+            on_node(depth, mask);
+
+            // Using the bucket offsets, place items into the appropriate slots in the scratch array
+            if (index) {
+                for (int i = lower; i < upper; ++i) {
+                    const int oct = (interleaved[i] >> depth) & 7;
+                    const int idx = offsets[oct]++;
+                    scratch[idx] = interleaved[i];
+                    index[1-which][idx] = index[which][i];
+                }
+            } else {
+                for (int i = lower; i < upper; ++i) {
+                    const int oct = (interleaved[i] >> depth) & 7;
+                    const int idx = offsets[oct]++;
+                    scratch[idx] = interleaved[i];
+                }
+            }
+            // Recurse on the buckets **switching the roles of scratch and data**
+            if (lower != offsets[0])
+                pq.next.emplace_back(lower, offsets[0]);
+            for (int i = 1; i < 8; ++i)
+                if (offsets[i-1] != offsets[i])
+                    pq.next.emplace_back(offsets[i-1], offsets[i]);
+        }
+        pq.current.swap(pq.next);
+    }
+}
+
+template <typename Key, typename NodeFn, typename LeafFn>
+void radix_bfs(Key* const data[2], const int which, const int lower, const int upper, const int depth,
+               NodeFn&& on_node, LeafFn&& on_leaf) {
+    BfsQueue pq;
+    radix_bfs(data, which, lower, upper, depth, on_node, on_leaf, pq);
+}
+
+// Encodes keys that are already interleaved: data[0][0, num_keys) holds them in any order, and
+// data[1] is scratch space of the same length. Both arrays are clobbered.
+template <int Bits = 16>
+std::pair<bytestream, bitstream> radixSortKeys(typename morton<Bits>::key_type* const data[2],
+                                               const int num_keys) noexcept {
+    using key_type = typename morton<Bits>::key_type;
     // Prepare the stream
     bytestream stream;
-    const int num_points = points.size();
     bitstream bit_stream;
-    stream_istate bit_stream_state{0, 0};
+    if (num_keys == 0) return {stream, bit_stream};
+    bitstream_writer bit_writer(bit_stream, (3 * Bits * (size_t)num_keys + 7) / 8);
+
+    stream.reserve(2 * num_keys); // An upper bound for the memory usage
+
+    radix_bfs(data, 0, 0, num_keys, morton<Bits>::top_depth,
+        [&](int, byte mask) { stream.push_back(mask); },
+        [&](int depth, key_type key) {
+            stream.push_back(0);
+            encode_leaf<Bits>(bit_writer, depth, key);
+        });
+
+    // Once the queue is exhausted, the traversal is complete, so the bytestream is finished
+    bit_writer.finish();
+    return {stream, bit_stream};
+}
 
-    stream.reserve(2 * num_points); // An upper bound for the memory usage
-    bit_stream.reserve(12 * num_points);
+template <int Bits = 16>
+std::pair<bytestream, bitstream> radixSortStream(const std::vector<point> &points) noexcept {
+    using key_type = typename morton<Bits>::key_type;
+    const int num_points = points.size();
 
     // Interleave the bits
-    uint64_t* data[2] = {new uint64_t[num_points], new uint64_t[num_points]};
-    std::transform(points.begin(), points.end(), data[0], &interleave);
-    
-    
-    // Because our implementation requires some scratch space, we instantiate two arrays of length n:
-    // one of which is the 'data'(interleaved) array, and the other is the scratch array.
-    // The `which` boolean indicates which array provides the data.
-    // The queue contains tuples (lower, upper, depth) with the same meanings as in stdSortStream.
-    std::deque<std::tuple<int, int, int, int> > pq;
-    // These are counter arrays which are encountered in bucket sorting. 
-    // We have 8 buckets and thus need 8 counters.
-    int cnts[8], offsets[8];
-    pq.emplace_back(0, 0, num_points, 45);
-    while (!pq.empty()) {
-        // Extract information from the queue
-        const auto [which, lower, upper, depth] = pq.front(); pq.pop_front();
-
-        const uint64_t* interleaved = data[which];
-        uint64_t* scratch = data[1-which];
-        
-        for (int i = 0; i < 8; ++i) cnts[i] = 0;
-        const uint64_t representative = interleaved[lower];
-        int all_same = 1;
-        
-        // Count the number of elements in each bucket
-        for (size_t i = lower; i < upper; ++i) {
-            all_same &= (interleaved[i] == representative);
-            const int oct = (interleaved[i] >> depth) & 7;
-            ++cnts[oct];
+    key_type* data[2] = {new key_type[num_points], new key_type[num_points]};
+    morton<Bits>::encode_points(points.data(), num_points, data[0]);
+    auto result = radixSortKeys<Bits>(data, num_points);
+    delete[] data[0];
+    delete[] data[1];
+    return result;
+}
+
+// Per-subtree output of parallelRadixSortStream: the occupancy bytes and leaf keys of one
+// top-level bucket, grouped by level relative to the bucket root.
+template <typename Key = uint64_t>
+struct SubtreeStream {
+    std::vector<bytestream> levels;
+    std::vector<std::vector<Key>> leaves;
+    bool uniform = false; // The bucket holds copies of a single key, i.e. it is a leaf itself.
+};
+
+// Multithreaded radixSortStream. The top `split` levels of the octree (split * 3 key bits) are
+// bucket sorted with a parallel histogram + scatter pass, each of the 8^split buckets is then
+// encoded independently on the pool, and the per-bucket, per-level outputs are stitched back
+// together level by level. Since every level of a BFS is in Morton order, concatenating the
+// buckets' levels in bucket order reproduces the serial streams byte for byte.
+template <int Bits = 16>
+std::pair<bytestream, bitstream> parallelRadixSortStream(const std::vector<point> &points,
+                                                         util::thread_pool &pool) noexcept {
+    using key_type = typename morton<Bits>::key_type;
+    const int num_points = points.size();
+    const int num_threads = pool.size();
+    // Splitting doesn't pay for itself on small inputs (and the serial encoder defines the empty case).
+    if (num_points < (1 << 16) || Bits < 2)
+        return radixSortStream<Bits>(points);
+
+    // Pick enough buckets that work stealing can balance skewed clouds, leaving at least one level
+    // below them.
+    int split = 1;
+    while (split < std::min(4, Bits - 1) && (1 << (3 * split)) < 16 * num_threads) ++split;
+    const int num_buckets = 1 << (3 * split);
+    const int shift = 3 * (Bits - split);
+    const int sub_depth = morton<Bits>::top_depth - 3 * split;
+
+    key_type* data[2] = {new key_type[num_points], new key_type[num_points]};
+
+    // Interleave and histogram the top `split` levels, one chunk per task.
+    const int num_chunks = 4 * num_threads;
+    const int chunk = (num_points + num_chunks - 1) / num_chunks;
+    std::vector<int> hist((size_t)num_chunks * num_buckets, 0);
+    pool.parallel_for(0, num_chunks, 1, [&](size_t lo, size_t hi) {
+        for (size_t c = lo; c < hi; ++c) {
+            const int begin = std::min<int>(c * chunk, num_points), end = std::min<int>(begin + chunk, num_points);
+            int* cnts = &hist[c * num_buckets];
+            morton<Bits>::encode_points(points.data() + begin, end - begin, data[0] + begin);
+            for (int i = begin; i < end; ++i)
+                ++cnts[data[0][i] >> shift];
         }
-    
-        // If all the elements in our set are the same, this is a leaf.
-        if (unlikely(all_same)) {
-            stream.push_back(0);
-            encode_leaf(bit_stream, bit_stream_state, depth, representative);
-            continue;
+    });
+
+    // Exclusive prefix sums, bucket-major, so each chunk knows where to scatter.
+    std::vector<int> bucket_start(num_buckets + 1);
+    int total = 0;
+    for (int b = 0; b < num_buckets; ++b) {
+        bucket_start[b] = total;
+        for (int c = 0; c < num_chunks; ++c) {
+            const int cnt = hist[(size_t)c * num_buckets + b];
+            hist[(size_t)c * num_buckets + b] = total;
+            total += cnt;
         }
-        
-        // Calculate the bucket offsets and the occupancy byte
-        offsets[0] = lower;
-        byte mask = !!cnts[0];
-        for (int i = 1; i < 8; ++i) { 
-            offsets[i] = offsets[i-1] + cnts[i-1];
-            mask |= (!!cnts[i]) << i;
-        }
-        stream.push_back(mask);
-
-        // NOTE: This will need to be changed to accomodate a different formatting of leaves.
-        if (depth == 0) {
-            for (int i = 0; i < 7; ++i) {
-                if (cnts[i])
-                    pq.emplace_back(1-which, offsets[i], offsets[i+1], 0); // Placeholder for a leaf.
+    }
+    bucket_start[num_buckets] = total;
+
+    pool.parallel_for(0, num_chunks, 1, [&](size_t lo, size_t hi) {
+        for (size_t c = lo; c < hi; ++c) {
+            const int begin = std::min<int>(c * chunk, num_points), end = std::min<int>(begin + chunk, num_points);
+            int* offsets = &hist[c * num_buckets];
+            for (int i = begin; i < end; ++i)
+                data[1][offsets[data[0][i] >> shift]++] = data[0][i];
+        }
+    });
+
+    // Encode every non-empty bucket as an independent subtree.
+    std::vector<SubtreeStream<key_type>> subtrees(num_buckets);
+    for (int b = 0; b < num_buckets; ++b) {
+        if (bucket_start[b] == bucket_start[b + 1]) continue;
+        pool.submit([&, b] {
+            SubtreeStream<key_type>& sub = subtrees[b];
+            const auto level = [&](int depth) {
+                const size_t l = (sub_depth - depth) / 3;
+                if (l >= sub.levels.size()) {
+                    sub.levels.resize(l + 1);
+                    sub.leaves.resize(l + 1);
+                }
+                return l;
+            };
+            radix_bfs(data, 1, bucket_start[b], bucket_start[b + 1], sub_depth,
+                [&](int depth, byte mask) { sub.levels[level(depth)].push_back(mask); },
+                [&](int depth, key_type key) {
+                    const size_t l = level(depth);
+                    sub.levels[l].push_back(0);
+                    sub.leaves[l].push_back(key);
+                    if (l == 0) sub.uniform = true;
+                });
+        });
+    }
+    pool.wait();
+
+    // Rebuild the top `split` levels from the bucket counts. uniform[l][p] says whether node p on
+    // level l is a leaf, i.e. it has exactly one non-empty bucket below it and that bucket is uniform.
+    std::vector<std::vector<int>> count(split + 1), uniform(split + 1);
+    count[split].resize(num_buckets);
+    uniform[split].resize(num_buckets);
+    for (int b = 0; b < num_buckets; ++b) {
+        count[split][b] = bucket_start[b + 1] - bucket_start[b];
+        uniform[split][b] = subtrees[b].uniform;
+    }
+    for (int l = split; l-->0; ) {
+        const int n = 1 << (3 * l);
+        count[l].assign(n, 0);
+        uniform[l].assign(n, 0);
+        for (int p = 0; p < n; ++p) {
+            int occupied = 0, child = 0;
+            for (int i = 0; i < 8; ++i) {
+                if (count[l + 1][8 * p + i]) { ++occupied; child = 8 * p + i; }
+                count[l][p] += count[l + 1][8 * p + i];
             }
-            if (cnts[7])
-                pq.emplace_back(1-which, offsets[7], upper, 0);
-            continue;
+            uniform[l][p] = occupied == 1 && uniform[l + 1][child];
         }
+    }
 
-        // Using the bucket offsets, place items into the appropriate slots in the scratch array
-        for (int i = lower; i < upper; ++i) {
-            const int oct = (interleaved[i] >> depth) & 7;
-            const int idx = offsets[oct]++;
-            scratch[idx] = interleaved[i];
-        }
-        // Recurse on the buckets **switching the roles of scratch and data**
-        if (lower != offsets[0])
-            pq.emplace_back(1-which, lower, offsets[0], depth - 3);
-        for (int i = 1; i < 8; ++i)
-            if (offsets[i-1] != offsets[i])
-                pq.emplace_back(1-which, offsets[i-1], offsets[i], depth - 3);
-    
+    bytestream stream;
+    bitstream bit_stream;
+    bitstream_writer bit_writer(bit_stream, (3 * Bits * (size_t)num_points + 7) / 8);
+    stream.reserve(2 * num_points);
+
+    // Emit the top levels. live[p] tracks whether node p on the current level is reached by the BFS.
+    std::vector<char> live{1}, next_live;
+    for (int l = 0; l < split; ++l) {
+        const int n = 1 << (3 * l);
+        const int depth = morton<Bits>::top_depth - 3 * l;
+        next_live.assign(8 * n, 0);
+        for (int p = 0; p < n; ++p) {
+            if (!live[p] || !count[l][p]) continue;
+            if (uniform[l][p]) {
+                // Any key below p will do: they are all the same.
+                int b = p << (3 * (split - l));
+                while (!count[split][b]) ++b;
+                stream.push_back(0);
+                encode_leaf<Bits>(bit_writer, depth, data[1][bucket_start[b]]);
+                continue;
+            }
+            byte mask = 0;
+            for (int i = 0; i < 8; ++i) {
+                if (count[l + 1][8 * p + i]) {
+                    mask |= 1 << i;
+                    next_live[8 * p + i] = 1;
+                }
+            }
+            stream.push_back(mask);
+        }
+        live.swap(next_live);
+    }
+
+    // Stitch the subtrees together, level by level.
+    size_t num_levels = 0;
+    for (int b = 0; b < num_buckets; ++b)
+        if (live[b]) num_levels = std::max(num_levels, subtrees[b].levels.size());
+    for (size_t l = 0; l < num_levels; ++l) {
+        for (int b = 0; b < num_buckets; ++b) {
+            if (!live[b] || l >= subtrees[b].levels.size()) continue;
+            const SubtreeStream<key_type>& sub = subtrees[b];
+            stream.insert(stream.end(), sub.levels[l].begin(), sub.levels[l].end());
+            encode_leaves<Bits>(bit_writer, sub_depth - 3 * (int)l, sub.leaves[l].data(), sub.leaves[l].size());
+        }
     }
+
     delete[] data[0];
     delete[] data[1];
-    // Once the queue is exhausted, the traversal is complete, so the bytestream is finished
-    return {stream, {}};
-}       
+    bit_writer.finish();
+    return {stream, bit_stream};
+}
 
+// Rebuilds the (deduplicated) points of an encoded cloud, in BFS leaf order. Rather than pointer
+// nodes, each level is a flat array of key prefixes: a node's children extend its prefix by one
+// octant, and a leaf's prefix is completed with its residual bits from the bitstream. All leaf
+// keys are converted back to coordinates in one batch at the end.
+template <int Bits = 16>
+std::vector<point> decodeStream(const bytestream &stream, const bitstream &bit_stream) {
+    using key_type = typename morton<Bits>::key_type;
+    // An empty cloud encodes as two empty streams.
+    if (stream.empty()) return {};
+    std::vector<key_type> level{0}, next, keys;
+    level.reserve(stream.size());
+    next.reserve(stream.size());
+    keys.reserve(stream.size());
+    bitstream_reader reader(bit_stream);
+    auto stream_it = stream.cbegin();
+    for (int depth = morton<Bits>::top_depth; !level.empty(); depth -= 3) {
+        if (unlikely(stream.cend() - stream_it < (ptrdiff_t)level.size())) {
+            std::cout << "stream too short" << '\n';
+            return {};
+        }
+        const int bits = leaf_bits(depth);
+        next.clear();
+        for (const key_type prefix : level) {
+            const byte mask = *stream_it++;
+            if (!mask) {
+                const uint32_t x = reader.read(bits), y = reader.read(bits), z = reader.read(bits);
+                keys.push_back(prefix | morton<Bits>::encode(x, y, z));
+                continue;
+            }
+            if (unlikely(depth < 0)) {
+                std::cout << "stream too deep" << '\n';
+                return {};
+            }
+            for (unsigned int m = mask; m; m &= m - 1)
+                next.push_back(prefix | (key_type)__builtin_ctz(m) << depth);
+        }
+        level.swap(next);
+    }
+    if (stream_it != stream.cend() || !reader.valid()) {
+        std::cout << "stream has trailing data or bitstream too short" << '\n';
+        return {};
+    }
+    std::vector<point> points(keys.size());
+    morton<Bits>::decode_keys(keys.data(), keys.size(), points.data());
+    return points;
+}